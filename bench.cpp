@@ -0,0 +1,581 @@
+// Benchmarks for the Hybrid pipeline.
+// Build: g++ -O2 -std=c++17 bench.cpp lexer.cpp parsers.cpp interpreter.cpp -o bench
+#include <sys/resource.h>
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <regex>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include "interpreter.h"
+#include "lexer.h"
+#include "parser.h"
+#include "ir.h"
+#include "iropt.h"
+#include "jit.h"
+#include "regir.h"
+#include "ssa.h"
+using namespace std;
+
+// Generate a toy-language source of roughly `bytes` bytes
+static string generateSource(size_t bytes) {
+    string src;
+    src.reserve(bytes + 256);
+    for (int i = 0; src.size() < bytes; ++i) {
+        string v = "var_" + to_string(i);
+        src += "// block " + to_string(i) + "\n";
+        src += v + " = " + to_string(i % 97) + ";\n";
+        src += "while (" + v + " < " + to_string(i % 97 + 10) + ") {\n";
+        src += "    if (" + v + " == 3) { total = total + " + v + " * 2; } else { total = total - 1; }\n";
+        src += "    " + v + " = " + v + " + 1;\n";
+        src += "}\n";
+        src += "print " + v + ";\n";
+    }
+    return src;
+}
+
+// Kind of a keyword, operator or separator spelling
+static TokenKind spellingKind(string_view text) {
+    static const pair<string_view, TokenKind> table[] = {
+        {"if", TokenKind::KW_IF}, {"else", TokenKind::KW_ELSE}, {"while", TokenKind::KW_WHILE},
+        {"for", TokenKind::KW_FOR}, {"return", TokenKind::KW_RETURN}, {"print", TokenKind::KW_PRINT},
+        {"int", TokenKind::KW_INT}, {"float", TokenKind::KW_FLOAT}, {"char", TokenKind::KW_CHAR},
+        {"void", TokenKind::KW_VOID}, {"bool", TokenKind::KW_BOOL},
+        {"+", TokenKind::PLUS}, {"-", TokenKind::MINUS}, {"*", TokenKind::STAR},
+        {"/", TokenKind::SLASH}, {"=", TokenKind::ASSIGN}, {"==", TokenKind::EQ},
+        {"!=", TokenKind::NE}, {"<", TokenKind::LT}, {">", TokenKind::GT},
+        {"<=", TokenKind::LE}, {">=", TokenKind::GE}, {"(", TokenKind::LPAREN},
+        {")", TokenKind::RPAREN}, {"{", TokenKind::LBRACE}, {"}", TokenKind::RBRACE},
+        {"[", TokenKind::LBRACKET}, {"]", TokenKind::RBRACKET}, {",", TokenKind::COMMA},
+        {";", TokenKind::SEMICOLON}
+    };
+    for (const auto& [spelling, kind] : table) {
+        if (spelling == text) return kind;
+    }
+    return TokenKind::UNKNOWN;
+}
+
+// The std::regex tokenizer the scanner replaced, kept as the baseline
+static vector<Token> tokenizeRegex(string_view code) {
+    vector<Token> tokens;
+    int lineNumber = 0;
+
+    regex keywordRegex("\\b(if|else|while|for|return|print|int|float|char|void|bool)\\b");
+    regex identifierRegex("[a-zA-Z_][a-zA-Z0-9_]*");
+    regex numberRegex("\\b\\d+(\\.\\d+)?\\b");
+    regex operatorRegex("==|!=|<=|>=|[+\\-*/=<>]");
+    regex separatorRegex("[\\(\\)\\{\\}\\[\\],;]");
+    regex stringLiteralRegex("\"(\\\\.|[^\"])*\"");
+    regex commentRegex("//.*");
+
+    const char* lineStart = code.data();
+    const char* const end = lineStart + code.size();
+    while (lineStart < end) {
+        lineNumber++;
+        const char* lineEnd = lineStart;
+        while (lineEnd < end && *lineEnd != '\n') ++lineEnd;
+        const char* searchStart = lineStart;
+
+        while (searchStart != lineEnd) {
+            cmatch match;
+            auto view = [&]() { return string_view(match[0].first, match.length()); };
+
+            if (regex_search(searchStart, lineEnd, match, commentRegex) && match.position() == 0) {
+                tokens.push_back({TokenType::COMMENT, view(), lineNumber, TokenKind::COMMENT});
+                break;
+            }
+            else if (regex_search(searchStart, lineEnd, match, keywordRegex) && match.position() == 0) {
+                tokens.push_back({TokenType::KEYWORD, view(), lineNumber, spellingKind(view())});
+            }
+            else if (regex_search(searchStart, lineEnd, match, identifierRegex) && match.position() == 0) {
+                tokens.push_back({TokenType::IDENTIFIER, view(), lineNumber, TokenKind::IDENTIFIER});
+            }
+            else if (regex_search(searchStart, lineEnd, match, numberRegex) && match.position() == 0) {
+                tokens.push_back({TokenType::NUMBER, view(), lineNumber, TokenKind::NUMBER});
+            }
+            else if (regex_search(searchStart, lineEnd, match, operatorRegex) && match.position() == 0) {
+                tokens.push_back({TokenType::OPERATOR, view(), lineNumber, spellingKind(view())});
+            }
+            else if (regex_search(searchStart, lineEnd, match, separatorRegex) && match.position() == 0) {
+                tokens.push_back({TokenType::SEPARATOR, view(), lineNumber, spellingKind(view())});
+            }
+            else if (regex_search(searchStart, lineEnd, match, stringLiteralRegex) && match.position() == 0) {
+                tokens.push_back({TokenType::STRING_LITERAL, view(), lineNumber, TokenKind::STRING_LITERAL});
+            }
+            else if (isspace(*searchStart)) {
+                ++searchStart;
+                continue;
+            }
+            else {
+                tokens.push_back({TokenType::UNKNOWN, string_view(searchStart, 1), lineNumber, TokenKind::UNKNOWN});
+                ++searchStart;
+                continue;
+            }
+
+            searchStart += match.length();
+        }
+        lineStart = lineEnd + 1;
+    }
+
+    return tokens;
+}
+
+template <typename F>
+static double timeMs(F&& f) {
+    auto start = chrono::steady_clock::now();
+    f();
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+static bool sameTokens(const vector<Token>& a, const vector<Token>& b) {
+    if (a.size() != b.size()) return false;
+    for (size_t i = 0; i < a.size(); ++i) {
+        if (a[i].type != b[i].type || a[i].value != b[i].value || a[i].lineNumber != b[i].lineNumber)
+            return false;
+    }
+    return true;
+}
+
+static void benchLexer(size_t bytes) {
+    string src = generateSource(bytes);
+    double mb = src.size() / (1024.0 * 1024.0);
+    cout << "=== LEXER: " << mb << " MB source ===\n";
+
+    vector<Token> fast, slow;
+    double fastMs = timeMs([&] { fast = tokenize(src); });
+    double slowMs = timeMs([&] { slow = tokenizeRegex(src); });
+
+    cout << "scanner: " << fast.size() << " tokens in " << fastMs << " ms ("
+         << mb / (fastMs / 1000.0) << " MB/s)\n";
+    cout << "regex:   " << slow.size() << " tokens in " << slowMs << " ms ("
+         << mb / (slowMs / 1000.0) << " MB/s)\n";
+    cout << "speedup: " << slowMs / fastMs << "x\n";
+    cout << "tokens match: " << (sameTokens(fast, slow) ? "yes" : "NO") << "\n";
+}
+
+// Loop-heavy programs modelled on test2.cpp (countdown loop) and
+// test3.cpp (Fibonacci), scaled to `iterations` and kept overflow free
+static string loopProgram(long iterations) {
+    return "x = " + to_string(iterations) + ";\n"
+           "fact = 1;\n"
+           "while (x > 0) {\n"
+           "    fact = fact * 3 - fact * 2;\n"
+           "    x = x - 1;\n"
+           "}\n"
+           "print fact;\n";
+}
+
+static string fibProgram(long iterations) {
+    return "a = 0;\nb = 1;\ncount = 0;\nnext = 0;\nn = " + to_string(iterations) + ";\n"
+           "while (count < n) {\n"
+           "    next = a + b;\n"
+           "    if (next > 1000000) { next = next - 1000000; }\n"
+           "    a = b;\n"
+           "    b = next;\n"
+           "    count = count + 1;\n"
+           "}\n"
+           "print a;\n";
+}
+
+static LinkedProgram buildLinked(const string& src) {
+    auto tokens = tokenize(src);
+    Parser parser(tokens);
+    AST ast = parser.parse();
+    IRProgram ir;
+    int labelCount = 0;
+    compileAST(ast, ir, labelCount);
+    return linkIR(ir);
+}
+
+static void benchDispatch(const char* name, const string& src) {
+    LinkedProgram prog = buildLinked(src);
+    IRVM vm;
+    ostringstream switchOut, threadedOut;
+    double switchMs, threadedMs;
+    {
+        OutputWriter out(switchOut);
+        VMState state;
+        state.prepare(prog);
+        Budget budget;
+        switchMs = timeMs([&] { vm.runSwitch(prog, state, out, budget); });
+    }
+#if HYBRID_COMPUTED_GOTO
+    {
+        OutputWriter out(threadedOut);
+        VMState state;
+        state.prepare(prog);
+        Budget budget;
+        threadedMs = timeMs([&] { vm.runThreaded(prog, state, out, budget); });
+    }
+#else
+    threadedMs = switchMs;
+    threadedOut << switchOut.str();
+#endif
+    cout << name << ": switch " << switchMs << " ms, threaded " << threadedMs << " ms, speedup "
+         << switchMs / threadedMs << "x, output " << (switchOut.str() == threadedOut.str() ? "matches" : "DIFFERS")
+         << "\n";
+    JITCode jit;
+    if (jit.compile(prog)) {
+        ostringstream jitOut;
+        double jitMs;
+        {
+            OutputWriter out(jitOut);
+            jitMs = timeMs([&] { jit.run(out); });
+        }
+        cout << name << ": jit " << jitMs << " ms, speedup over switch " << switchMs / jitMs
+             << "x, output " << (jitOut.str() == switchOut.str() ? "matches" : "DIFFERS") << "\n";
+    }
+}
+
+// Register VM on the direct AST translation vs. the SSA-optimized one
+static void benchRegisters(const char* name, const string& src) {
+    auto tokens = tokenize(src);
+    AST ast = Parser(tokens).parse();
+    RegProgram direct = compileToRegisters(ast);
+    RegProgram ssa = compileSSA(ast);
+    RegVM vm;
+    ostringstream directOut, ssaOut;
+    double directMs, ssaMs;
+    {
+        OutputWriter out(directOut);
+        directMs = timeMs([&] { vm.run(direct, out); });
+    }
+    {
+        OutputWriter out(ssaOut);
+        ssaMs = timeMs([&] { vm.run(ssa, out); });
+    }
+    cout << name << ": register " << directMs << " ms (" << direct.code.size() << " instr), ssa "
+         << ssaMs << " ms (" << ssa.code.size() << " instr), speedup " << directMs / ssaMs
+         << "x, output " << (directOut.str() == ssaOut.str() ? "matches" : "DIFFERS") << "\n";
+}
+
+static void benchVM(long iterations) {
+    cout << "=== VM DISPATCH: " << iterations << " iterations ===\n";
+#if !HYBRID_COMPUTED_GOTO
+    cout << "(computed goto unavailable; both columns use the switch loop)\n";
+#endif
+    benchDispatch("loop (test2)", loopProgram(iterations));
+    benchDispatch("fib  (test3)", fibProgram(iterations));
+    cout << "=== REGISTER VM: " << iterations << " iterations ===\n";
+    benchRegisters("loop (test2)", loopProgram(iterations));
+    benchRegisters("fib  (test3)", fibProgram(iterations));
+}
+
+// ---------------------------------------------------------------------------
+// Stage suite: every pipeline stage timed on its own over scalable
+// workloads, with optional JSON output and a baseline check.
+// ---------------------------------------------------------------------------
+
+// Operands are variables so -O1 cannot fold the trees away. Products only
+// at the bottom level keep every value well inside int range.
+static void appendTree(string& src, int depth, int& leaf) {
+    if (depth == 0) {
+        src += "abc"[leaf++ % 3];
+        return;
+    }
+    src += "(";
+    appendTree(src, depth - 1, leaf);
+    src += depth == 1 ? " * " : depth % 2 ? " + " : " - ";
+    appendTree(src, depth - 1, leaf);
+    src += ")";
+}
+
+// Balanced trees for size, plus one right-leaning chain for nesting depth
+static string deepExpressions(int scale) {
+    string src = "a = 1;\nb = 2;\nc = 3;\n";
+    int leaf = 0;
+    for (int i = 0; i < 40 * scale; ++i) {
+        src += "t = ";
+        appendTree(src, 12, leaf);
+        src += ";\n";
+    }
+    src += "d = ";
+    for (int i = 0; i < 1000; ++i) src += "(a + ";
+    src += "b";
+    src += string(1000, ')');
+    src += ";\nprint t;\nprint d;\n";
+    return src;
+}
+
+// The division keeps the values bounded however long the chain gets
+static string assignmentChain(int scale) {
+    string src;
+    for (int i = 0; i < 512; ++i) src += "v" + to_string(i) + " = " + to_string(i) + ";\n";
+    for (int i = 512; i < 200000 * scale; ++i) {
+        src += "v" + to_string(i % 512) + " = (v" + to_string((i - 1) % 512) + " + v" +
+               to_string((i + 7) % 512) + " * 3 + " + to_string(i % 7) + ") / 5;\n";
+    }
+    src += "print v0;\n";
+    return src;
+}
+
+static string nestedLoops(int scale) {
+    return "s = 0;\ni = 0;\n"
+           "while (i < " + to_string(1000 * scale) + ") {\n"
+           "    j = 0;\n"
+           "    while (j < 1000) {\n"
+           "        s = i + j - s;\n"
+           "        j = j + 1;\n"
+           "    }\n"
+           "    i = i + 1;\n"
+           "}\n"
+           "print s;\n";
+}
+
+static string largeSource(int scale) {
+    // generateSource's loops update `total`, which the interpreter needs defined
+    return "total = 0;\n" + generateSource((size_t)scale * 4 * 1024 * 1024);
+}
+
+struct StageResult {
+    string workload;
+    string stage;
+    double ms;
+    uint64_t items;
+    const char* unit;
+    long peakRssKb;
+    double rate() const { return ms > 0 ? items / (ms / 1000.0) : 0; }
+};
+
+// Peak resident set size in KB. resetPeakRss() restarts the high-water
+// mark (Linux 4.0+) so each workload reports its own peak; elsewhere the
+// figure is the process-wide peak so far.
+static void resetPeakRss() {
+    if (FILE* f = fopen("/proc/self/clear_refs", "w")) {
+        fputs("5", f);
+        fclose(f);
+    }
+}
+
+static long peakRssKb() {
+    if (FILE* f = fopen("/proc/self/status", "r")) {
+        char line[256];
+        long kb = -1;
+        while (fgets(line, sizeof line, f)) {
+            if (sscanf(line, "VmHWM: %ld kB", &kb) == 1) break;
+        }
+        fclose(f);
+        if (kb >= 0) return kb;
+    }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+// Best of `reps` runs; `setup` runs untimed before each one
+template <typename Setup, typename F>
+static double bestMs(int reps, Setup&& setup, F&& f) {
+    double best = 0;
+    for (int r = 0; r < reps; ++r) {
+        setup();
+        double ms = timeMs(f);
+        if (r == 0 || ms < best) best = ms;
+    }
+    return best;
+}
+
+static void benchStages(const string& name, const string& src, int reps, vector<StageResult>& results) {
+    resetPeakRss();
+    size_t first = results.size();
+    auto none = [] {};
+    auto record = [&](const char* stage, double ms, uint64_t items, const char* unit) {
+        results.push_back({name, stage, ms, items, unit, 0});
+    };
+
+    // Each stage is timed before its item count is read
+    vector<Token> tokens;
+    double ms = bestMs(reps, none, [&] { tokens = tokenize(src); });
+    record("tokenize", ms, tokens.size(), "tokens/s");
+
+    AST parsed;
+    ms = bestMs(reps, none, [&] { parsed = Parser(tokens).parse(); });
+    record("parse", ms, parsed.nodes.size(), "nodes/s");
+
+    AST tree;
+    ms = bestMs(reps, [&] { tree = parsed; }, [&] { optimizeAST(tree, 1); });
+    record("optimize", ms, parsed.nodes.size(), "nodes/s");
+
+    IRProgram ir;
+    int labelCount = 0;
+    ms = bestMs(reps, [&] { ir.instructions.clear(); labelCount = 0; }, [&] { compileAST(tree, ir, labelCount); });
+    record("compile", ms, tree.nodes.size(), "nodes/s");
+    optimizeIR(ir);
+    LinkedProgram prog = linkIR(ir);
+    resolveSlots(tree);
+
+    // Work done by a run: one pass over the program plus the loop iterations
+    // the step budget charged (see budget.h). The interpreter only counts
+    // loop nodes under a step limit, so it is measured once with a limit
+    // that cannot be hit, outside the timed runs.
+    uint64_t evalNodes;
+    {
+        ostringstream sink;
+        OutputWriter out(sink);
+        ExecutionLimits counting;
+        counting.maxSteps = UINT64_MAX / 2;
+        Interpreter<> interp(out, counting);
+        interp.eval(tree);
+        evalNodes = tree.nodes.size() + interp.steps();
+    }
+    {
+        ostringstream sink;
+        ms = bestMs(reps, [&] { sink.str(""); }, [&] {
+            OutputWriter out(sink);
+            Interpreter<> interp(out);
+            interp.eval(tree);
+        });
+        record("eval", ms, evalNodes, "nodes/s");
+    }
+    {
+        ostringstream sink;
+        VMState state;
+        IRVM vm;
+        ms = bestMs(reps, [&] { sink.str(""); state.prepare(prog); }, [&] {
+            OutputWriter out(sink);
+            vm.run(prog, state, out);
+        });
+        record("vm", ms, prog.code.size() + state.steps, "instr/s");
+    }
+
+    long peak = peakRssKb();
+    for (size_t i = first; i < results.size(); ++i) results[i].peakRssKb = peak;
+}
+
+static void printStages(const vector<StageResult>& results) {
+    cout << "=== STAGES ===\n";
+    cout << left << setw(10) << "workload" << setw(10) << "stage" << right << setw(12) << "ms" << setw(14)
+         << "items" << setw(16) << "rate" << "  " << left << setw(10) << "unit" << right << setw(12)
+         << "peak RSS KB" << "\n";
+    cout << fixed;
+    for (const auto& r : results) {
+        cout << left << setw(10) << r.workload << setw(10) << r.stage << right << setw(12)
+             << setprecision(2) << r.ms << setw(14) << r.items << setw(16) << setprecision(0) << r.rate()
+             << "  " << left << setw(10) << r.unit << right << setw(12) << r.peakRssKb << "\n";
+    }
+    cout << defaultfloat << setprecision(6);
+}
+
+// One result per line, so readBaseline() can read it back without a full
+// JSON parser
+static void writeJson(ostream& os, const vector<StageResult>& results) {
+    os << "{\n  \"benchmark\": \"hybrid-stages\",\n  \"results\": [\n";
+    os << fixed;
+    for (size_t i = 0; i < results.size(); ++i) {
+        const auto& r = results[i];
+        os << "    {\"workload\": \"" << r.workload << "\", \"stage\": \"" << r.stage << "\", \"ms\": "
+           << setprecision(3) << r.ms << ", \"items\": " << r.items << ", \"rate\": " << setprecision(1)
+           << r.rate() << ", \"unit\": \"" << r.unit << "\", \"peak_rss_kb\": " << r.peakRssKb << "}"
+           << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    os << defaultfloat << "  ]\n}\n";
+}
+
+static string jsonField(const string& line, const string& key) {
+    string tag = "\"" + key + "\": ";
+    size_t at = line.find(tag);
+    if (at == string::npos) return "";
+    at += tag.size();
+    if (line[at] == '"') {
+        size_t end = line.find('"', at + 1);
+        return line.substr(at + 1, end - at - 1);
+    }
+    size_t end = line.find_first_of(",}", at);
+    return line.substr(at, end - at);
+}
+
+// "workload/stage" -> rate, from a file written by writeJson()
+static map<string, double> readBaseline(const string& path) {
+    ifstream in(path);
+    if (!in) throw runtime_error("Cannot open baseline: " + path);
+    map<string, double> rates;
+    string line;
+    while (getline(in, line)) {
+        string workload = jsonField(line, "workload"), stage = jsonField(line, "stage");
+        string rate = jsonField(line, "rate");
+        if (!workload.empty() && !stage.empty() && !rate.empty()) rates[workload + "/" + stage] = stod(rate);
+    }
+    return rates;
+}
+
+// Returns false when any stage is more than `tolerance` percent slower.
+// Stages under a millisecond are too short to time reliably and are skipped.
+static bool compareBaseline(const vector<StageResult>& results, const map<string, double>& baseline,
+                            double tolerance) {
+    cout << "=== BASELINE (tolerance " << tolerance << "%) ===\n";
+    bool ok = true;
+    cout << fixed << setprecision(1);
+    for (const auto& r : results) {
+        auto it = baseline.find(r.workload + "/" + r.stage);
+        if (it == baseline.end() || it->second <= 0 || r.ms < 1) continue;
+        double change = 100.0 * (r.rate() - it->second) / it->second;
+        bool slower = change < -tolerance;
+        ok = ok && !slower;
+        cout << left << setw(10) << r.workload << setw(10) << r.stage << right << showpos << setw(8) << change
+             << "%" << noshowpos << (slower ? "  SLOWER" : "") << "\n";
+    }
+    cout << defaultfloat << setprecision(6);
+    cout << (ok ? "no regressions\n" : "REGRESSION: stage(s) slower than the baseline\n");
+    return ok;
+}
+
+static int runSuite(int argc, char* argv[]) {
+    int scale = 1, reps = 3;
+    double tolerance = 10;
+    string jsonPath, baselinePath;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        auto value = [&] { return arg.substr(arg.find('=') + 1); };
+        if (arg == "--suite") continue;
+        else if (arg.rfind("--scale=", 0) == 0) scale = max(1, stoi(value()));
+        else if (arg.rfind("--reps=", 0) == 0) reps = max(1, stoi(value()));
+        else if (arg.rfind("--json=", 0) == 0) jsonPath = value();
+        else if (arg.rfind("--baseline=", 0) == 0) baselinePath = value();
+        else if (arg.rfind("--tolerance=", 0) == 0) tolerance = stod(value());
+        else {
+            cerr << "Unknown option: " << arg << "\n";
+            return 2;
+        }
+    }
+
+    vector<StageResult> results;
+    benchStages("deep", deepExpressions(scale), reps, results);
+    benchStages("chain", assignmentChain(scale), reps, results);
+    benchStages("loops", nestedLoops(scale), reps, results);
+    benchStages("large", largeSource(scale), reps, results);
+    printStages(results);
+
+    if (!jsonPath.empty()) {
+        ofstream out(jsonPath);
+        writeJson(out, results);
+        if (!out) {
+            cerr << "Cannot write " << jsonPath << "\n";
+            return 2;
+        }
+    }
+    if (!baselinePath.empty()) {
+        try {
+            if (!compareBaseline(results, readBaseline(baselinePath), tolerance)) return 1;
+        } catch (const exception& e) {
+            cerr << e.what() << "\n";
+            return 2;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc > 1 && string(argv[1]).rfind("--", 0) == 0) return runSuite(argc, argv);
+    size_t megabytes = argc > 1 ? stoul(argv[1]) : 4;
+    long iterations = argc > 2 ? stol(argv[2]) : 5000000;
+    benchLexer(megabytes * 1024 * 1024);
+    benchVM(iterations);
+    return 0;
+}
@@ -0,0 +1,120 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+using namespace std;
+
+// Execution limits shared by the interpreter and the VM. Zero means
+// unlimited.
+//   maxSteps       VM: instructions; interpreter: tree nodes evaluated.
+//                  Both charge a whole loop iteration at once, at the
+//                  backward jump or loop head.
+//   timeout        Wall-clock time per run, checked every Budget::Slice steps
+//   maxStackDepth  VM: operand stack slots; interpreter: tree nesting
+//                  (recursion depth). Checked before the run starts.
+//   maxOutput      print statements per run (embedding API only)
+//   cancel         Stops the run with Cancelled once set, checked with the
+//                  timeout; parallel statements use it to stop the tasks
+//                  after one that failed
+struct ExecutionLimits {
+    uint64_t maxSteps = 0;
+    chrono::milliseconds timeout{0};
+    size_t maxStackDepth = 0;
+    size_t maxOutput = 0;
+    const atomic<bool>* cancel = nullptr;
+};
+
+enum class LimitKind { Steps, Timeout, StackDepth, Output };
+
+inline const char* limitKindName(LimitKind kind) {
+    switch (kind) {
+        case LimitKind::Steps: return "step";
+        case LimitKind::Timeout: return "timeout";
+        case LimitKind::StackDepth: return "stack depth";
+        case LimitKind::Output: return "output";
+    }
+    return "?";
+}
+
+// Thrown when a run hits one of its limits. `limit` and `used` are in the
+// limit's unit (steps, milliseconds, stack slots or prints).
+class LimitExceeded : public runtime_error {
+public:
+    LimitExceeded(LimitKind kind, uint64_t limit, uint64_t used)
+        : runtime_error(string("Execution ") + limitKindName(kind) + " limit exceeded (used " +
+                        to_string(used) + ", limit " + to_string(limit) + ")"),
+          kind(kind), limit(limit), used(used) {}
+
+    LimitKind kind;
+    uint64_t limit;
+    uint64_t used;
+};
+
+// Thrown when a run's cancel flag is set
+class Cancelled : public runtime_error {
+public:
+    Cancelled() : runtime_error("Execution cancelled") {}
+};
+
+// Fuel counter for one run. The engines call charge() only at backward
+// jumps and loop heads; it is a decrement and a compare until the current
+// slice of fuel runs out, and only then are the step total and the clock
+// checked. Without step or time limits or a cancel flag the slice never
+// runs out.
+class Budget {
+public:
+    static constexpr int64_t Slice = 1 << 14;
+
+    explicit Budget(const ExecutionLimits& limits = ExecutionLimits())
+        : limits(limits), start(chrono::steady_clock::now()) {
+        grant();
+    }
+
+    void charge(int64_t cost) {
+        if ((fuel -= cost) < 0) refill();
+    }
+
+    bool limited() const { return limits.maxSteps != 0 || limits.timeout.count() != 0 || limits.cancel; }
+    uint64_t used() const { return spent + (uint64_t)(slice - fuel); }
+
+    void checkStackDepth(size_t depth) const {
+        if (limits.maxStackDepth && depth > limits.maxStackDepth) {
+            throw LimitExceeded(LimitKind::StackDepth, limits.maxStackDepth, depth);
+        }
+    }
+
+private:
+    ExecutionLimits limits;
+    chrono::steady_clock::time_point start;
+    uint64_t spent = 0; // Charged in earlier slices
+    int64_t slice = 0;  // Size of the current slice
+    int64_t fuel = 0;   // Left in the current slice
+
+    void grant() {
+        if (!limited()) {
+            slice = fuel = INT64_MAX;
+            return;
+        }
+        slice = Slice;
+        if (limits.maxSteps) slice = (int64_t)min<uint64_t>(Slice, limits.maxSteps - spent);
+        fuel = slice;
+    }
+
+    void refill() {
+        spent += (uint64_t)(slice - fuel);
+        if (limits.maxSteps && spent > limits.maxSteps) {
+            throw LimitExceeded(LimitKind::Steps, limits.maxSteps, spent);
+        }
+        if (limits.cancel && limits.cancel->load(memory_order_relaxed)) throw Cancelled();
+        if (limits.timeout.count()) {
+            auto elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start);
+            if (elapsed >= limits.timeout) {
+                throw LimitExceeded(LimitKind::Timeout, limits.timeout.count(), elapsed.count());
+            }
+        }
+        grant();
+    }
+};
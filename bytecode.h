@@ -0,0 +1,265 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "ir.h"
+#include "source.h" // HYBRID_MMAP and the POSIX mapping headers
+using namespace std;
+
+// On-disk format for linked bytecode, used to skip lexing, parsing and
+// compiling for scripts that have not changed. Layout (native endianness,
+// every section 4-byte aligned):
+//
+//   BytecodeHeader
+//   constant pool   int32[constCount]
+//   symbol table    uint32 offsets[symbolCount + 1], then the name bytes
+//                   (padded to 4)
+//   code            BytecodeInstr[codeCount]; IMM operands index the
+//                   constant pool, VAR operands the symbol table and LABEL
+//                   operands the code
+//
+// A file is only used if its header matches the source hash, compiler
+// version and optimization level and the payload passes validation.
+
+constexpr uint32_t BYTECODE_MAGIC = 0x43425948; // "HYBC"
+constexpr uint32_t BYTECODE_FORMAT = 1;
+// Bump whenever the compiler, optimizers or opcode set change the code
+// produced for a given source
+constexpr uint32_t COMPILER_VERSION = 2;
+
+struct BytecodeHeader {
+    uint32_t magic;
+    uint32_t format;
+    uint32_t compilerVersion;
+    uint32_t optLevel;
+    uint64_t sourceHash;
+    uint64_t checksum; // Of everything after the header
+    uint32_t constCount;
+    uint32_t symbolCount;
+    uint32_t symbolBytes; // Name bytes, before padding
+    uint32_t codeCount;
+};
+
+struct BytecodeInstr {
+    uint8_t op;
+    uint8_t pad[3];
+    int32_t operand[3];
+};
+
+static_assert(sizeof(BytecodeHeader) == 48, "BytecodeHeader layout");
+static_assert(sizeof(BytecodeInstr) == 16, "BytecodeInstr layout");
+
+// 64-bit FNV-1a
+inline uint64_t hashBytes(const void* data, size_t size, uint64_t hash = 0xcbf29ce484222325ULL) {
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= p[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// Cache file for a source: the name covers everything the code depends on
+inline string bytecodeCachePath(const string& dir, uint64_t sourceHash, int optLevel) {
+    uint64_t key = sourceHash;
+    key = hashBytes(&COMPILER_VERSION, sizeof(COMPILER_VERSION), key);
+    key = hashBytes(&optLevel, sizeof(optLevel), key);
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.hbc", (unsigned long long)key);
+    return dir + "/" + name;
+}
+
+inline vector<char> serializeBytecode(const LinkedProgram& prog, uint64_t sourceHash, int optLevel) {
+    vector<int32_t> pool;
+    unordered_map<int, uint32_t> poolIndex;
+    vector<BytecodeInstr> code;
+    code.reserve(prog.code.size());
+    for (const auto& instr : prog.code) {
+        BytecodeInstr out{};
+        out.op = (uint8_t)instr.op;
+        OperandKinds kinds = operandKinds(instr.op);
+        const int operands[3] = {instr.operand, instr.operand2, instr.operand3};
+        for (int k = 0; k < 3; ++k) {
+            out.operand[k] = operands[k];
+            if (kinds[k] != OperandKind::IMM) continue;
+            auto it = poolIndex.find(operands[k]);
+            if (it == poolIndex.end()) {
+                it = poolIndex.emplace(operands[k], (uint32_t)pool.size()).first;
+                pool.push_back(operands[k]);
+            }
+            out.operand[k] = (int32_t)it->second;
+        }
+        code.push_back(out);
+    }
+
+    vector<uint32_t> offsets{0};
+    string names;
+    for (const auto& name : prog.slotNames) {
+        names += name;
+        offsets.push_back((uint32_t)names.size());
+    }
+    size_t namesPadded = (names.size() + 3) & ~size_t(3);
+
+    BytecodeHeader header{};
+    header.magic = BYTECODE_MAGIC;
+    header.format = BYTECODE_FORMAT;
+    header.compilerVersion = COMPILER_VERSION;
+    header.optLevel = (uint32_t)optLevel;
+    header.sourceHash = sourceHash;
+    header.constCount = (uint32_t)pool.size();
+    header.symbolCount = (uint32_t)prog.slotNames.size();
+    header.symbolBytes = (uint32_t)names.size();
+    header.codeCount = (uint32_t)code.size();
+
+    vector<char> file(sizeof(header));
+    auto append = [&](const void* data, size_t size) {
+        const char* p = static_cast<const char*>(data);
+        file.insert(file.end(), p, p + size);
+    };
+    append(pool.data(), pool.size() * sizeof(int32_t));
+    append(offsets.data(), offsets.size() * sizeof(uint32_t));
+    append(names.data(), names.size());
+    file.resize(file.size() + namesPadded - names.size(), 0);
+    append(code.data(), code.size() * sizeof(BytecodeInstr));
+    header.checksum = hashBytes(file.data() + sizeof(header), file.size() - sizeof(header));
+    memcpy(file.data(), &header, sizeof(header));
+    return file;
+}
+
+// Create the cache directory if needed (one level)
+inline void ensureCacheDir(const string& dir) {
+#if HYBRID_MMAP
+    mkdir(dir.c_str(), 0755);
+#else
+    (void)dir;
+#endif
+}
+
+// Write through a temporary file and rename, so concurrent runs never see
+// a partial file. Returns false if the cache could not be written.
+inline bool writeBytecode(const string& path, const LinkedProgram& prog, uint64_t sourceHash, int optLevel) {
+    vector<char> data = serializeBytecode(prog, sourceHash, optLevel);
+    // Unique per process and thread, so concurrent writers never share a file
+    string tmp = path + ".tmp." + to_string(hash<thread::id>{}(this_thread::get_id()));
+#if HYBRID_MMAP
+    tmp += "." + to_string(getpid());
+#endif
+    {
+        ofstream out(tmp, ios::binary | ios::trunc);
+        if (!out) return false;
+        out.write(data.data(), (streamsize)data.size());
+        if (!out) return false;
+    }
+    if (rename(tmp.c_str(), path.c_str()) != 0) {
+        remove(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Linked code is only safe to run if the operand stack depth is the same on
+// every path into an instruction and never goes negative; the VMs size
+// their stack from the code length and do no checks of their own.
+inline bool verifyStackDepth(const LinkedProgram& prog) {
+    return maxStackDepth(prog) >= 0;
+}
+
+// Decode and validate a cache file image. Returns false on any mismatch.
+inline bool decodeBytecode(const char* data, size_t size, uint64_t sourceHash, int optLevel,
+                           LinkedProgram& prog) {
+    BytecodeHeader header;
+    if (size < sizeof(header)) return false;
+    memcpy(&header, data, sizeof(header));
+    if (header.magic != BYTECODE_MAGIC || header.format != BYTECODE_FORMAT ||
+        header.compilerVersion != COMPILER_VERSION || header.optLevel != (uint32_t)optLevel ||
+        header.sourceHash != sourceHash) {
+        return false;
+    }
+    uint64_t poolBytes = (uint64_t)header.constCount * 4;
+    uint64_t offsetBytes = ((uint64_t)header.symbolCount + 1) * 4;
+    uint64_t namesPadded = ((uint64_t)header.symbolBytes + 3) & ~uint64_t(3);
+    uint64_t codeBytes = (uint64_t)header.codeCount * sizeof(BytecodeInstr);
+    if (sizeof(header) + poolBytes + offsetBytes + namesPadded + codeBytes != size) return false;
+    if (hashBytes(data + sizeof(header), size - sizeof(header)) != header.checksum) return false;
+
+    const char* p = data + sizeof(header);
+    vector<int32_t> pool(header.constCount);
+    memcpy(pool.data(), p, poolBytes);
+    p += poolBytes;
+    vector<uint32_t> offsets(header.symbolCount + 1);
+    memcpy(offsets.data(), p, offsetBytes);
+    p += offsetBytes;
+    const char* names = p;
+    p += namesPadded;
+
+    prog.slotNames.clear();
+    prog.slotNames.reserve(header.symbolCount);
+    for (uint32_t i = 0; i < header.symbolCount; ++i) {
+        if (offsets[i] > offsets[i + 1] || offsets[i + 1] > header.symbolBytes) return false;
+        prog.slotNames.emplace_back(names + offsets[i], offsets[i + 1] - offsets[i]);
+    }
+
+    prog.code.clear();
+    prog.code.reserve(header.codeCount);
+    for (uint32_t i = 0; i < header.codeCount; ++i) {
+        BytecodeInstr in;
+        memcpy(&in, p + (size_t)i * sizeof(in), sizeof(in));
+        if (in.op > (uint8_t)OpCode::HALT) return false;
+        OpCode op = (OpCode)in.op;
+        if (op == OpCode::LABEL) return false;
+        OperandKinds kinds = operandKinds(op);
+        int operands[3];
+        for (int k = 0; k < 3; ++k) {
+            int32_t v = in.operand[k];
+            switch (kinds[k]) {
+                case OperandKind::IMM:
+                    if (v < 0 || (uint32_t)v >= header.constCount) return false;
+                    v = pool[v];
+                    break;
+                case OperandKind::VAR:
+                    if (v < 0 || (uint32_t)v >= header.symbolCount) return false;
+                    break;
+                case OperandKind::LABEL:
+                    if (v < 0 || (uint32_t)v >= header.codeCount) return false;
+                    break;
+                case OperandKind::NONE:
+                    break;
+            }
+            operands[k] = v;
+        }
+        prog.code.push_back({op, operands[0], operands[1], operands[2]});
+    }
+    if (prog.code.empty() || prog.code.back().op != OpCode::HALT) return false;
+    return verifyStackDepth(prog);
+}
+
+// Map a cache file and decode it. Returns false if it is missing or invalid.
+inline bool loadBytecode(const string& path, uint64_t sourceHash, int optLevel, LinkedProgram& prog) {
+#if HYBRID_MMAP
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return false;
+    }
+    size_t size = (size_t)st.st_size;
+    void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return false;
+    bool ok = decodeBytecode(static_cast<const char*>(data), size, sourceHash, optLevel, prog);
+    munmap(data, size);
+    return ok;
+#else
+    ifstream in(path, ios::binary);
+    if (!in) return false;
+    string data((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+    return decodeBytecode(data.data(), data.size(), sourceHash, optLevel, prog);
+#endif
+}
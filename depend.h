@@ -0,0 +1,167 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <utility>
+#include <unordered_map>
+#include <vector>
+#include "parser.h"
+using namespace std;
+
+// Dependence analysis for running the statements of a Block in parallel.
+// Each statement gets the variables it may read and may write (both
+// branches of an if, every iteration of a loop) and a rough cost. Two
+// statements are independent when neither writes a variable the other
+// reads or writes. Prints do not order statements: the engines give every
+// task its own output buffer and replay the buffers in statement order.
+
+// Assumed iterations of a loop, for cost estimates only
+constexpr uint64_t LOOP_TRIPS = 100;
+// Estimated cost (nodes evaluated) from which a statement gets a task
+constexpr uint64_t PARALLEL_THRESHOLD = 100000;
+
+struct StatementEffects {
+    vector<SymbolId> reads;  // Sorted
+    vector<SymbolId> writes; // Sorted
+    uint64_t cost = 0;       // Nodes evaluated, loops counted LOOP_TRIPS times
+};
+
+inline StatementEffects statementEffects(const AST& ast, NodeId stmt) {
+    StatementEffects effects;
+    vector<pair<NodeId, uint64_t>> pending; // Node and how often it runs
+    if (stmt != NO_NODE) pending.push_back({stmt, 1});
+    while (!pending.empty()) {
+        auto [id, weight] = pending.back();
+        pending.pop_back();
+        const ASTNode& node = ast[id];
+        effects.cost = min(effects.cost + weight, UINT64_MAX / 2);
+        auto visit = [&](NodeId child, uint64_t w) {
+            if (child != NO_NODE) pending.push_back({child, w});
+        };
+        switch (node.kind) {
+            case NodeKind::Literal: break;
+            case NodeKind::Identifier: effects.reads.push_back(node.identifier.name); break;
+            case NodeKind::BinaryExpr: visit(node.binary.left, weight); visit(node.binary.right, weight); break;
+            case NodeKind::Assignment:
+                effects.writes.push_back(node.assign.name);
+                visit(node.assign.value, weight);
+                break;
+            case NodeKind::IfStmt:
+                visit(node.ifStmt.cond, weight);
+                visit(node.ifStmt.thenBranch, weight);
+                visit(node.ifStmt.elseBranch, weight);
+                break;
+            case NodeKind::WhileStmt: {
+                uint64_t inner = min(weight * LOOP_TRIPS, UINT64_MAX / 2);
+                visit(node.whileStmt.cond, inner);
+                visit(node.whileStmt.body, inner);
+                break;
+            }
+            case NodeKind::Block:
+                for (NodeId s : ast.statements(node)) visit(s, weight);
+                break;
+            case NodeKind::PrintStmt: visit(node.print, weight); break;
+        }
+    }
+    for (auto* set : {&effects.reads, &effects.writes}) {
+        sort(set->begin(), set->end());
+        set->erase(unique(set->begin(), set->end()), set->end());
+    }
+    return effects;
+}
+
+inline bool intersects(const vector<SymbolId>& a, const vector<SymbolId>& b) {
+    size_t i = 0, j = 0;
+    while (i < a.size() && j < b.size()) {
+        if (a[i] == b[j]) return true;
+        if (a[i] < b[j]) ++i;
+        else ++j;
+    }
+    return false;
+}
+
+inline bool independent(const StatementEffects& a, const StatementEffects& b) {
+    return !intersects(a.writes, b.writes) && !intersects(a.writes, b.reads) && !intersects(b.writes, a.reads);
+}
+
+// Adds `other`'s variables and cost to `into`: the effects of running both
+inline void mergeEffects(StatementEffects& into, const StatementEffects& other) {
+    for (auto [set, more] : {pair{&into.reads, &other.reads}, pair{&into.writes, &other.writes}}) {
+        vector<SymbolId> merged;
+        set_union(set->begin(), set->end(), more->begin(), more->end(), back_inserter(merged));
+        *set = std::move(merged);
+    }
+    into.cost = min(into.cost + other.cost, UINT64_MAX / 2);
+}
+
+// Consecutive statements of a Block that run as parallel tasks. Task i runs
+// statements [i ? ends[i - 1] : first, ends[i]) in order; writes[i] holds
+// the variables it writes (SymbolIds, which are also frame slots).
+struct StatementGroup {
+    uint32_t first;
+    vector<uint32_t> ends;
+    vector<vector<SymbolId>> writes;
+    size_t size() const { return ends.size(); }
+    uint32_t begin(size_t task) const { return task ? ends[task - 1] : first; }
+};
+
+// The groups of one Block. Every task ends with a statement that costs at
+// least `threshold` and takes the cheaper statements before it (the
+// initialization of a loop, say); a group is a run of two or more such
+// tasks that are pairwise independent. The statements outside the groups
+// run in order between them.
+inline vector<StatementGroup> planBlock(const AST& ast, const ASTNode& block, uint64_t threshold) {
+    NodeSpan statements = ast.statements(block);
+    vector<StatementGroup> groups;
+    StatementGroup group{0, {}, {}};
+    vector<StatementEffects> tasks; // Effects of group's tasks
+    auto close = [&] {
+        if (tasks.size() >= 2) groups.push_back(std::move(group));
+        group = StatementGroup{0, {}, {}};
+        tasks.clear();
+    };
+    StatementEffects pending; // Statements since the last task ended
+    uint32_t pendingFirst = 0;
+    for (uint32_t i = 0; i < statements.size(); ++i) {
+        StatementEffects effects = statementEffects(ast, statements.begin()[i]);
+        bool heavy = effects.cost >= threshold;
+        mergeEffects(pending, effects);
+        if (!heavy) continue;
+        bool fits = all_of(tasks.begin(), tasks.end(),
+                           [&](const StatementEffects& other) { return independent(other, pending); });
+        if (!fits) close();
+        if (tasks.empty()) group.first = pendingFirst;
+        group.ends.push_back(i + 1);
+        group.writes.push_back(pending.writes);
+        tasks.push_back(std::move(pending));
+        pending = StatementEffects();
+        pendingFirst = i + 1;
+    }
+    close();
+    return groups;
+}
+
+// Groups of every Block with any, by Block node. Only the root and Blocks
+// reached from it through ifs are planned: a Block inside a loop would
+// start its tasks again on every iteration.
+using ParallelPlan = unordered_map<NodeId, vector<StatementGroup>>;
+
+inline ParallelPlan planParallel(const AST& ast, uint64_t threshold) {
+    ParallelPlan plan;
+    vector<NodeId> pending;
+    if (ast.root != NO_NODE) pending.push_back(ast.root);
+    while (!pending.empty()) {
+        NodeId id = pending.back();
+        pending.pop_back();
+        const ASTNode& node = ast[id];
+        if (node.kind == NodeKind::Block) {
+            vector<StatementGroup> groups = planBlock(ast, node, threshold);
+            if (!groups.empty()) plan.emplace(id, std::move(groups));
+            for (NodeId stmt : ast.statements(node)) pending.push_back(stmt);
+        } else if (node.kind == NodeKind::IfStmt) {
+            if (node.ifStmt.thenBranch != NO_NODE) pending.push_back(node.ifStmt.thenBranch);
+            if (node.ifStmt.elseBranch != NO_NODE) pending.push_back(node.ifStmt.elseBranch);
+        }
+    }
+    return plan;
+}
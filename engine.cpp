@@ -0,0 +1,60 @@
+#include "engine.h"
+#include <algorithm>
+#include <stdexcept>
+#include "iropt.h"
+#include "lexer.h"
+#include "parser.h"
+using namespace std;
+
+shared_ptr<const Program> Program::compile(const string& source, int optLevel) {
+    auto tokens = tokenize(source);
+    AST tree = Parser(tokens).parse();
+    optimizeAST(tree, optLevel, true);
+    IRProgram ir;
+    int labelCount = 0;
+    compileAST(tree, ir, labelCount);
+    optimizeIR(ir);
+
+    shared_ptr<Program> program(new Program());
+    program->linked = linkIR(ir, &tree);
+    const auto& names = program->linked.slotNames;
+    for (size_t i = 0; i < names.size(); ++i) program->slots.emplace(names[i], (int)i);
+    return program;
+}
+
+int Program::slot(const string& name) const {
+    auto it = slots.find(name);
+    return it == slots.end() ? -1 : it->second;
+}
+
+ExecutionContext::ExecutionContext(shared_ptr<const Program> program) : program(std::move(program)) {
+    if (!this->program) throw runtime_error("ExecutionContext: no program");
+    state.prepare(this->program->code());
+}
+
+void ExecutionContext::set(const string& name, int value) {
+    int s = program->slot(name);
+    if (s < 0) throw runtime_error("Unknown variable: " + name);
+    state.frame[s] = Value::fromInt(value);
+}
+
+int ExecutionContext::get(const string& name) const {
+    int s = program->slot(name);
+    if (s < 0) throw runtime_error("Unknown variable: " + name);
+    return state.frame[s].toInt();
+}
+
+void ExecutionContext::reset() {
+    fill(state.frame.begin(), state.frame.end(), Value());
+}
+
+void ExecutionContext::run() {
+    printed = 0;
+    OutputWriter out([this](int value) {
+        if (limits.maxOutput && ++printed > limits.maxOutput) {
+            throw LimitExceeded(LimitKind::Output, limits.maxOutput, printed);
+        }
+        if (output) output(value);
+    });
+    IRVM().run(program->code(), state, out, limits);
+}
@@ -0,0 +1,75 @@
+#pragma once
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "budget.h"
+#include "ir.h"
+using namespace std;
+
+// Embedding API. A Program is compiled once and never modified afterwards,
+// so one instance can be shared by any number of threads. Each evaluation
+// runs in its own ExecutionContext, which owns the variable storage, the
+// output sink and the limits. There is no global state: contexts on
+// different threads never touch each other.
+//
+//   auto program = Program::compile(source);
+//   ExecutionContext ctx(program);
+//   ctx.set("n", 10);
+//   ctx.setOutput([](int value) { ... });
+//   ctx.run();
+//   int result = ctx.get("fact");
+
+class Program {
+public:
+    // Lexes, parses, optimizes and links `source`. Throws runtime_error on
+    // syntax errors. Final variable values are preserved by the optimizer
+    // so they can be read back from a context.
+    static shared_ptr<const Program> compile(const string& source, int optLevel = 1);
+
+    // Variables the program reads or writes, in frame slot order
+    const vector<string>& variables() const { return linked.slotNames; }
+    // Frame slot of a variable, or -1 if the program never uses it
+    int slot(const string& name) const;
+    const LinkedProgram& code() const { return linked; }
+
+private:
+    Program() = default;
+
+    LinkedProgram linked;
+    unordered_map<string, int> slots;
+};
+
+class ExecutionContext {
+public:
+    explicit ExecutionContext(shared_ptr<const Program> program);
+
+    // Variables keep their values across runs until reset(). set() and get()
+    // throw runtime_error for names the program does not use.
+    void set(const string& name, int value);
+    int get(const string& name) const;
+    bool has(const string& name) const { return program->slot(name) >= 0; }
+    void setSlot(int slot, int value) { state.frame.at(slot) = Value::fromInt(value); }
+    int getSlot(int slot) const { return state.frame.at(slot).toInt(); }
+    void reset();
+
+    // Receives the value of every print statement; output is discarded
+    // when no sink is set
+    void setOutput(function<void(int)> sink) { output = std::move(sink); }
+
+    ExecutionLimits limits;
+
+    // Runs the program on the VM. Throws LimitExceeded when a limit is hit;
+    // variables then hold whatever the program had stored so far.
+    void run();
+
+    const Program& compiled() const { return *program; }
+
+private:
+    shared_ptr<const Program> program;
+    VMState state;
+    function<void(int)> output;
+    size_t printed = 0;
+};
@@ -0,0 +1,213 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "ir.h"
+#include "iropt.h"
+#include "lexer.h"
+#include "parser.h"
+using namespace std;
+
+// Incremental front end for long-lived sessions that re-run edited scripts.
+//
+// The program is kept as a list of regions: runs of top-level statements
+// that share no source line with their neighbours. Each region owns its
+// tokens, its subtrees and its linked code. An edit is located by comparing
+// the old and new source line by line; regions outside the changed lines
+// are kept (those after it only move), and only the changed ones, plus the
+// region before them (an added `else` attaches to it), are lexed, parsed,
+// optimized and compiled again. If that stretch does not parse on its own,
+// e.g. after an edit that moved a brace, it grows a region at a time.
+//
+// Region code uses region-relative jump targets and its own variable slots;
+// laying the regions out into one LinkedProgram relocates both.
+struct EditStats {
+    size_t regions = 0; // Regions in the program after the edit
+    size_t rebuilt = 0; // Regions lexed, parsed and compiled by the edit
+    size_t lines = 0;   // Source lines re-parsed
+    double ms = 0;      // Wall time of the update
+};
+
+class IncrementalProgram {
+public:
+    // The level is capped at 1: -O2 carries values across statements, which
+    // would make one region's code depend on the others
+    explicit IncrementalProgram(int optLevel = 1) : optLevel(min(optLevel, 1)) {}
+
+    // Replaces the source and brings the program up to date. Throws
+    // runtime_error on a syntax error and keeps the previous program.
+    EditStats update(string_view source);
+
+    const LinkedProgram& program() const { return linked; }
+
+private:
+    // One lexed and parsed stretch of source, shared by the regions cut
+    // from it
+    struct Chunk {
+        string text;
+        vector<Token> tokens; // Views into text
+        AST ast;
+    };
+
+    struct Region {
+        shared_ptr<Chunk> chunk;
+        vector<NodeId> statements;
+        size_t start;       // First line (0-based) in the current source
+        size_t lineShift;   // Chunk line + lineShift = source line
+        LinkedProgram code; // Region-relative jump targets and slots, no HALT
+        vector<int> slots;  // Region slot -> program slot
+    };
+
+    int optLevel;
+    shared_ptr<const string> source;
+    vector<string_view> lines; // Views into *source
+    vector<Region> regions;
+    unordered_map<string, int> slotIds;
+    LinkedProgram linked;
+
+    static vector<string_view> splitLines(string_view text) {
+        vector<string_view> out;
+        size_t begin = 0;
+        while (begin < text.size()) {
+            size_t end = text.find('\n', begin);
+            if (end == string_view::npos) end = text.size();
+            out.push_back(text.substr(begin, end - begin));
+            begin = end + 1;
+        }
+        return out;
+    }
+
+    // Index of the region holding `line`; lines before the first region
+    // belong to it
+    size_t regionAt(size_t line) const {
+        auto it = upper_bound(regions.begin(), regions.end(), line,
+                              [](size_t l, const Region& r) { return l < r.start; });
+        return it == regions.begin() ? 0 : (size_t)(it - regions.begin()) - 1;
+    }
+
+    int programSlot(const string& name) {
+        auto it = slotIds.find(name);
+        if (it != slotIds.end()) return it->second;
+        int slot = (int)linked.slotNames.size();
+        slotIds.emplace(name, slot);
+        linked.slotNames.push_back(name);
+        return slot;
+    }
+
+    // Lexes, parses and compiles lines [from, to) of `text` into regions
+    vector<Region> build(size_t from, size_t to, const vector<string_view>& text) {
+        auto chunk = make_shared<Chunk>();
+        for (size_t i = from; i < to; ++i) {
+            chunk->text.append(text[i]);
+            chunk->text += '\n';
+        }
+        chunk->tokens = tokenize(chunk->text);
+        vector<StatementLines> spans;
+        chunk->ast = Parser(chunk->tokens).parse(spans);
+
+        // Statements touching a line already used by the previous one join
+        // its region, so every region starts on a line of its own
+        vector<Region> out;
+        NodeSpan statements = chunk->ast.statements(chunk->ast[chunk->ast.root]);
+        uint32_t lastLine = 0;
+        for (size_t i = 0; i < spans.size(); ++i) {
+            if (out.empty() || spans[i].first > lastLine) {
+                out.push_back({chunk, {}, from + spans[i].first - 1, from, {}, {}});
+            }
+            out.back().statements.push_back(statements.begin()[i]);
+            lastLine = max(lastLine, spans[i].last);
+        }
+        for (Region& region : out) compile(region);
+        return out;
+    }
+
+    void compile(Region& region) {
+        AST& ast = region.chunk->ast;
+        IRProgram ir;
+        int labelCount = 0;
+        for (NodeId& stmt : region.statements) {
+            ast.root = stmt;
+            optimizeAST(ast, optLevel);
+            stmt = ast.root;
+            compileStatement<QuietTrace>(ast, stmt, ir, labelCount);
+        }
+        optimizeIR(ir);
+        region.code = linkIR(ir);
+        region.code.code.pop_back(); // HALT; the layout adds one at the end
+        region.code.lines.pop_back();
+        region.slots.clear();
+        for (const string& name : region.code.slotNames) region.slots.push_back(programSlot(name));
+    }
+
+    // Concatenates the regions, relocating jumps and variables
+    void layout() {
+        linked.code.clear();
+        linked.lines.clear();
+        for (const Region& region : regions) {
+            appendLinked(linked, region.code, &region.slots, (int)region.lineShift);
+        }
+        linked.code.push_back({OpCode::HALT, 0, 0, 0});
+        linked.lines.push_back(0);
+    }
+};
+
+inline EditStats IncrementalProgram::update(string_view text) {
+    auto started = chrono::steady_clock::now();
+    auto next = make_shared<const string>(text);
+    vector<string_view> nextLines = splitLines(*next);
+    EditStats stats;
+
+    size_t oldN = lines.size(), newN = nextLines.size();
+    size_t p = 0;
+    while (p < oldN && p < newN && lines[p] == nextLines[p]) ++p;
+    size_t s = 0;
+    while (s < oldN - p && s < newN - p && lines[oldN - 1 - s] == nextLines[newN - 1 - s]) ++s;
+
+    if (!source || regions.empty()) {
+        regions = build(0, newN, nextLines);
+        stats.rebuilt = regions.size();
+        stats.lines = newN;
+    } else if (p < oldN || p < newN) {
+        // Old lines [p, q) were replaced; everything from q on only moves
+        size_t q = oldN - s;
+        size_t first = regionAt(p);
+        if (first > 0) --first;
+        size_t last = regionAt(max(q, p + 1) - 1);
+        for (;;) {
+            size_t from = first == 0 ? 0 : regions[first].start;
+            size_t to = last + 1 < regions.size() ? regions[last + 1].start : oldN;
+            size_t newTo = to + newN - oldN;
+            vector<Region> rebuilt;
+            try {
+                rebuilt = build(from, newTo, nextLines);
+            } catch (const runtime_error&) {
+                if (first == 0 && last + 1 == regions.size()) throw;
+                if (first > 0) --first;
+                if (last + 1 < regions.size()) ++last;
+                continue;
+            }
+            for (size_t k = last + 1; k < regions.size(); ++k) {
+                regions[k].start = regions[k].start + newN - oldN;
+                regions[k].lineShift = regions[k].lineShift + newN - oldN;
+            }
+            stats.rebuilt = rebuilt.size();
+            stats.lines = newTo - from;
+            regions.erase(regions.begin() + first, regions.begin() + last + 1);
+            regions.insert(regions.begin() + first, make_move_iterator(rebuilt.begin()),
+                           make_move_iterator(rebuilt.end()));
+            break;
+        }
+    }
+
+    source = std::move(next);
+    lines = std::move(nextLines);
+    layout();
+    stats.regions = regions.size();
+    stats.ms = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+    return stats;
+}
@@ -1,102 +1,382 @@
 #include "interpreter.h"
+#include <algorithm>
+#include <atomic>
+#include <exception>
 #include <iostream>
 #include <iomanip>
 using namespace std;
 
-Interpreter::Interpreter() {}
-
-Value Interpreter::eval(shared_ptr<ASTNode> node) {
-    if (auto bin = dynamic_cast<BinaryExpr*>(node.get())) return evalBinaryExpr(bin);
-    if (auto lit = dynamic_cast<Literal*>(node.get())) return evalLiteral(lit);
-    if (auto id = dynamic_cast<Identifier*>(node.get())) return evalIdentifier(id);
-    if (auto assign = dynamic_cast<Assignment*>(node.get())) return evalAssignment(assign);
-    if (auto ifStmt = dynamic_cast<IfStmt*>(node.get())) return evalIfStmt(ifStmt);
-    if (auto block = dynamic_cast<Block*>(node.get())) return evalBlock(block);
-    if (auto whileStmt = dynamic_cast<WhileStmt*>(node.get())) return evalWhileStmt(whileStmt);
-    if (auto printStmt = dynamic_cast<PrintStmt*>(node.get())) return evalPrintStmt(printStmt);
+namespace {
+
+// Size and nesting depth of a subtree, measured without recursion so that
+// trees too deep to evaluate can still be rejected
+struct SubtreeSize {
+    size_t nodes = 0;
+    size_t depth = 0;
+};
+
+SubtreeSize measure(const AST& ast, NodeId root) {
+    SubtreeSize size;
+    vector<pair<NodeId, size_t>> pending;
+    if (root != NO_NODE) pending.push_back({root, 1});
+    while (!pending.empty()) {
+        auto [id, depth] = pending.back();
+        pending.pop_back();
+        ++size.nodes;
+        size.depth = max(size.depth, depth);
+        const ASTNode& node = ast[id];
+        auto visit = [&](NodeId child) {
+            if (child != NO_NODE) pending.push_back({child, depth + 1});
+        };
+        switch (node.kind) {
+            case NodeKind::BinaryExpr: visit(node.binary.left); visit(node.binary.right); break;
+            case NodeKind::Assignment: visit(node.assign.value); break;
+            case NodeKind::IfStmt:
+                visit(node.ifStmt.cond);
+                visit(node.ifStmt.thenBranch);
+                visit(node.ifStmt.elseBranch);
+                break;
+            case NodeKind::WhileStmt: visit(node.whileStmt.cond); visit(node.whileStmt.body); break;
+            case NodeKind::Block:
+                for (NodeId stmt : ast.statements(node)) visit(stmt);
+                break;
+            case NodeKind::PrintStmt: visit(node.print); break;
+            default: break;
+        }
+    }
+    return size;
+}
+
+// Nodes one iteration of each loop walks (its condition and body), by
+// WhileStmt NodeId. Subtree sizes are summed bottom-up in one pass.
+vector<uint64_t> loopCosts(const AST& ast) {
+    vector<uint64_t> size(ast.nodes.size(), 0);
+    vector<uint64_t> cost(ast.nodes.size(), 0);
+    vector<pair<NodeId, bool>> pending; // Node and whether its children are done
+    if (ast.root != NO_NODE) pending.push_back({ast.root, false});
+    auto sizeOf = [&](NodeId id) { return id == NO_NODE ? 0 : size[id]; };
+    while (!pending.empty()) {
+        auto [id, childrenDone] = pending.back();
+        pending.pop_back();
+        const ASTNode& node = ast[id];
+        if (!childrenDone) {
+            pending.push_back({id, true});
+            auto visit = [&](NodeId child) {
+                if (child != NO_NODE) pending.push_back({child, false});
+            };
+            switch (node.kind) {
+                case NodeKind::BinaryExpr: visit(node.binary.left); visit(node.binary.right); break;
+                case NodeKind::Assignment: visit(node.assign.value); break;
+                case NodeKind::IfStmt:
+                    visit(node.ifStmt.cond);
+                    visit(node.ifStmt.thenBranch);
+                    visit(node.ifStmt.elseBranch);
+                    break;
+                case NodeKind::WhileStmt: visit(node.whileStmt.cond); visit(node.whileStmt.body); break;
+                case NodeKind::Block:
+                    for (NodeId stmt : ast.statements(node)) visit(stmt);
+                    break;
+                case NodeKind::PrintStmt: visit(node.print); break;
+                default: break;
+            }
+            continue;
+        }
+        uint64_t nodes = 1;
+        switch (node.kind) {
+            case NodeKind::BinaryExpr: nodes += sizeOf(node.binary.left) + sizeOf(node.binary.right); break;
+            case NodeKind::Assignment: nodes += sizeOf(node.assign.value); break;
+            case NodeKind::IfStmt:
+                nodes += sizeOf(node.ifStmt.cond) + sizeOf(node.ifStmt.thenBranch) + sizeOf(node.ifStmt.elseBranch);
+                break;
+            case NodeKind::WhileStmt:
+                cost[id] = sizeOf(node.whileStmt.cond) + sizeOf(node.whileStmt.body);
+                nodes += cost[id];
+                break;
+            case NodeKind::Block:
+                for (NodeId stmt : ast.statements(node)) nodes += sizeOf(stmt);
+                break;
+            case NodeKind::PrintStmt: nodes += sizeOf(node.print); break;
+            default: break;
+        }
+        size[id] = nodes;
+    }
+    return cost;
+}
+
+} // namespace
+
+template <typename Trace>
+Interpreter<Trace>::Interpreter(OutputWriter& out, const ExecutionLimits& limits, Profiler* profiler)
+    : out(out), limits(limits), profiler(profiler) {}
+
+template <typename Trace>
+Value Interpreter<Trace>::eval(const AST& tree) {
+    if (!tree.resolved) throw runtime_error("Interpreter: tree has no slots (run resolveSlots first)");
+    ast = &tree;
+    frame.assign(tree.slots.size(), Value());
+    defined.assign(tree.slots.size(), 0);
+    // Kept variables go back out however the run ends
+    struct SaveVariables {
+        Interpreter* self;
+        ~SaveVariables() {
+            if (self->persistent) self->saveVariables();
+        }
+    } save{this};
+    if (persistent) {
+        for (size_t slot = 0; slot < frame.size(); ++slot) {
+            auto it = saved.find(string(tree.name(tree.slots[slot])));
+            if (it == saved.end()) continue;
+            frame[slot] = it->second;
+            defined[slot] = 1;
+        }
+    }
+    budget = Budget(limits);
+    // Recursion depth follows the tree's nesting, so it is checked up front
+    if (limits.maxStackDepth) budget.checkStackDepth(measure(tree, tree.root).depth);
+    loopCost.clear();
+    if (limits.maxSteps || limits.timeout.count()) loopCost = loopCosts(tree);
+    // Tasks keep their own steps, output and timing, so limits, tracing and
+    // profiling all need the statements run in order
+    plan.clear();
+    loopDepth = 0;
+    if (jobs > 1 && !Trace::enabled && !budget.limited() && !profiler) plan = planParallel(tree, threshold);
+    if (!plan.empty() && !pool) pool = make_unique<ThreadPool>(jobs - 1);
+    if constexpr (Profiler::enabled) {
+        if (profiler) {
+            // The last node's time is charged however the run ends
+            struct Finish {
+                Profiler* profiler;
+                ~Finish() { profiler->finish(); }
+            } finish{profiler};
+            return eval(tree.root);
+        }
+    }
+    return eval(tree.root);
+}
+
+template <typename Trace>
+Value Interpreter<Trace>::eval(NodeId id) {
+    if constexpr (Profiler::enabled) {
+        if (profiler) profiler->enter(id);
+    }
+    const ASTNode& node = (*ast)[id];
+    switch (node.kind) {
+        case NodeKind::BinaryExpr: return evalBinaryExpr(node);
+        case NodeKind::Literal: return evalLiteral(node);
+        case NodeKind::Identifier: return evalIdentifier(node);
+        case NodeKind::Assignment: return evalAssignment(node);
+        case NodeKind::IfStmt: return evalIfStmt(node);
+        case NodeKind::Block: return evalBlock(node);
+        case NodeKind::WhileStmt: return evalWhileStmt(node);
+        case NodeKind::PrintStmt: return evalPrintStmt(node);
+    }
     throw runtime_error("Unknown AST node");
 }
 
-Value Interpreter::evalBinaryExpr(BinaryExpr* expr) {
-    Value left = eval(expr->left);
-    Value right = eval(expr->right);
-
-    if (expr->op == "+") return Value{left.asInt() + right.asInt()};
-    if (expr->op == "-") return Value{left.asInt() - right.asInt()};
-    if (expr->op == "*") return Value{left.asInt() * right.asInt()};
-    if (expr->op == "/") return Value{left.asInt() / right.asInt()};
-    if (expr->op == "==") return Value{left.asInt() == right.asInt()};
-    if (expr->op == "<") return Value{left.asInt() < right.asInt()};
-    if (expr->op == ">") return Value{left.asInt() > right.asInt()};
-    throw runtime_error("Unknown binary operator: " + expr->op);
+template <typename Trace>
+Value Interpreter<Trace>::evalBinaryExpr(const ASTNode& expr) {
+    Value left = eval(expr.binary.left);
+    Value right = eval(expr.binary.right);
+
+    switch (expr.op) {
+        case BinOp::Add: return arithmetic(ArithOp::Add, left, right);
+        case BinOp::Sub: return arithmetic(ArithOp::Sub, left, right);
+        case BinOp::Mul: return arithmetic(ArithOp::Mul, left, right);
+        case BinOp::Div: return arithmetic(ArithOp::Div, left, right);
+        case BinOp::Eq: return Value::fromBool(compare(CompareOp::Eq, left, right));
+        case BinOp::Ne: return Value::fromBool(compare(CompareOp::Ne, left, right));
+        case BinOp::Lt: return Value::fromBool(compare(CompareOp::Lt, left, right));
+        case BinOp::Gt: return Value::fromBool(compare(CompareOp::Gt, left, right));
+        case BinOp::Le: return Value::fromBool(compare(CompareOp::Le, left, right));
+        case BinOp::Ge: return Value::fromBool(compare(CompareOp::Ge, left, right));
+    }
+    throw runtime_error(string("Unknown binary operator: ") + binOpName(expr.op));
 }
 
-Value Interpreter::evalLiteral(Literal* expr) {
-    return Value{expr->value};
+template <typename Trace>
+Value Interpreter<Trace>::evalLiteral(const ASTNode& expr) {
+    return Value::fromInt(expr.literal);
 }
 
-Value Interpreter::evalIdentifier(Identifier* expr) {
-    if (variables.find(expr->name) == variables.end())
-        throw runtime_error("Undefined variable: " + expr->name);
-    return variables[expr->name];
+template <typename Trace>
+Value Interpreter<Trace>::evalIdentifier(const ASTNode& expr) {
+    uint32_t slot = expr.identifier.slot;
+    if (expr.identifier.unset && !defined[slot])
+        throw runtime_error("Undefined variable: " + string(ast->name(expr.identifier.name)));
+    return frame[slot];
 }
 
-Value Interpreter::evalAssignment(Assignment* expr) {
-    cout << "[Interpreter] Assignment: " << expr->name << " = ...\n";
-    Value val = eval(expr->value);
-    variables[expr->name] = val;
-    cout << "[Interpreter] Assigned " << expr->name << " = " << val.asInt() << "\n";
+template <typename Trace>
+Value Interpreter<Trace>::evalAssignment(const ASTNode& expr) {
+    if constexpr (Trace::enabled) cout << "[Interpreter] Assignment: " << ast->name(expr.assign.name) << " = ...\n";
+    Value val = eval(expr.assign.value);
+    frame[expr.assign.slot] = val;
+    defined[expr.assign.slot] = 1;
+    if constexpr (Trace::enabled) {
+        cout << "[Interpreter] Assigned " << ast->name(expr.assign.name) << " = " << val << "\n";
+    }
     return val;
 }
 
-Value Interpreter::evalIfStmt(IfStmt* stmt) {
-    cout << "[Interpreter] If condition...\n";
-    Value cond = eval(stmt->condition);
-    if (cond.asBool()) {
-        cout << "[Interpreter] Condition true, executing then-branch\n";
-        return eval(stmt->thenBranch);
+template <typename Trace>
+Value Interpreter<Trace>::evalIfStmt(const ASTNode& stmt) {
+    if constexpr (Trace::enabled) cout << "[Interpreter] If condition...\n";
+    Value cond = eval(stmt.ifStmt.cond);
+    if (cond.truthy()) {
+        if constexpr (Trace::enabled) cout << "[Interpreter] Condition true, executing then-branch\n";
+        if (stmt.ifStmt.thenBranch == NO_NODE) return Value();
+        return eval(stmt.ifStmt.thenBranch);
     }
-    if (stmt->elseBranch) {
-        cout << "[Interpreter] Condition false, executing else-branch\n";
-        return eval(stmt->elseBranch);
+    if (stmt.ifStmt.elseBranch != NO_NODE) {
+        if constexpr (Trace::enabled) cout << "[Interpreter] Condition false, executing else-branch\n";
+        return eval(stmt.ifStmt.elseBranch);
     }
-    cout << "[Interpreter] Condition false, no else-branch\n";
-    return Value{0};
+    if constexpr (Trace::enabled) cout << "[Interpreter] Condition false, no else-branch\n";
+    return Value();
 }
 
-Value Interpreter::evalBlock(Block* stmt) {
+template <typename Trace>
+Value Interpreter<Trace>::evalBlock(const ASTNode& stmt) {
     Value last;
-    cout << "\n[Interpreter] Entering block with " << stmt->statements.size() << " statement(s)\n";
-    for (auto& s : stmt->statements) {
-        cout << "[Interpreter] Evaluating statement...\n";
-        last = eval(s);
-        cout << "[Interpreter] Variable state: ";
-        for (const auto& [k, v] : variables) {
-            cout << k << "=" << v.asInt() << " ";
+    NodeSpan statements = ast->statements(stmt);
+    if constexpr (Trace::enabled) cout << "\n[Interpreter] Entering block with " << statements.size() << " statement(s)\n";
+    if (!plan.empty() && loopDepth == 0) {
+        auto it = plan.find((NodeId)(&stmt - ast->nodes.data()));
+        if (it != plan.end()) {
+            size_t next = 0;
+            for (const StatementGroup& group : it->second) {
+                for (; next < group.first; ++next) last = eval(statements.begin()[next]);
+                last = evalGroup(statements.begin(), group);
+                next = group.ends.back();
+            }
+            for (; next < statements.size(); ++next) last = eval(statements.begin()[next]);
+            return last;
         }
-        cout << "\n";
     }
-    cout << "[Interpreter] Exiting block\n";
+    for (NodeId s : statements) {
+        if constexpr (Trace::enabled) cout << "[Interpreter] Evaluating statement...\n";
+        last = eval(s);
+        if constexpr (Trace::enabled) dumpVariables("Variable state");
+    }
+    if constexpr (Trace::enabled) cout << "[Interpreter] Exiting block\n";
     return last;
 }
 
-Value Interpreter::evalWhileStmt(WhileStmt* stmt) {
-    cout << "[Interpreter] Entering while loop\n";
+template <typename Trace>
+Value Interpreter<Trace>::evalWhileStmt(const ASTNode& stmt) {
+    if constexpr (Trace::enabled) cout << "[Interpreter] Entering while loop\n";
+    // Each iteration is charged at the loop head, one step per node it walks
+    // (a cancel flag alone only needs the slices to run out)
+    int64_t cost = loopCost.empty() ? 1 : (int64_t)loopCost[&stmt - ast->nodes.data()];
     Value last;
-    while (eval(stmt->condition).asBool()) {
-        last = eval(stmt->body);
-        cout << "[Interpreter] Variable state (in while): ";
-        for (const auto& [k, v] : variables) {
-            cout << k << "=" << v.asInt() << " ";
+    ++loopDepth;
+    while (eval(stmt.whileStmt.cond).truthy()) {
+        budget.charge(cost);
+        if constexpr (Profiler::enabled) {
+            if (profiler) profiler->iteration(&stmt - ast->nodes.data());
         }
-        cout << "\n";
+        if (stmt.whileStmt.body != NO_NODE) last = eval(stmt.whileStmt.body);
+        if constexpr (Trace::enabled) dumpVariables("Variable state (in while)");
     }
-    cout << "[Interpreter] Exiting while loop\n";
+    --loopDepth;
+    if constexpr (Trace::enabled) cout << "[Interpreter] Exiting while loop\n";
     return last;
 }
 
-Value Interpreter::evalPrintStmt(PrintStmt* stmt) {
-    Value val = eval(stmt->expr);
-    std::cout << "print: " << val.asInt() << std::endl;
+template <typename Trace>
+Value Interpreter<Trace>::evalPrintStmt(const ASTNode& stmt) {
+    Value val = eval(stmt.print);
+    out.print(val.toInt());
+    if constexpr (Trace::enabled) out.flush(); // Keep prints in order with the trace
     return val;
 }
+
+// Every task of the group runs on its own copy of the frame and prints into
+// its own buffer; the caller runs the first one. Then, in statement order,
+// each buffer is replayed and the variables the task writes are copied
+// back. A task that throws keeps its effects and drops those of the tasks
+// after it, as if the statements had run in order; it also cancels them, so
+// one that would never finish does not hold up the error.
+template <typename Trace>
+Value Interpreter<Trace>::evalGroup(const NodeId* statements, const StatementGroup& group) {
+    struct Task {
+        vector<int> printed;
+        vector<Value> frame;
+        vector<uint8_t> defined;
+        Value result;
+        uint64_t steps = 0;
+        exception_ptr error;
+    };
+    vector<Task> tasks(group.size());
+    vector<atomic<bool>> cancel(group.size());
+    auto run = [&](size_t i) {
+        Task& task = tasks[i];
+        try {
+            OutputWriter buffer([&task](int value) { task.printed.push_back(value); });
+            ExecutionLimits taskLimits;
+            taskLimits.cancel = &cancel[i];
+            Interpreter worker(buffer, taskLimits);
+            worker.ast = ast;
+            worker.frame = frame;
+            worker.defined = defined;
+            worker.budget = Budget(taskLimits);
+            try {
+                for (uint32_t s = group.begin(i); s < group.ends[i]; ++s) task.result = worker.eval(statements[s]);
+            } catch (...) {
+                task.error = current_exception();
+            }
+            task.steps = worker.budget.used();
+            task.frame = std::move(worker.frame);
+            task.defined = std::move(worker.defined);
+        } catch (...) {
+            task.error = current_exception();
+        }
+        if (task.error) {
+            for (size_t j = i + 1; j < cancel.size(); ++j) cancel[j] = true;
+        }
+    };
+    TaskLatch latch(tasks.size() - 1);
+    for (size_t i = 1; i < tasks.size(); ++i) {
+        pool->submit([&, i] {
+            run(i);
+            latch.countDown();
+        });
+    }
+    run(0);
+    latch.wait();
+
+    Value last;
+    for (size_t i = 0; i < tasks.size(); ++i) {
+        Task& task = tasks[i];
+        for (int value : task.printed) out.print(value);
+        if (!task.frame.empty()) {
+            for (SymbolId slot : group.writes[i]) {
+                frame[slot] = task.frame[slot];
+                defined[slot] = task.defined[slot];
+            }
+        }
+        budget.charge((int64_t)task.steps);
+        if (task.error) rethrow_exception(task.error);
+        last = task.result;
+    }
+    return last;
+}
+
+template <typename Trace>
+void Interpreter<Trace>::saveVariables() {
+    for (size_t slot = 0; slot < frame.size(); ++slot) {
+        if (defined[slot]) saved[string(ast->name(ast->slots[slot]))] = frame[slot];
+    }
+}
+
+template <typename Trace>
+void Interpreter<Trace>::dumpVariables(const char* label) {
+    cout << "[Interpreter] " << label << ": ";
+    for (size_t slot = 0; slot < frame.size(); ++slot) {
+        if (defined[slot]) cout << ast->name(ast->slots[slot]) << "=" << frame[slot] << " ";
+    }
+    cout << "\n";
+}
+
+template class Interpreter<QuietTrace>;
+template class Interpreter<VerboseTrace>;
@@ -1,33 +1,77 @@
 #pragma once
+#include "budget.h"
+#include "depend.h"
 #include "parser.h"
-#include <unordered_map>
-#include <variant>
+#include "profile.h"
+#include "threadpool.h"
+#include "trace.h"
+#include "value.h"
+#include <memory>
 #include <stdexcept>
 #include <string>
-#include <memory>
+#include <unordered_map>
+#include <vector>
 using namespace std;
 
-struct Value {
-    variant<int, bool> data;
-
-    int asInt() const { return get<int>(data); }
-    bool asBool() const { return get<bool>(data); }
-};
-
+// AST interpreter; Trace selects the (compile-time) tracing policy.
+// Variables live in a dense frame indexed by the slots resolveSlots() put on
+// the tree, which eval() requires. eval() throws LimitExceeded when the
+// program runs past `limits`. A profiler (HYBRID_PROFILE builds only) must
+// have been set up with profileSites().
+template <typename Trace = QuietTrace>
 class Interpreter {
 public:
-    Interpreter();
-    Value eval(shared_ptr<ASTNode> node);
+    explicit Interpreter(OutputWriter& out, const ExecutionLimits& limits = ExecutionLimits(),
+                         Profiler* profiler = nullptr);
+    Value eval(const AST& tree);
+    // Budget steps the last eval() used (see budget.h)
+    uint64_t steps() const { return budget.used(); }
+
+    // Keeps variables from one eval() to the next, so a program can be fed
+    // in pieces (the REPL). Values are matched by name as each tree starts
+    // and saved when it ends, also when it ends with an error.
+    void keepVariables(bool keep) { persistent = keep; }
+    bool hasVariable(string_view name) const { return saved.count(string(name)) != 0; }
+    const unordered_map<string, Value>& variables() const { return saved; }
+
+    // Runs independent statements of a Block as tasks on `jobs` threads (see
+    // depend.h); statements estimated below `threshold` stay in order. The
+    // pool starts with the first tree that has such statements. Runs with
+    // step or time limits, traced runs and profiled runs stay sequential.
+    void parallelize(size_t jobs, uint64_t threshold = PARALLEL_THRESHOLD) {
+        this->jobs = jobs;
+        this->threshold = threshold;
+    }
 
 private:
-    unordered_map<string, Value> variables;
+    vector<Value> frame;     // Indexed by slot
+    vector<uint8_t> defined; // Per slot; only consulted for reads marked `unset`
+    OutputWriter& out;
+    const AST* ast = nullptr;
+    ExecutionLimits limits;
+    Budget budget;
+    Profiler* profiler;
+    bool persistent = false;
+    unordered_map<string, Value> saved; // Kept variables, by name
+    size_t jobs = 1;
+    uint64_t threshold = PARALLEL_THRESHOLD;
+    unique_ptr<ThreadPool> pool; // Helpers; the evaluating thread is the other job
+    ParallelPlan plan;   // Parallel groups of this tree's Blocks
+    int loopDepth = 0;   // Loops being run; groups only start outside them
+    // Steps one iteration of each loop is charged, by WhileStmt NodeId;
+    // filled only when steps or time are limited
+    vector<uint64_t> loopCost;
 
-    Value evalBinaryExpr(BinaryExpr* expr);
-    Value evalLiteral(Literal* expr);
-    Value evalIdentifier(Identifier* expr);
-    Value evalAssignment(Assignment* expr);
-    Value evalIfStmt(IfStmt* stmt);
-    Value evalBlock(Block* stmt);
-    Value evalWhileStmt(WhileStmt* stmt);
-    Value evalPrintStmt(PrintStmt* stmt);
+    Value eval(NodeId id);
+    Value evalBinaryExpr(const ASTNode& expr);
+    Value evalLiteral(const ASTNode& expr);
+    Value evalIdentifier(const ASTNode& expr);
+    Value evalAssignment(const ASTNode& expr);
+    Value evalIfStmt(const ASTNode& stmt);
+    Value evalBlock(const ASTNode& stmt);
+    Value evalWhileStmt(const ASTNode& stmt);
+    Value evalPrintStmt(const ASTNode& stmt);
+    Value evalGroup(const NodeId* statements, const StatementGroup& group); // Block statements
+    void saveVariables();
+    void dumpVariables(const char* label);
 };
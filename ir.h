@@ -1,9 +1,15 @@
 #pragma once
+#include <algorithm>
 #include <string>
 #include <vector>
 #include <unordered_map>
 #include <iostream>
+#include <stdexcept>
+#include "budget.h"
 #include "parser.h"
+#include "profile.h"
+#include "trace.h"
+#include "value.h"
 using namespace std;
 
 // Simple IR instruction set
@@ -18,45 +24,120 @@ enum class OpCode {
     GT,     // Greater than
     LT,     // Less than
     EQ,     // Equal
+    NE,     // Not equal
+    LE,     // Less or equal
+    GE,     // Greater or equal
     JZ,     // Jump if zero
     JMP,    // Unconditional jump
     LABEL,  // Label
     NOP,    // No operation
-    PRINT   // Print top of stack
+    PRINT,  // Print top of stack
+    POP,    // Discard top of stack
+    // Superinstructions produced by the peephole optimizer (iropt.h)
+    INC,            // INC var, imm: var += imm
+    PUSH_STORE,     // PUSH_STORE imm, var: var = imm
+    LOAD_STORE,     // LOAD_STORE src, dst: dst = src
+    LOAD_LOAD_ADD,  // LOAD_LOAD_ADD a, b: push a + b
+    JLT,            // JLT a, b, label: jump if a < b
+    JLE,            // JLE a, b, label
+    JGT,            // JGT a, b, label
+    JGE,            // JGE a, b, label
+    JEQ,            // JEQ a, b, label
+    JNE,            // JNE a, b, label
+    HALT    // End of program (appended by the linker)
 };
 
 struct IRInstr {
     OpCode op;
     string arg; // For PUSH (value), LOAD/STORE (var), LABEL (label), JZ/JMP (label)
-    IRInstr(OpCode o, const string& a = "") : op(o), arg(a) {}
+    string arg2; // Second and third operands of superinstructions
+    string arg3;
+    int line = 0; // Source line (0 = unknown)
+    IRInstr(OpCode o, const string& a = "", const string& b = "", const string& c = "")
+        : op(o), arg(a), arg2(b), arg3(c) {}
 };
 
 struct IRProgram {
     vector<IRInstr> instructions;
 };
 
-inline void printIR(const IRProgram& prog) {
+inline const char* opName(OpCode op) {
+    switch (op) {
+        case OpCode::PUSH: return "PUSH";
+        case OpCode::LOAD: return "LOAD";
+        case OpCode::STORE: return "STORE";
+        case OpCode::ADD: return "ADD";
+        case OpCode::SUB: return "SUB";
+        case OpCode::MUL: return "MUL";
+        case OpCode::DIV: return "DIV";
+        case OpCode::GT: return "GT";
+        case OpCode::LT: return "LT";
+        case OpCode::EQ: return "EQ";
+        case OpCode::NE: return "NE";
+        case OpCode::LE: return "LE";
+        case OpCode::GE: return "GE";
+        case OpCode::JZ: return "JZ";
+        case OpCode::JMP: return "JMP";
+        case OpCode::LABEL: return "LABEL";
+        case OpCode::NOP: return "NOP";
+        case OpCode::PRINT: return "PRINT";
+        case OpCode::POP: return "POP";
+        case OpCode::INC: return "INC";
+        case OpCode::PUSH_STORE: return "PUSH_STORE";
+        case OpCode::LOAD_STORE: return "LOAD_STORE";
+        case OpCode::LOAD_LOAD_ADD: return "LOAD_LOAD_ADD";
+        case OpCode::JLT: return "JLT";
+        case OpCode::JLE: return "JLE";
+        case OpCode::JGT: return "JGT";
+        case OpCode::JGE: return "JGE";
+        case OpCode::JEQ: return "JEQ";
+        case OpCode::JNE: return "JNE";
+        case OpCode::HALT: return "HALT";
+    }
+    return "?";
+}
+
+// What each operand of an instruction refers to
+enum class OperandKind { NONE, IMM, VAR, LABEL };
+
+struct OperandKinds {
+    OperandKind kinds[3];
+    OperandKind operator[](int i) const { return kinds[i]; }
+};
+
+inline OperandKinds operandKinds(OpCode op) {
+    using K = OperandKind;
+    switch (op) {
+        case OpCode::PUSH: return {{K::IMM, K::NONE, K::NONE}};
+        case OpCode::LOAD:
+        case OpCode::STORE: return {{K::VAR, K::NONE, K::NONE}};
+        case OpCode::JZ:
+        case OpCode::JMP:
+        case OpCode::LABEL: return {{K::LABEL, K::NONE, K::NONE}};
+        case OpCode::INC: return {{K::VAR, K::IMM, K::NONE}};
+        case OpCode::PUSH_STORE: return {{K::IMM, K::VAR, K::NONE}};
+        case OpCode::LOAD_STORE:
+        case OpCode::LOAD_LOAD_ADD: return {{K::VAR, K::VAR, K::NONE}};
+        case OpCode::JLT: case OpCode::JLE: case OpCode::JGT:
+        case OpCode::JGE: case OpCode::JEQ: case OpCode::JNE:
+            return {{K::VAR, K::VAR, K::LABEL}};
+        default: return {{K::NONE, K::NONE, K::NONE}};
+    }
+}
+
+// True for opcodes that carry an operand
+inline bool hasOperand(OpCode op) {
+    return operandKinds(op)[0] != OperandKind::NONE;
+}
+
+inline void printIR(const IRProgram& prog, ostream& os = cout) {
     for (size_t i = 0; i < prog.instructions.size(); ++i) {
         const auto& instr = prog.instructions[i];
-        cout << i << ": ";
-        switch (instr.op) {
-            case OpCode::PUSH: cout << "PUSH " << instr.arg; break;
-            case OpCode::LOAD: cout << "LOAD " << instr.arg; break;
-            case OpCode::STORE: cout << "STORE " << instr.arg; break;
-            case OpCode::ADD: cout << "ADD"; break;
-            case OpCode::SUB: cout << "SUB"; break;
-            case OpCode::MUL: cout << "MUL"; break;
-            case OpCode::DIV: cout << "DIV"; break;
-            case OpCode::GT: cout << "GT"; break;
-            case OpCode::LT: cout << "LT"; break;
-            case OpCode::EQ: cout << "EQ"; break;
-            case OpCode::JZ: cout << "JZ " << instr.arg; break;
-            case OpCode::JMP: cout << "JMP " << instr.arg; break;
-            case OpCode::LABEL: cout << "LABEL " << instr.arg; break;
-            case OpCode::NOP: cout << "NOP"; break;
-            case OpCode::PRINT: cout << "PRINT"; break;
-        }
-        cout << endl;
+        OperandKinds kinds = operandKinds(instr.op);
+        os << i << ": " << opName(instr.op);
+        const string* args[3] = {&instr.arg, &instr.arg2, &instr.arg3};
+        for (int k = 0; k < 3 && kinds[k] != OperandKind::NONE; ++k) os << (k ? ", " : " ") << *args[k];
+        os << endl;
     }
 }
 
@@ -64,180 +145,590 @@ inline int toInt(const string& s) {
     return stoi(s);
 }
 
-// Simple stack-based VM to execute IR
+// Linked (executable) form of an IRProgram. Operands are resolved to integers:
+// immediates stay immediates, variables become frame slots and labels
+// absolute instruction indices. LABEL and NOP are dropped and the code ends
+// in HALT.
+struct LinkedInstr {
+    OpCode op;
+    int operand;
+    int operand2;
+    int operand3;
+};
+
+struct LinkedProgram {
+    vector<LinkedInstr> code;
+    vector<string> slotNames; // Frame slot -> variable name
+    vector<int> lines;        // Source line per instruction; may be empty
+};
+
+// Resolve labels, variables and constants of an IRProgram once, ahead of
+// execution. Given the tree's symbol table, slot n is symbol n, as in the
+// interpreter and the register VM; otherwise slots follow first use.
+inline LinkedProgram linkIR(const IRProgram& prog, const AST* symbols = nullptr) {
+    LinkedProgram linked;
+    unordered_map<string, int> labels;
+    unordered_map<string, int> slots;
+    if (symbols) {
+        for (string_view name : symbols->symbols) {
+            slots.emplace(string(name), (int)linked.slotNames.size());
+            linked.slotNames.emplace_back(name);
+        }
+    }
+
+    // Pass 1: a label points at the next instruction that survives linking
+    int pc = 0;
+    for (const auto& instr : prog.instructions) {
+        if (instr.op == OpCode::LABEL) labels[instr.arg] = pc;
+        else if (instr.op != OpCode::NOP) ++pc;
+    }
+
+    auto resolve = [&](OperandKind kind, const string& arg) -> int {
+        switch (kind) {
+            case OperandKind::NONE: return 0;
+            case OperandKind::IMM: return toInt(arg);
+            case OperandKind::VAR: {
+                auto it = slots.find(arg);
+                if (it == slots.end()) {
+                    it = slots.emplace(arg, (int)linked.slotNames.size()).first;
+                    linked.slotNames.push_back(arg);
+                }
+                return it->second;
+            }
+            case OperandKind::LABEL: {
+                auto it = labels.find(arg);
+                if (it == labels.end()) throw runtime_error("Undefined label: " + arg);
+                return it->second;
+            }
+        }
+        return 0;
+    };
+
+    // Pass 2: emit code with resolved operands
+    linked.code.reserve(pc + 1);
+    for (const auto& instr : prog.instructions) {
+        if (instr.op == OpCode::LABEL || instr.op == OpCode::NOP) continue;
+        OperandKinds kinds = operandKinds(instr.op);
+        linked.code.push_back({instr.op, resolve(kinds[0], instr.arg),
+                               resolve(kinds[1], instr.arg2), resolve(kinds[2], instr.arg3)});
+        linked.lines.push_back(instr.line);
+    }
+    linked.code.push_back({OpCode::HALT, 0, 0, 0});
+    linked.lines.push_back(0);
+    return linked;
+}
+
+// Appends code linked on its own, without its HALT, to `program`. Jump
+// targets move by the code already there; given `slotMap`, the part's
+// slots are mapped into the program's frame; known lines move by
+// `lineShift`.
+inline void appendLinked(LinkedProgram& program, const LinkedProgram& part,
+                         const vector<int>* slotMap = nullptr, int lineShift = 0) {
+    int base = (int)program.code.size();
+    for (size_t i = 0; i < part.code.size(); ++i) {
+        LinkedInstr instr = part.code[i];
+        OperandKinds kinds = operandKinds(instr.op);
+        int* operands[3] = {&instr.operand, &instr.operand2, &instr.operand3};
+        for (int k = 0; k < 3; ++k) {
+            if (kinds[k] == OperandKind::LABEL) *operands[k] += base;
+            else if (kinds[k] == OperandKind::VAR && slotMap) *operands[k] = (*slotMap)[*operands[k]];
+        }
+        program.code.push_back(instr);
+        int line = i < part.lines.size() ? part.lines[i] : 0;
+        program.lines.push_back(line ? line + lineShift : 0);
+    }
+}
+
+inline void printLinkedInstr(ostream& os, const LinkedProgram& prog, const LinkedInstr& instr) {
+    OperandKinds kinds = operandKinds(instr.op);
+    os << opName(instr.op);
+    const int operands[3] = {instr.operand, instr.operand2, instr.operand3};
+    for (int k = 0; k < 3 && kinds[k] != OperandKind::NONE; ++k) {
+        os << (k ? ", " : " ");
+        if (kinds[k] == OperandKind::VAR) os << prog.slotNames[operands[k]];
+        else os << operands[k];
+    }
+}
+
+inline void printLinked(const LinkedProgram& prog, ostream& os = cout) {
+    for (size_t i = 0; i < prog.code.size(); ++i) {
+        os << i << ": ";
+        printLinkedInstr(os, prog, prog.code[i]);
+        os << endl;
+    }
+}
+
+// Net operand stack change of an instruction (HALT ends the program)
+inline int stackEffect(OpCode op) {
+    switch (op) {
+        case OpCode::PUSH: case OpCode::LOAD: case OpCode::LOAD_LOAD_ADD: return 1;
+        case OpCode::STORE: case OpCode::ADD: case OpCode::SUB: case OpCode::MUL: case OpCode::DIV:
+        case OpCode::GT: case OpCode::LT: case OpCode::EQ: case OpCode::NE: case OpCode::LE:
+        case OpCode::GE: case OpCode::JZ: case OpCode::PRINT: case OpCode::POP: return -1;
+        default: return 0;
+    }
+}
+
+// Deepest operand stack the program can reach, or -1 if the depth differs
+// between paths into an instruction, goes negative or a jump leaves the code
+inline int maxStackDepth(const LinkedProgram& prog) {
+    const int size = (int)prog.code.size();
+    if (size == 0) return -1;
+    vector<int> depth(size, -1);
+    vector<int> work{0};
+    depth[0] = 0;
+    int deepest = 0;
+    auto flow = [&](int target, int d) {
+        if (target < 0 || target >= size) return false;
+        if (depth[target] == -1) {
+            depth[target] = d;
+            work.push_back(target);
+            return true;
+        }
+        return depth[target] == d;
+    };
+    while (!work.empty()) {
+        int pc = work.back();
+        work.pop_back();
+        const LinkedInstr& instr = prog.code[pc];
+        // Every pop needs a value below it: one for STORE/JZ/PRINT/POP, two for binary ops
+        int needs = (instr.op == OpCode::STORE || instr.op == OpCode::JZ || instr.op == OpCode::PRINT ||
+                     instr.op == OpCode::POP) ? 1 : (stackEffect(instr.op) == -1 ? 2 : 0);
+        if (depth[pc] < needs) return -1;
+        if (instr.op == OpCode::HALT) continue;
+        int d = depth[pc] + stackEffect(instr.op);
+        if (d > size) return -1;
+        deepest = max(deepest, d);
+        OperandKinds kinds = operandKinds(instr.op);
+        const int operands[3] = {instr.operand, instr.operand2, instr.operand3};
+        for (int k = 0; k < 3; ++k) {
+            if (kinds[k] == OperandKind::LABEL && !flow(operands[k], d)) return -1;
+        }
+        if (instr.op != OpCode::JMP && !flow(pc + 1, d)) return -1;
+    }
+    return deepest;
+}
+
+// VM profiler sites: one per instruction. Every backward jump closes a
+// loop that starts at its target.
+inline void profileSites(Profiler& profiler, const LinkedProgram& prog) {
+    profiler.reset("vm", prog.code.size());
+    vector<pair<int, int>> loops; // (head, backward jump)
+    for (size_t i = 0; i < prog.code.size(); ++i) {
+        const LinkedInstr& instr = prog.code[i];
+        OperandKinds kinds = operandKinds(instr.op);
+        const int operands[3] = {instr.operand, instr.operand2, instr.operand3};
+        for (int k = 0; k < 3; ++k) {
+            if (kinds[k] == OperandKind::LABEL && operands[k] <= (int)i) loops.push_back({operands[k], (int)i});
+        }
+    }
+    auto lineAt = [&](int pc) { return pc < (int)prog.lines.size() ? prog.lines[pc] : 0; };
+    // Innermost first, so the first loop found around a site is its parent
+    sort(loops.begin(), loops.end(), [](auto a, auto b) { return a.second - a.first < b.second - b.first; });
+    vector<int> headOf(prog.code.size(), -1);
+    for (auto [head, jump] : loops) {
+        profiler.markLoop(jump, lineAt(head));
+        headOf[jump] = head;
+    }
+    for (size_t i = 0; i < prog.code.size(); ++i) {
+        // A loop's own backward jump is placed by its whole range
+        int first = headOf[i] >= 0 ? headOf[i] : (int)i;
+        int parent = -1;
+        for (auto [head, jump] : loops) {
+            if (head <= first && jump >= (int)i && jump != (int)i) {
+                parent = jump;
+                break;
+            }
+        }
+        profiler.describe(i, opName(prog.code[i].op), lineAt((int)i), parent);
+    }
+}
+
+// Computed-goto dispatch needs the GCC/Clang labels-as-values extension;
+// other compilers (or -DHYBRID_NO_COMPUTED_GOTO) use the switch loop.
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(HYBRID_NO_COMPUTED_GOTO)
+#define HYBRID_COMPUTED_GOTO 1
+#else
+#define HYBRID_COMPUTED_GOTO 0
+#endif
+
+// Storage for one execution: the operand stack and the variable frame.
+// Keeping it outside the VM lets a host reuse it across runs and pass
+// variable values in and read them back out.
+struct VMState {
+    vector<Value> stack;
+    vector<Value> frame; // Indexed by LinkedProgram slot
+    uint64_t steps = 0; // Budget steps the last completed run used (see budget.h)
+
+    // Size for `prog`; existing variable values are kept
+    void prepare(const LinkedProgram& prog) {
+        // Every instruction pushes at most one value, so this bounds the stack
+        stack.resize(prog.code.size() + 1);
+        frame.resize(prog.slotNames.size());
+    }
+};
+
+// Simple stack-based VM to execute IR; Trace selects the tracing policy.
+// The VM itself is stateless, so one instance may run on many threads.
 class IRVM {
 public:
-    void run(const IRProgram& prog);
+    template <typename Trace = QuietTrace>
+    void run(const IRProgram& prog, OutputWriter& out);
+    template <typename Trace = QuietTrace>
+    void run(const LinkedProgram& prog, OutputWriter& out);
+    // Throws LimitExceeded when the program runs past `limits`. A profiler
+    // (HYBRID_PROFILE builds only) must have been set up with profileSites().
+    template <typename Trace = QuietTrace>
+    void run(const LinkedProgram& prog, VMState& state, OutputWriter& out,
+             const ExecutionLimits& limits = ExecutionLimits(), Profiler* profiler = nullptr);
+
+    // Central switch dispatch; used for tracing, profiling and as the portable
+    // fallback. Both loops charge `budget` at backward jumps only.
+    template <typename Trace = QuietTrace>
+    void runSwitch(const LinkedProgram& prog, VMState& state, OutputWriter& out, Budget& budget,
+                   Profiler* profiler = nullptr);
+#if HYBRID_COMPUTED_GOTO
+    // Token-threaded dispatch: every handler jumps straight to the next one
+    void runThreaded(const LinkedProgram& prog, VMState& state, OutputWriter& out, Budget& budget);
+#endif
 };
 
-inline void IRVM::run(const IRProgram& prog) {
-    unordered_map<string, size_t> labels;
-    for (size_t i = 0; i < prog.instructions.size(); ++i) {
-        if (prog.instructions[i].op == OpCode::LABEL) {
-            labels[prog.instructions[i].arg] = i;
+template <typename Trace>
+inline void IRVM::run(const IRProgram& prog, OutputWriter& out) {
+    run<Trace>(linkIR(prog), out);
+}
+
+template <typename Trace>
+inline void IRVM::run(const LinkedProgram& prog, OutputWriter& out) {
+    VMState state;
+    run<Trace>(prog, state, out);
+}
+
+template <typename Trace>
+inline void IRVM::run(const LinkedProgram& prog, VMState& state, OutputWriter& out,
+                      const ExecutionLimits& limits, Profiler* profiler) {
+    Budget budget(limits);
+    // The stack depth is fixed by the code, so it is checked once up front
+    if (limits.maxStackDepth) {
+        int depth = maxStackDepth(prog);
+        if (depth < 0) throw runtime_error("VM: inconsistent stack depth");
+        budget.checkStackDepth((size_t)depth);
+    }
+    state.prepare(prog);
+    if constexpr (Profiler::enabled) {
+        if (profiler) {
+            runSwitch<Trace>(prog, state, out, budget, profiler);
+            state.steps = budget.used();
+            return;
         }
     }
-    vector<int> stack;
-    unordered_map<string, int> vars;
-    for (size_t ip = 0; ip < prog.instructions.size(); ++ip) {
-        const auto& instr = prog.instructions[ip];
-        cout << "[VM] Executing: ";
-        switch (instr.op) {
-            case OpCode::PUSH: cout << "PUSH " << instr.arg; break;
-            case OpCode::LOAD: cout << "LOAD " << instr.arg; break;
-            case OpCode::STORE: cout << "STORE " << instr.arg; break;
-            case OpCode::ADD: cout << "ADD"; break;
-            case OpCode::SUB: cout << "SUB"; break;
-            case OpCode::MUL: cout << "MUL"; break;
-            case OpCode::DIV: cout << "DIV"; break;
-            case OpCode::GT: cout << "GT"; break;
-            case OpCode::LT: cout << "LT"; break;
-            case OpCode::EQ: cout << "EQ"; break;
-            case OpCode::JZ: cout << "JZ " << instr.arg; break;
-            case OpCode::JMP: cout << "JMP " << instr.arg; break;
-            case OpCode::LABEL: cout << "LABEL " << instr.arg; break;
-            case OpCode::NOP: cout << "NOP"; break;
-            case OpCode::PRINT: cout << "PRINT"; break;
-        }
-        cout << endl;
-        switch (instr.op) {
-            case OpCode::PUSH:
-                stack.push_back(toInt(instr.arg));
-                break;
-            case OpCode::LOAD:
-                stack.push_back(vars[instr.arg]);
-                break;
-            case OpCode::STORE: {
-                int val = stack.back(); stack.pop_back();
-                vars[instr.arg] = val;
-                break;
+#if HYBRID_COMPUTED_GOTO
+    if constexpr (!Trace::enabled) {
+        runThreaded(prog, state, out, budget);
+        state.steps = budget.used();
+        return;
+    }
+#endif
+    runSwitch<Trace>(prog, state, out, budget);
+    state.steps = budget.used();
+}
+
+template <typename Trace>
+inline void IRVM::runSwitch(const LinkedProgram& prog, VMState& state, OutputWriter& out, Budget& budget,
+                            Profiler* profiler) {
+    const LinkedInstr* code = prog.code.data();
+    const vector<Value>& frame = state.frame;
+    Value* const base = state.stack.data();
+    Value* sp = base;
+    Value* vars = state.frame.data();
+    size_t ip = 0;
+    // Backward jumps pay for the loop they close: its length in instructions
+    auto jumpTo = [&](size_t target) {
+        if (target < ip) {
+            budget.charge((int64_t)(ip - target));
+            if constexpr (Profiler::enabled) {
+                if (profiler) profiler->iteration(ip - 1);
             }
-            case OpCode::ADD: {
-                int b = stack.back(); stack.pop_back();
-                int a = stack.back(); stack.pop_back();
-                stack.push_back(a + b);
-                break;
+        }
+        ip = target;
+    };
+    // The last instruction's time is charged however the run ends
+    struct FinishProfile {
+        Profiler* profiler;
+        ~FinishProfile() {
+            if constexpr (Profiler::enabled) {
+                if (profiler) profiler->finish();
             }
-            case OpCode::SUB: {
-                int b = stack.back(); stack.pop_back();
-                int a = stack.back(); stack.pop_back();
-                stack.push_back(a - b);
+        }
+    } finishProfile{profiler};
+    for (;;) {
+        if constexpr (Profiler::enabled) {
+            if (profiler) profiler->enter(ip);
+        }
+        const auto& instr = code[ip++];
+        if constexpr (Trace::enabled) {
+            cout << "[VM] Executing: ";
+            printLinkedInstr(cout, prog, instr);
+            cout << "\n";
+        }
+        switch (instr.op) {
+            case OpCode::PUSH: *sp++ = Value::fromInt(instr.operand); break;
+            case OpCode::LOAD: *sp++ = vars[instr.operand]; break;
+            case OpCode::STORE: vars[instr.operand] = *--sp; break;
+            case OpCode::ADD: sp[-2] = arithmetic(ArithOp::Add, sp[-2], sp[-1]); --sp; break;
+            case OpCode::SUB: sp[-2] = arithmetic(ArithOp::Sub, sp[-2], sp[-1]); --sp; break;
+            case OpCode::MUL: sp[-2] = arithmetic(ArithOp::Mul, sp[-2], sp[-1]); --sp; break;
+            case OpCode::DIV: sp[-2] = arithmetic(ArithOp::Div, sp[-2], sp[-1]); --sp; break;
+            case OpCode::GT: sp[-2] = Value::fromBool(compare(CompareOp::Gt, sp[-2], sp[-1])); --sp; break;
+            case OpCode::LT: sp[-2] = Value::fromBool(compare(CompareOp::Lt, sp[-2], sp[-1])); --sp; break;
+            case OpCode::EQ: sp[-2] = Value::fromBool(compare(CompareOp::Eq, sp[-2], sp[-1])); --sp; break;
+            case OpCode::NE: sp[-2] = Value::fromBool(compare(CompareOp::Ne, sp[-2], sp[-1])); --sp; break;
+            case OpCode::LE: sp[-2] = Value::fromBool(compare(CompareOp::Le, sp[-2], sp[-1])); --sp; break;
+            case OpCode::GE: sp[-2] = Value::fromBool(compare(CompareOp::Ge, sp[-2], sp[-1])); --sp; break;
+            case OpCode::JZ: if (!(--sp)->truthy()) jumpTo(instr.operand); break;
+            case OpCode::JMP: jumpTo(instr.operand); break;
+            case OpCode::LABEL:
+            case OpCode::NOP:
                 break;
-            }
-            case OpCode::MUL: {
-                int b = stack.back(); stack.pop_back();
-                int a = stack.back(); stack.pop_back();
-                stack.push_back(a * b);
+            case OpCode::PRINT:
+                out.print((--sp)->toInt());
+                if constexpr (Trace::enabled) out.flush();
                 break;
-            }
-            case OpCode::DIV: {
-                int b = stack.back(); stack.pop_back();
-                int a = stack.back(); stack.pop_back();
-                stack.push_back(a / b);
+            case OpCode::POP: --sp; break;
+            case OpCode::INC:
+                vars[instr.operand] = arithmetic(ArithOp::Add, vars[instr.operand], Value::fromInt(instr.operand2));
                 break;
-            }
-            case OpCode::GT: {
-                int b = stack.back(); stack.pop_back();
-                int a = stack.back(); stack.pop_back();
-                stack.push_back(a > b ? 1 : 0);
+            case OpCode::PUSH_STORE: vars[instr.operand2] = Value::fromInt(instr.operand); break;
+            case OpCode::LOAD_STORE: vars[instr.operand2] = vars[instr.operand]; break;
+            case OpCode::LOAD_LOAD_ADD:
+                *sp++ = arithmetic(ArithOp::Add, vars[instr.operand], vars[instr.operand2]);
                 break;
-            }
-            case OpCode::LT: {
-                int b = stack.back(); stack.pop_back();
-                int a = stack.back(); stack.pop_back();
-                stack.push_back(a < b ? 1 : 0);
+            case OpCode::JLT:
+                if (compare(CompareOp::Lt, vars[instr.operand], vars[instr.operand2])) jumpTo(instr.operand3);
                 break;
-            }
-            case OpCode::EQ: {
-                int b = stack.back(); stack.pop_back();
-                int a = stack.back(); stack.pop_back();
-                stack.push_back(a == b ? 1 : 0);
+            case OpCode::JLE:
+                if (compare(CompareOp::Le, vars[instr.operand], vars[instr.operand2])) jumpTo(instr.operand3);
                 break;
-            }
-            case OpCode::JZ: {
-                int cond = stack.back(); stack.pop_back();
-                if (cond == 0) {
-                    ip = labels[instr.arg];
-                }
+            case OpCode::JGT:
+                if (compare(CompareOp::Gt, vars[instr.operand], vars[instr.operand2])) jumpTo(instr.operand3);
                 break;
-            }
-            case OpCode::JMP:
-                ip = labels[instr.arg];
+            case OpCode::JGE:
+                if (compare(CompareOp::Ge, vars[instr.operand], vars[instr.operand2])) jumpTo(instr.operand3);
                 break;
-            case OpCode::LABEL:
-            case OpCode::NOP:
+            case OpCode::JEQ:
+                if (compare(CompareOp::Eq, vars[instr.operand], vars[instr.operand2])) jumpTo(instr.operand3);
                 break;
-            case OpCode::PRINT: {
-                int val = stack.back(); stack.pop_back();
-                std::cout << "print: " << val << std::endl;
+            case OpCode::JNE:
+                if (compare(CompareOp::Ne, vars[instr.operand], vars[instr.operand2])) jumpTo(instr.operand3);
                 break;
-            }
+            case OpCode::HALT: goto done;
+        }
+        if constexpr (Trace::enabled) {
+            cout << "[VM] Stack: ";
+            for (Value* p = base; p < sp; ++p) cout << *p << " ";
+            cout << "| Vars: ";
+            for (size_t i = 0; i < frame.size(); ++i) cout << prog.slotNames[i] << "=" << frame[i] << " ";
+            cout << "\n";
         }
-        cout << "[VM] Stack: ";
-        for (auto v : stack) cout << v << " ";
-        cout << "| Vars: ";
-        for (const auto& [k, v] : vars) cout << k << "=" << v << " ";
-        cout << endl;
-    }
-    cout << "\n=== VM Variable State ===\n";
-    for (const auto& [k, v] : vars) {
-        cout << k << " = " << v << endl;
-    }
-}
-
-inline void compileAST(const shared_ptr<ASTNode>& node, IRProgram& ir, int& labelCount) {
-    if (!node) return;
-    if (auto block = dynamic_pointer_cast<Block>(node)) {
-        for (auto& stmt : block->statements) compileAST(stmt, ir, labelCount);
-    } else if (auto assign = dynamic_pointer_cast<Assignment>(node)) {
-        compileAST(assign->value, ir, labelCount);
-        ir.instructions.emplace_back(OpCode::STORE, assign->name);
-        cout << "[Compiler] STORE " << assign->name << endl;
-    } else if (auto bin = dynamic_pointer_cast<BinaryExpr>(node)) {
-        compileAST(bin->left, ir, labelCount);
-        compileAST(bin->right, ir, labelCount);
-        if (bin->op == "+") { ir.instructions.emplace_back(OpCode::ADD); cout << "[Compiler] ADD" << endl; }
-        else if (bin->op == "-") { ir.instructions.emplace_back(OpCode::SUB); cout << "[Compiler] SUB" << endl; }
-        else if (bin->op == "*") { ir.instructions.emplace_back(OpCode::MUL); cout << "[Compiler] MUL" << endl; }
-        else if (bin->op == "/") { ir.instructions.emplace_back(OpCode::DIV); cout << "[Compiler] DIV" << endl; }
-        else if (bin->op == ">") { ir.instructions.emplace_back(OpCode::GT); cout << "[Compiler] GT" << endl; }
-        else if (bin->op == "<") { ir.instructions.emplace_back(OpCode::LT); cout << "[Compiler] LT" << endl; }
-        else if (bin->op == "==") { ir.instructions.emplace_back(OpCode::EQ); cout << "[Compiler] EQ" << endl; }
-    } else if (auto lit = dynamic_pointer_cast<Literal>(node)) {
-        ir.instructions.emplace_back(OpCode::PUSH, to_string(lit->value));
-        cout << "[Compiler] PUSH " << lit->value << endl;
-    } else if (auto id = dynamic_pointer_cast<Identifier>(node)) {
-        ir.instructions.emplace_back(OpCode::LOAD, id->name);
-        cout << "[Compiler] LOAD " << id->name << endl;
-    } else if (auto iff = dynamic_pointer_cast<IfStmt>(node)) {
-        string elseLabel = "L_else_" + to_string(labelCount++);
-        string endLabel = "L_end_" + to_string(labelCount++);
-        compileAST(iff->condition, ir, labelCount);
-        ir.instructions.emplace_back(OpCode::JZ, elseLabel);
-        cout << "[Compiler] JZ " << elseLabel << endl;
-        compileAST(iff->thenBranch, ir, labelCount);
-        ir.instructions.emplace_back(OpCode::JMP, endLabel);
-        cout << "[Compiler] JMP " << endLabel << endl;
-        ir.instructions.emplace_back(OpCode::LABEL, elseLabel);
-        cout << "[Compiler] LABEL " << elseLabel << endl;
-        if (iff->elseBranch) compileAST(iff->elseBranch, ir, labelCount);
-        ir.instructions.emplace_back(OpCode::LABEL, endLabel);
-        cout << "[Compiler] LABEL " << endLabel << endl;
-    } else if (auto wh = dynamic_pointer_cast<WhileStmt>(node)) {
-        string startLabel = "L_start_" + to_string(labelCount++);
-        string endLabel = "L_end_" + to_string(labelCount++);
-        ir.instructions.emplace_back(OpCode::LABEL, startLabel);
-        cout << "[Compiler] LABEL " << startLabel << endl;
-        compileAST(wh->condition, ir, labelCount);
-        ir.instructions.emplace_back(OpCode::JZ, endLabel);
-        cout << "[Compiler] JZ " << endLabel << endl;
-        compileAST(wh->body, ir, labelCount);
-        ir.instructions.emplace_back(OpCode::JMP, startLabel);
-        cout << "[Compiler] JMP " << startLabel << endl;
-        ir.instructions.emplace_back(OpCode::LABEL, endLabel);
-    } else if (auto print = dynamic_pointer_cast<PrintStmt>(node)) {
-        compileAST(print->expr, ir, labelCount);
-        ir.instructions.emplace_back(OpCode::PRINT);
-        cout << "[Compiler] PRINT" << endl;
-    }
-} 
\ No newline at end of file
+    }
+done:
+    if constexpr (Trace::enabled) {
+        cout << "\n=== VM Variable State ===\n";
+        for (size_t i = 0; i < frame.size(); ++i) {
+            cout << prog.slotNames[i] << " = " << frame[i] << "\n";
+        }
+    }
+}
+
+#if HYBRID_COMPUTED_GOTO
+inline void IRVM::runThreaded(const LinkedProgram& prog, VMState& state, OutputWriter& out, Budget& budget) {
+    // Indexed by OpCode; must follow the enum order
+    static const void* const handlers[] = {
+        &&op_PUSH, &&op_LOAD, &&op_STORE, &&op_ADD, &&op_SUB, &&op_MUL, &&op_DIV,
+        &&op_GT, &&op_LT, &&op_EQ, &&op_NE, &&op_LE, &&op_GE, &&op_JZ, &&op_JMP,
+        &&op_LABEL, &&op_NOP, &&op_PRINT, &&op_POP, &&op_INC, &&op_PUSH_STORE,
+        &&op_LOAD_STORE, &&op_LOAD_LOAD_ADD, &&op_JLT, &&op_JLE, &&op_JGT, &&op_JGE,
+        &&op_JEQ, &&op_JNE, &&op_HALT
+    };
+    static_assert(sizeof(handlers) / sizeof(handlers[0]) == (size_t)OpCode::HALT + 1,
+                  "handler table out of sync with OpCode");
+
+    const LinkedInstr* const code = prog.code.data();
+    Value* sp = state.stack.data();
+    Value* vars = state.frame.data();
+    const LinkedInstr* ip = code;
+
+#define VM_NEXT() goto *handlers[(size_t)(ip++)->op]
+#define VM_OPERAND (ip[-1].operand)
+#define VM_OPERAND2 (ip[-1].operand2)
+#define VM_OPERAND3 (ip[-1].operand3)
+// Backward jumps pay for the loop they close: its length in instructions
+#define VM_JUMP(target) do { \
+        const LinkedInstr* to = code + (target); \
+        if (to < ip) budget.charge(ip - to); \
+        ip = to; \
+    } while (0)
+#define VM_ARITH(op) sp[-2] = arithmetic(ArithOp::op, sp[-2], sp[-1]); --sp; VM_NEXT()
+#define VM_COMPARE(op) sp[-2] = Value::fromBool(compare(CompareOp::op, sp[-2], sp[-1])); --sp; VM_NEXT()
+#define VM_BRANCH(op) \
+    if (compare(CompareOp::op, vars[VM_OPERAND], vars[VM_OPERAND2])) VM_JUMP(VM_OPERAND3); \
+    VM_NEXT()
+
+    VM_NEXT();
+op_PUSH:  *sp++ = Value::fromInt(VM_OPERAND); VM_NEXT();
+op_LOAD:  *sp++ = vars[VM_OPERAND]; VM_NEXT();
+op_STORE: vars[VM_OPERAND] = *--sp; VM_NEXT();
+op_ADD:   VM_ARITH(Add);
+op_SUB:   VM_ARITH(Sub);
+op_MUL:   VM_ARITH(Mul);
+op_DIV:   VM_ARITH(Div);
+op_GT:    VM_COMPARE(Gt);
+op_LT:    VM_COMPARE(Lt);
+op_EQ:    VM_COMPARE(Eq);
+op_NE:    VM_COMPARE(Ne);
+op_LE:    VM_COMPARE(Le);
+op_GE:    VM_COMPARE(Ge);
+op_JZ:    if (!(--sp)->truthy()) VM_JUMP(VM_OPERAND); VM_NEXT();
+op_JMP:   VM_JUMP(VM_OPERAND); VM_NEXT();
+op_LABEL:
+op_NOP:   VM_NEXT();
+op_PRINT: out.print((--sp)->toInt()); VM_NEXT();
+op_POP:   --sp; VM_NEXT();
+op_INC:   vars[VM_OPERAND] = arithmetic(ArithOp::Add, vars[VM_OPERAND], Value::fromInt(VM_OPERAND2)); VM_NEXT();
+op_PUSH_STORE:    vars[VM_OPERAND2] = Value::fromInt(VM_OPERAND); VM_NEXT();
+op_LOAD_STORE:    vars[VM_OPERAND2] = vars[VM_OPERAND]; VM_NEXT();
+op_LOAD_LOAD_ADD: *sp++ = arithmetic(ArithOp::Add, vars[VM_OPERAND], vars[VM_OPERAND2]); VM_NEXT();
+op_JLT:   VM_BRANCH(Lt);
+op_JLE:   VM_BRANCH(Le);
+op_JGT:   VM_BRANCH(Gt);
+op_JGE:   VM_BRANCH(Ge);
+op_JEQ:   VM_BRANCH(Eq);
+op_JNE:   VM_BRANCH(Ne);
+op_HALT:  return;
+
+#undef VM_BRANCH
+#undef VM_COMPARE
+#undef VM_ARITH
+#undef VM_JUMP
+#undef VM_OPERAND3
+#undef VM_OPERAND2
+#undef VM_OPERAND
+#undef VM_NEXT
+}
+#endif
+
+inline OpCode binOpCode(BinOp op) {
+    switch (op) {
+        case BinOp::Add: return OpCode::ADD;
+        case BinOp::Sub: return OpCode::SUB;
+        case BinOp::Mul: return OpCode::MUL;
+        case BinOp::Div: return OpCode::DIV;
+        case BinOp::Eq: return OpCode::EQ;
+        case BinOp::Ne: return OpCode::NE;
+        case BinOp::Lt: return OpCode::LT;
+        case BinOp::Gt: return OpCode::GT;
+        case BinOp::Le: return OpCode::LE;
+        case BinOp::Ge: return OpCode::GE;
+    }
+    return OpCode::NOP;
+}
+
+// `outerLine` tags the code of a node that has no line of its own
+template <typename Trace>
+inline void compileAST(const AST& ast, NodeId id, IRProgram& ir, int& labelCount, int outerLine = 0);
+
+// Compile a statement; expression statements discard their value
+template <typename Trace>
+inline void compileStatement(const AST& ast, NodeId id, IRProgram& ir, int& labelCount, int outerLine = 0) {
+    compileAST<Trace>(ast, id, ir, labelCount, outerLine);
+    if (id == NO_NODE) return;
+    NodeKind kind = ast[id].kind;
+    if (kind == NodeKind::Literal || kind == NodeKind::Identifier || kind == NodeKind::BinaryExpr) {
+        ir.instructions.emplace_back(OpCode::POP);
+        ir.instructions.back().line = ast.lineOf(id) ? (int)ast.lineOf(id) : outerLine;
+        if constexpr (Trace::enabled) cout << "[Compiler] POP\n";
+    }
+}
+
+// Compile an AST to IR; Trace selects the tracing policy
+template <typename Trace = QuietTrace>
+inline void compileAST(const AST& ast, NodeId id, IRProgram& ir, int& labelCount, int outerLine) {
+    if (id == NO_NODE) return;
+    const ASTNode& node = ast[id];
+    // Every instruction is tagged with the line of the node that emits it
+    int line = ast.lineOf(id) ? (int)ast.lineOf(id) : outerLine;
+    auto emit = [&](OpCode op, const string& arg = "") {
+        ir.instructions.emplace_back(op, arg);
+        ir.instructions.back().line = line;
+    };
+    switch (node.kind) {
+        case NodeKind::Block:
+            for (NodeId stmt : ast.statements(node)) compileStatement<Trace>(ast, stmt, ir, labelCount, line);
+            break;
+        case NodeKind::Assignment: {
+            string name(ast.name(node.assign.name));
+            compileAST<Trace>(ast, node.assign.value, ir, labelCount, line);
+            emit(OpCode::STORE, name);
+            if constexpr (Trace::enabled) cout << "[Compiler] STORE " << name << "\n";
+            break;
+        }
+        case NodeKind::BinaryExpr: {
+            compileAST<Trace>(ast, node.binary.left, ir, labelCount, line);
+            compileAST<Trace>(ast, node.binary.right, ir, labelCount, line);
+            OpCode op = binOpCode(node.op);
+            emit(op);
+            if constexpr (Trace::enabled) cout << "[Compiler] " << opName(op) << "\n";
+            break;
+        }
+        case NodeKind::Literal:
+            emit(OpCode::PUSH, to_string(node.literal));
+            if constexpr (Trace::enabled) cout << "[Compiler] PUSH " << node.literal << "\n";
+            break;
+        case NodeKind::Identifier: {
+            string name(ast.name(node.identifier.name));
+            emit(OpCode::LOAD, name);
+            if constexpr (Trace::enabled) cout << "[Compiler] LOAD " << name << "\n";
+            break;
+        }
+        case NodeKind::IfStmt: {
+            string elseLabel = "L_else_" + to_string(labelCount++);
+            string endLabel = "L_end_" + to_string(labelCount++);
+            compileAST<Trace>(ast, node.ifStmt.cond, ir, labelCount, line);
+            emit(OpCode::JZ, elseLabel);
+            if constexpr (Trace::enabled) cout << "[Compiler] JZ " << elseLabel << "\n";
+            compileStatement<Trace>(ast, node.ifStmt.thenBranch, ir, labelCount, line);
+            emit(OpCode::JMP, endLabel);
+            if constexpr (Trace::enabled) cout << "[Compiler] JMP " << endLabel << "\n";
+            emit(OpCode::LABEL, elseLabel);
+            if constexpr (Trace::enabled) cout << "[Compiler] LABEL " << elseLabel << "\n";
+            compileStatement<Trace>(ast, node.ifStmt.elseBranch, ir, labelCount, line);
+            emit(OpCode::LABEL, endLabel);
+            if constexpr (Trace::enabled) cout << "[Compiler] LABEL " << endLabel << "\n";
+            break;
+        }
+        case NodeKind::WhileStmt: {
+            string startLabel = "L_start_" + to_string(labelCount++);
+            string endLabel = "L_end_" + to_string(labelCount++);
+            emit(OpCode::LABEL, startLabel);
+            if constexpr (Trace::enabled) cout << "[Compiler] LABEL " << startLabel << "\n";
+            compileAST<Trace>(ast, node.whileStmt.cond, ir, labelCount, line);
+            emit(OpCode::JZ, endLabel);
+            if constexpr (Trace::enabled) cout << "[Compiler] JZ " << endLabel << "\n";
+            compileStatement<Trace>(ast, node.whileStmt.body, ir, labelCount, line);
+            emit(OpCode::JMP, startLabel);
+            if constexpr (Trace::enabled) cout << "[Compiler] JMP " << startLabel << "\n";
+            emit(OpCode::LABEL, endLabel);
+            break;
+        }
+        case NodeKind::PrintStmt:
+            compileAST<Trace>(ast, node.print, ir, labelCount, line);
+            emit(OpCode::PRINT);
+            if constexpr (Trace::enabled) cout << "[Compiler] PRINT\n";
+            break;
+    }
+}
+
+template <typename Trace = QuietTrace>
+inline void compileAST(const AST& ast, IRProgram& ir, int& labelCount) {
+    compileAST<Trace>(ast, ast.root, ir, labelCount);
+}
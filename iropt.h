@@ -0,0 +1,227 @@
+#pragma once
+#include <climits>
+#include <functional>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "ir.h"
+using namespace std;
+
+// Peephole optimizer over IRProgram: jump threading, unreachable code and
+// label cleanup, and fusion of hot instruction sequences into
+// superinstructions.
+
+// A fusion replaces a window of instructions matching `pattern` with one
+// superinstruction. build() fills `fused` from the window and may reject the
+// match (e.g. when operands do not line up). New fusions are added by
+// appending a rule to fusionRules().
+struct FusionRule {
+    string name;
+    vector<OpCode> pattern;
+    function<bool(const IRInstr* window, IRInstr& fused)> build;
+};
+
+struct PeepholeStats {
+    map<string, int> fused; // Rule name -> times applied
+    int jumpsThreaded = 0;
+    int jumpsRemoved = 0;
+    int deadRemoved = 0;
+    int labelsRemoved = 0;
+};
+
+// Compare-and-branch that jumps when `cmp` is false (the JZ of a condition)
+inline OpCode branchIfNot(OpCode cmp) {
+    switch (cmp) {
+        case OpCode::LT: return OpCode::JGE;
+        case OpCode::LE: return OpCode::JGT;
+        case OpCode::GT: return OpCode::JLE;
+        case OpCode::GE: return OpCode::JLT;
+        case OpCode::EQ: return OpCode::JNE;
+        case OpCode::NE: return OpCode::JEQ;
+        default: return OpCode::NOP;
+    }
+}
+
+inline const vector<FusionRule>& fusionRules() {
+    static const vector<FusionRule> rules = [] {
+        vector<FusionRule> r;
+        // x = x + k
+        r.push_back({"INC", {OpCode::LOAD, OpCode::PUSH, OpCode::ADD, OpCode::STORE},
+            [](const IRInstr* w, IRInstr& fused) {
+                if (w[0].arg != w[3].arg) return false;
+                fused = IRInstr(OpCode::INC, w[0].arg, w[1].arg);
+                return true;
+            }});
+        // x = x - k
+        r.push_back({"INC", {OpCode::LOAD, OpCode::PUSH, OpCode::SUB, OpCode::STORE},
+            [](const IRInstr* w, IRInstr& fused) {
+                if (w[0].arg != w[3].arg || toInt(w[1].arg) == INT_MIN) return false;
+                fused = IRInstr(OpCode::INC, w[0].arg, to_string(-toInt(w[1].arg)));
+                return true;
+            }});
+        // while (a < b) / if (a < b) and the other comparisons
+        for (OpCode cmp : {OpCode::LT, OpCode::LE, OpCode::GT, OpCode::GE, OpCode::EQ, OpCode::NE}) {
+            r.push_back({string(opName(branchIfNot(cmp))), {OpCode::LOAD, OpCode::LOAD, cmp, OpCode::JZ},
+                [cmp](const IRInstr* w, IRInstr& fused) {
+                    fused = IRInstr(branchIfNot(cmp), w[0].arg, w[1].arg, w[3].arg);
+                    return true;
+                }});
+        }
+        r.push_back({"LOAD_LOAD_ADD", {OpCode::LOAD, OpCode::LOAD, OpCode::ADD},
+            [](const IRInstr* w, IRInstr& fused) {
+                fused = IRInstr(OpCode::LOAD_LOAD_ADD, w[0].arg, w[1].arg);
+                return true;
+            }});
+        r.push_back({"PUSH_STORE", {OpCode::PUSH, OpCode::STORE},
+            [](const IRInstr* w, IRInstr& fused) {
+                fused = IRInstr(OpCode::PUSH_STORE, w[0].arg, w[1].arg);
+                return true;
+            }});
+        r.push_back({"LOAD_STORE", {OpCode::LOAD, OpCode::STORE},
+            [](const IRInstr* w, IRInstr& fused) {
+                fused = IRInstr(OpCode::LOAD_STORE, w[0].arg, w[1].arg);
+                return true;
+            }});
+        return r;
+    }();
+    return rules;
+}
+
+// Label operand of a jump, or nullptr
+inline string* jumpTarget(IRInstr& instr) {
+    if (instr.op == OpCode::LABEL) return nullptr;
+    OperandKinds kinds = operandKinds(instr.op);
+    string* args[3] = {&instr.arg, &instr.arg2, &instr.arg3};
+    for (int k = 0; k < 3; ++k) {
+        if (kinds[k] == OperandKind::LABEL) return args[k];
+    }
+    return nullptr;
+}
+
+// Retarget jumps whose destination is itself a JMP, and drop JMPs to the
+// label that immediately follows them
+inline void threadJumps(vector<IRInstr>& code, PeepholeStats& stats) {
+    unordered_map<string, size_t> labelAt;
+    for (size_t i = 0; i < code.size(); ++i) {
+        if (code[i].op == OpCode::LABEL) labelAt[code[i].arg] = i;
+    }
+    // First real instruction at or after a label
+    auto landing = [&](const string& label) -> const IRInstr* {
+        for (size_t i = labelAt.at(label); i < code.size(); ++i) {
+            if (code[i].op != OpCode::LABEL && code[i].op != OpCode::NOP) return &code[i];
+        }
+        return nullptr;
+    };
+    for (auto& instr : code) {
+        string* target = jumpTarget(instr);
+        if (!target) continue;
+        // Bounded so jump cycles (while (1) {}) terminate
+        for (size_t hops = 0; hops < code.size(); ++hops) {
+            const IRInstr* next = landing(*target);
+            if (!next || next->op != OpCode::JMP || next->arg == *target) break;
+            *target = next->arg;
+            ++stats.jumpsThreaded;
+        }
+    }
+    vector<IRInstr> out;
+    out.reserve(code.size());
+    for (size_t i = 0; i < code.size(); ++i) {
+        if (code[i].op == OpCode::JMP) {
+            size_t j = i + 1;
+            bool fallsThrough = false;
+            while (j < code.size() && (code[j].op == OpCode::LABEL || code[j].op == OpCode::NOP)) {
+                if (code[j].op == OpCode::LABEL && code[j].arg == code[i].arg) fallsThrough = true;
+                ++j;
+            }
+            if (fallsThrough) {
+                ++stats.jumpsRemoved;
+                continue;
+            }
+        }
+        out.push_back(std::move(code[i]));
+    }
+    code = std::move(out);
+}
+
+// Remove code after an unconditional JMP up to the next referenced label,
+// then unreferenced labels and NOPs. Returns true if anything changed.
+inline bool removeDeadCode(vector<IRInstr>& code, PeepholeStats& stats) {
+    unordered_set<string> referenced;
+    for (auto& instr : code) {
+        if (string* target = jumpTarget(instr)) referenced.insert(*target);
+    }
+    vector<IRInstr> out;
+    out.reserve(code.size());
+    bool reachable = true;
+    bool changed = false;
+    for (auto& instr : code) {
+        bool liveLabel = instr.op == OpCode::LABEL && referenced.count(instr.arg);
+        if (liveLabel) reachable = true;
+        if (!reachable) {
+            if (instr.op == OpCode::LABEL) ++stats.labelsRemoved;
+            else ++stats.deadRemoved;
+            changed = true;
+            continue;
+        }
+        if ((instr.op == OpCode::LABEL && !liveLabel) || instr.op == OpCode::NOP) {
+            if (instr.op == OpCode::LABEL) ++stats.labelsRemoved;
+            changed = true;
+            continue;
+        }
+        if (instr.op == OpCode::JMP) reachable = false;
+        out.push_back(std::move(instr));
+    }
+    code = std::move(out);
+    return changed;
+}
+
+inline void fuseInstructions(vector<IRInstr>& code, PeepholeStats& stats) {
+    const auto& rules = fusionRules();
+    vector<IRInstr> out;
+    out.reserve(code.size());
+    size_t i = 0;
+    while (i < code.size()) {
+        bool matched = false;
+        for (const auto& rule : rules) {
+            size_t n = rule.pattern.size();
+            if (i + n > code.size()) continue;
+            bool same = true;
+            for (size_t k = 0; k < n && same; ++k) same = code[i + k].op == rule.pattern[k];
+            IRInstr fused(OpCode::NOP);
+            if (!same || !rule.build(&code[i], fused)) continue;
+            fused.line = code[i].line;
+            out.push_back(std::move(fused));
+            ++stats.fused[rule.name];
+            i += n;
+            matched = true;
+            break;
+        }
+        if (!matched) out.push_back(std::move(code[i++]));
+    }
+    code = std::move(out);
+}
+
+inline PeepholeStats optimizeIR(IRProgram& prog) {
+    PeepholeStats stats;
+    auto& code = prog.instructions;
+    auto cleanup = [&] {
+        do {
+            threadJumps(code, stats);
+        } while (removeDeadCode(code, stats));
+    };
+    cleanup();
+    fuseInstructions(code, stats);
+    cleanup();
+    return stats;
+}
+
+inline void printPeepholeStats(const PeepholeStats& stats, ostream& os = cout) {
+    os << "[Peephole] threaded " << stats.jumpsThreaded << " jump(s), removed "
+         << stats.jumpsRemoved << " jump(s), " << stats.deadRemoved << " dead instruction(s), "
+         << stats.labelsRemoved << " label(s)\n";
+    for (const auto& [name, count] : stats.fused) {
+        os << "[Peephole] fused " << name << " x" << count << "\n";
+    }
+}
@@ -0,0 +1,311 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+#include "ir.h"
+#include "trace.h"
+using namespace std;
+
+// x86-64 JIT for linked bytecode. Every instruction is translated to a short
+// native sequence in an mmap'd buffer that is then called directly.
+//
+// Register use inside the generated code:
+//   rbx = variable frame (one int32 per slot)
+//   r14 = operand stack pointer (grows upwards, like the VM's sp)
+//   r15 = OutputWriter*, passed to the PRINT helper
+// All three are callee-saved, so calls into the runtime leave them intact.
+// The generated code returns a JITStatus in eax. Run-time errors jump to a
+// stub that returns its status, and run() throws from C++, since no
+// exception can unwind through the generated frames.
+#if defined(__x86_64__) && defined(__linux__) && !defined(HYBRID_NO_JIT)
+#define HYBRID_JIT 1
+#include <sys/mman.h>
+#else
+#define HYBRID_JIT 0
+#endif
+
+enum JITStatus : int { JIT_DONE, JIT_DIVISION_BY_ZERO, JIT_DIVISION_OVERFLOW };
+
+class JITCode {
+public:
+    JITCode() = default;
+    JITCode(const JITCode&) = delete;
+    JITCode& operator=(const JITCode&) = delete;
+    ~JITCode() { release(); }
+
+    // Native code generation is available on this target
+    static constexpr bool supported() { return HYBRID_JIT != 0; }
+
+    // Translate and map the program. Returns false when the target is not
+    // supported or the executable mapping could not be created; the caller
+    // should then run the bytecode on the VM instead.
+    template <typename Trace = QuietTrace>
+    bool compile(const LinkedProgram& prog);
+
+    // Throws runtime_error on a division error, like the VM
+    void run(OutputWriter& out) const;
+
+    size_t size() const { return codeSize; }
+
+private:
+    using EntryFn = int (*)(int* frame, int* stack, OutputWriter* out);
+
+    void* mapping = nullptr;
+    size_t mappingSize = 0;
+    size_t codeSize = 0;
+    size_t slotCount = 0;
+    size_t stackSize = 0;
+
+    void release();
+};
+
+// Runtime helper called from generated code for PRINT
+inline void jitPrint(OutputWriter* out, int value) {
+    out->print(value);
+}
+
+#if HYBRID_JIT
+// Minimal byte emitter for the handful of encodings the JIT needs
+class X64Emitter {
+public:
+    vector<uint8_t> bytes;
+
+    void emit(initializer_list<uint8_t> b) { bytes.insert(bytes.end(), b); }
+    void imm32(int32_t v) {
+        uint8_t b[4];
+        memcpy(b, &v, 4);
+        bytes.insert(bytes.end(), b, b + 4);
+    }
+    void imm64(uint64_t v) {
+        uint8_t b[8];
+        memcpy(b, &v, 8);
+        bytes.insert(bytes.end(), b, b + 8);
+    }
+    // Displacement of a frame slot from rbx
+    void slot(int index) { imm32(index * 4); }
+    size_t pos() const { return bytes.size(); }
+    void patch32(size_t at, int32_t v) { memcpy(&bytes[at], &v, 4); }
+
+    void pushTop() { emit({0x49, 0x83, 0xC6, 0x04}); }          // add r14, 4
+    void popTop() { emit({0x49, 0x83, 0xEE, 0x04}); }           // sub r14, 4
+    void loadSlot(int s) { emit({0x8B, 0x83}); slot(s); }       // mov eax, [rbx+s]
+    void storeSlot(int s) { emit({0x89, 0x83}); slot(s); }      // mov [rbx+s], eax
+    void storeTop() { emit({0x41, 0x89, 0x06}); }               // mov [r14], eax
+    void loadTop() { emit({0x41, 0x8B, 0x06}); }                // mov eax, [r14]
+    void loadSecond() { emit({0x41, 0x8B, 0x46, 0xFC}); }       // mov eax, [r14-4]
+    void storeSecond() { emit({0x41, 0x89, 0x46, 0xFC}); }      // mov [r14-4], eax
+};
+
+// Condition codes, shared by SETcc (0x0F 0x90+cc) and Jcc (0x0F 0x80+cc)
+enum : uint8_t { CC_E = 0x4, CC_NE = 0x5, CC_L = 0xC, CC_GE = 0xD, CC_LE = 0xE, CC_G = 0xF };
+
+inline uint8_t conditionCode(OpCode op) {
+    switch (op) {
+        case OpCode::EQ: case OpCode::JEQ: return CC_E;
+        case OpCode::NE: case OpCode::JNE: return CC_NE;
+        case OpCode::LT: case OpCode::JLT: return CC_L;
+        case OpCode::GE: case OpCode::JGE: return CC_GE;
+        case OpCode::LE: case OpCode::JLE: return CC_LE;
+        case OpCode::GT: case OpCode::JGT: return CC_G;
+        default: return CC_E;
+    }
+}
+#endif
+
+template <typename Trace>
+inline bool JITCode::compile(const LinkedProgram& prog) {
+#if HYBRID_JIT
+    release();
+    X64Emitter x;
+    vector<size_t> offsets(prog.code.size() + 1);
+    vector<pair<size_t, int>> fixups; // rel32 position -> bytecode target
+    vector<pair<size_t, JITStatus>> errorJumps; // rel32 position -> error stub
+
+    auto jumpTo = [&](int target) {
+        fixups.push_back({x.pos(), target});
+        x.imm32(0);
+    };
+
+    // Prologue: three pushes leave rsp 16-byte aligned for calls
+    x.emit({0x53, 0x41, 0x56, 0x41, 0x57});                   // push rbx; push r14; push r15
+    x.emit({0x48, 0x89, 0xFB, 0x49, 0x89, 0xF6, 0x49, 0x89, 0xD7}); // rbx=rdi, r14=rsi, r15=rdx
+
+    for (size_t i = 0; i < prog.code.size(); ++i) {
+        const LinkedInstr& instr = prog.code[i];
+        offsets[i] = x.pos();
+        switch (instr.op) {
+            case OpCode::PUSH:
+                x.emit({0x41, 0xC7, 0x06}); x.imm32(instr.operand); // mov dword [r14], imm
+                x.pushTop();
+                break;
+            case OpCode::LOAD:
+                x.loadSlot(instr.operand);
+                x.storeTop();
+                x.pushTop();
+                break;
+            case OpCode::STORE:
+                x.popTop();
+                x.loadTop();
+                x.storeSlot(instr.operand);
+                break;
+            case OpCode::ADD:
+                x.popTop(); x.loadTop();
+                x.emit({0x41, 0x01, 0x46, 0xFC});                  // add [r14-4], eax
+                break;
+            case OpCode::SUB:
+                x.popTop(); x.loadTop();
+                x.emit({0x41, 0x29, 0x46, 0xFC});                  // sub [r14-4], eax
+                break;
+            case OpCode::MUL:
+                x.popTop(); x.loadSecond();
+                x.emit({0x41, 0x0F, 0xAF, 0x06});                  // imul eax, [r14]
+                x.storeSecond();
+                break;
+            case OpCode::DIV:
+                // idiv traps on a zero divisor and on INT_MIN / -1
+                x.popTop();
+                x.emit({0x41, 0x8B, 0x0E});                        // mov ecx, [r14]
+                x.emit({0x85, 0xC9});                              // test ecx, ecx
+                x.emit({0x0F, 0x84});                              // je division by zero
+                errorJumps.push_back({x.pos(), JIT_DIVISION_BY_ZERO});
+                x.imm32(0);
+                x.loadSecond();
+                x.emit({0x83, 0xF9, 0xFF});                        // cmp ecx, -1
+                x.emit({0x75, 0x0B});                              // jne over the next two
+                x.emit({0x3D}); x.imm32(INT32_MIN);                // cmp eax, INT_MIN
+                x.emit({0x0F, 0x84});                              // je division overflow
+                errorJumps.push_back({x.pos(), JIT_DIVISION_OVERFLOW});
+                x.imm32(0);
+                x.emit({0x99, 0xF7, 0xF9});                        // cdq; idiv ecx
+                x.storeSecond();
+                break;
+            case OpCode::GT: case OpCode::LT: case OpCode::EQ:
+            case OpCode::NE: case OpCode::LE: case OpCode::GE:
+                x.popTop(); x.loadSecond();
+                x.emit({0x41, 0x3B, 0x06});                        // cmp eax, [r14]
+                x.emit({0x0F, (uint8_t)(0x90 | conditionCode(instr.op)), 0xC0}); // setcc al
+                x.emit({0x0F, 0xB6, 0xC0});                        // movzx eax, al
+                x.storeSecond();
+                break;
+            case OpCode::JZ:
+                x.popTop();
+                x.emit({0x41, 0x83, 0x3E, 0x00});                  // cmp dword [r14], 0
+                x.emit({0x0F, 0x84}); jumpTo(instr.operand);       // je
+                break;
+            case OpCode::JMP:
+                x.emit({0xE9}); jumpTo(instr.operand);
+                break;
+            case OpCode::LABEL:
+            case OpCode::NOP:
+                break;
+            case OpCode::PRINT:
+                x.popTop();
+                x.emit({0x41, 0x8B, 0x36});                        // mov esi, [r14]
+                x.emit({0x4C, 0x89, 0xFF});                        // mov rdi, r15
+                x.emit({0x48, 0xB8}); x.imm64((uint64_t)(uintptr_t)&jitPrint); // mov rax, helper
+                x.emit({0xFF, 0xD0});                              // call rax
+                break;
+            case OpCode::POP:
+                x.popTop();
+                break;
+            case OpCode::INC:
+                x.emit({0x81, 0x83}); x.slot(instr.operand); x.imm32(instr.operand2); // add [rbx+s], imm
+                break;
+            case OpCode::PUSH_STORE:
+                x.emit({0xC7, 0x83}); x.slot(instr.operand2); x.imm32(instr.operand); // mov [rbx+s], imm
+                break;
+            case OpCode::LOAD_STORE:
+                x.loadSlot(instr.operand);
+                x.storeSlot(instr.operand2);
+                break;
+            case OpCode::LOAD_LOAD_ADD:
+                x.loadSlot(instr.operand);
+                x.emit({0x03, 0x83}); x.slot(instr.operand2);      // add eax, [rbx+s]
+                x.storeTop();
+                x.pushTop();
+                break;
+            case OpCode::JLT: case OpCode::JLE: case OpCode::JGT:
+            case OpCode::JGE: case OpCode::JEQ: case OpCode::JNE:
+                x.loadSlot(instr.operand);
+                x.emit({0x3B, 0x83}); x.slot(instr.operand2);      // cmp eax, [rbx+s]
+                x.emit({0x0F, (uint8_t)(0x80 | conditionCode(instr.op))}); jumpTo(instr.operand3);
+                break;
+            case OpCode::HALT:
+                x.emit({0x31, 0xC0});                              // xor eax, eax (JIT_DONE)
+                x.emit({0x41, 0x5F, 0x41, 0x5E, 0x5B, 0xC3});      // pop r15; pop r14; pop rbx; ret
+                break;
+        }
+        if constexpr (Trace::enabled) {
+            cout << "[JIT] " << i << ": ";
+            printLinkedInstr(cout, prog, instr);
+            cout << " ->" << hex << setfill('0');
+            for (size_t b = offsets[i]; b < x.pos(); ++b) cout << " " << setw(2) << (int)x.bytes[b];
+            cout << dec << setfill(' ') << "\n";
+        }
+    }
+    offsets[prog.code.size()] = x.pos();
+    for (auto [at, target] : fixups) {
+        x.patch32(at, (int32_t)(offsets[target] - (at + 4)));
+    }
+    // Error stubs: return the status through the HALT epilogue sequence
+    for (JITStatus status : {JIT_DIVISION_BY_ZERO, JIT_DIVISION_OVERFLOW}) {
+        size_t stub = x.pos();
+        bool used = false;
+        for (auto [at, target] : errorJumps) {
+            if (target != status) continue;
+            x.patch32(at, (int32_t)(stub - (at + 4)));
+            used = true;
+        }
+        if (!used) continue;
+        x.emit({0xB8}); x.imm32(status);                           // mov eax, status
+        x.emit({0x41, 0x5F, 0x41, 0x5E, 0x5B, 0xC3});              // pop r15; pop r14; pop rbx; ret
+    }
+
+    // Map writable, copy, then flip to executable (never both at once)
+    size_t page = 4096;
+    size_t length = (x.bytes.size() + page - 1) / page * page;
+    void* mem = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) return false;
+    memcpy(mem, x.bytes.data(), x.bytes.size());
+    if (mprotect(mem, length, PROT_READ | PROT_EXEC) != 0) {
+        munmap(mem, length);
+        return false;
+    }
+    mapping = mem;
+    mappingSize = length;
+    codeSize = x.bytes.size();
+    slotCount = prog.slotNames.size();
+    stackSize = prog.code.size() + 1;
+    if constexpr (Trace::enabled) {
+        cout << "[JIT] Emitted " << codeSize << " bytes for " << prog.code.size() << " instructions\n";
+    }
+    return true;
+#else
+    (void)prog;
+    return false;
+#endif
+}
+
+inline void JITCode::run(OutputWriter& out) const {
+#if HYBRID_JIT
+    if (!mapping) throw runtime_error("JIT: no compiled code");
+    vector<int> frame(slotCount, 0);
+    vector<int> stack(stackSize);
+    int status = reinterpret_cast<EntryFn>(mapping)(frame.data(), stack.data(), &out);
+    if (status == JIT_DIVISION_BY_ZERO) throw runtime_error("Division by zero");
+    if (status == JIT_DIVISION_OVERFLOW) throw runtime_error("Division overflow");
+#else
+    (void)out;
+    throw runtime_error("JIT: not supported on this target");
+#endif
+}
+
+inline void JITCode::release() {
+#if HYBRID_JIT
+    if (mapping) munmap(mapping, mappingSize);
+#endif
+    mapping = nullptr;
+    mappingSize = codeSize = 0;
+}
@@ -1,5 +1,4 @@
 #include "lexer.h"
-#include <sstream>
 
 using namespace std;
 
@@ -16,61 +15,156 @@ string tokenTypeToString(TokenType type) {
     }
 }
 
-vector<Token> tokenize(const string& code) {
+namespace {
+
+// Character classes for the scanner
+enum : unsigned char {
+    CH_OTHER = 0,
+    CH_SPACE = 1,
+    CH_IDENT_START = 2,
+    CH_DIGIT = 4
+};
+
+struct CharTable {
+    unsigned char cls[256] = {};
+    CharTable() {
+        for (unsigned char c : {' ', '\t', '\r', '\v', '\f'}) cls[c] = CH_SPACE;
+        for (int c = 'a'; c <= 'z'; ++c) cls[c] = CH_IDENT_START;
+        for (int c = 'A'; c <= 'Z'; ++c) cls[c] = CH_IDENT_START;
+        cls[(unsigned char)'_'] = CH_IDENT_START;
+        for (int c = '0'; c <= '9'; ++c) cls[c] = CH_DIGIT;
+    }
+};
+
+const CharTable chars;
+
+inline bool isSpaceChar(char c) { return chars.cls[(unsigned char)c] == CH_SPACE; }
+inline bool isIdentStart(char c) { return chars.cls[(unsigned char)c] == CH_IDENT_START; }
+inline bool isIdentChar(char c) { return chars.cls[(unsigned char)c] & (CH_IDENT_START | CH_DIGIT); }
+inline bool isDigitChar(char c) { return chars.cls[(unsigned char)c] == CH_DIGIT; }
+
+// Perfect hash over the keyword set: (5 * first + 4 * last + length) % 16
+// is collision-free, so a keyword test is one hash and one compare.
+struct Keyword {
+    string_view text;
+    TokenKind kind;
+};
+
+const Keyword keywordTable[16] = {
+    {"int", TokenKind::KW_INT}, {"else", TokenKind::KW_ELSE},
+    {"void", TokenKind::KW_VOID}, {"float", TokenKind::KW_FLOAT},
+    {"", TokenKind::IDENTIFIER}, {"print", TokenKind::KW_PRINT},
+    {"", TokenKind::IDENTIFIER}, {"if", TokenKind::KW_IF},
+    {"return", TokenKind::KW_RETURN}, {"for", TokenKind::KW_FOR},
+    {"", TokenKind::IDENTIFIER}, {"char", TokenKind::KW_CHAR},
+    {"while", TokenKind::KW_WHILE}, {"", TokenKind::IDENTIFIER},
+    {"bool", TokenKind::KW_BOOL}, {"", TokenKind::IDENTIFIER}
+};
+
+// Keyword kind of a word, or IDENTIFIER
+inline TokenKind keywordKind(string_view word) {
+    size_t h = (5u * (unsigned char)word.front() + 4u * (unsigned char)word.back() + word.size()) & 15u;
+    return keywordTable[h].text == word ? keywordTable[h].kind : TokenKind::IDENTIFIER;
+}
+
+} // namespace
+
+vector<Token> tokenize(string_view code, int firstLine) {
     vector<Token> tokens;
-    istringstream stream(code);
-    string line;
-    int lineNumber = 0;
-
-    regex keywordRegex("\\b(if|else|while|for|return|int|float|char|void|bool)\\b");
-    regex identifierRegex("[a-zA-Z_][a-zA-Z0-9_]*");
-    regex numberRegex("\\b\\d+(\\.\\d+)?\\b");
-    regex operatorRegex("==|!=|<=|>=|[+\\-*/=<>]");
-    regex separatorRegex("[\\(\\)\\{\\}\\[\\],;]");
-    regex stringLiteralRegex("\"(\\\\.|[^\"])*\"");
-    regex commentRegex("//.*");
-
-    while (getline(stream, line)) {
-        lineNumber++;
-        string::const_iterator searchStart(line.cbegin());
-
-        while (searchStart != line.cend()) {
-            smatch match;
-
-            if (regex_search(searchStart, line.cend(), match, commentRegex) && match.position() == 0) {
-                tokens.push_back({TokenType::COMMENT, match[0], lineNumber});
-                break;
-            }
-            else if (regex_search(searchStart, line.cend(), match, keywordRegex) && match.position() == 0) {
-                tokens.push_back({TokenType::KEYWORD, match[0], lineNumber});
-            }
-            else if (regex_search(searchStart, line.cend(), match, identifierRegex) && match.position() == 0) {
-                tokens.push_back({TokenType::IDENTIFIER, match[0], lineNumber});
-            }
-            else if (regex_search(searchStart, line.cend(), match, numberRegex) && match.position() == 0) {
-                tokens.push_back({TokenType::NUMBER, match[0], lineNumber});
-            }
-            else if (regex_search(searchStart, line.cend(), match, operatorRegex) && match.position() == 0) {
-                tokens.push_back({TokenType::OPERATOR, match[0], lineNumber});
-            }
-            else if (regex_search(searchStart, line.cend(), match, separatorRegex) && match.position() == 0) {
-                tokens.push_back({TokenType::SEPARATOR, match[0], lineNumber});
-            }
-            else if (regex_search(searchStart, line.cend(), match, stringLiteralRegex) && match.position() == 0) {
-                tokens.push_back({TokenType::STRING_LITERAL, match[0], lineNumber});
-            }
-            else if (isspace(*searchStart)) {
-                ++searchStart;
-                continue;
+    tokens.reserve(code.size() / 4 + 1);
+    const char* const begin = code.data();
+    const char* const end = begin + code.size();
+    const char* p = begin;
+    int lineNumber = firstLine;
+
+    auto emit = [&](TokenType type, TokenKind kind, const char* start) {
+        tokens.push_back({type, string_view(start, p - start), lineNumber, kind});
+    };
+
+    while (p < end) {
+        const char* start = p;
+        char c = *p;
+
+        if (c == '\n') {
+            ++lineNumber;
+            ++p;
+        }
+        else if (isSpaceChar(c)) {
+            ++p;
+        }
+        else if (isIdentStart(c)) {
+            while (++p < end && isIdentChar(*p)) {}
+            TokenKind kind = keywordKind(string_view(start, p - start));
+            emit(kind == TokenKind::IDENTIFIER ? TokenType::IDENTIFIER : TokenType::KEYWORD, kind, start);
+        }
+        else if (isDigitChar(c)) {
+            while (++p < end && isDigitChar(*p)) {}
+            if (p + 1 < end && *p == '.' && isDigitChar(p[1])) {
+                ++p;
+                while (++p < end && isDigitChar(*p)) {}
             }
-            else {
-                string unknown(1, *searchStart);
-                tokens.push_back({TokenType::UNKNOWN, unknown, lineNumber});
-                ++searchStart;
-                continue;
+            emit(TokenType::NUMBER, TokenKind::NUMBER, start);
+        }
+        else {
+            switch (c) {
+                case '/':
+                    if (p + 1 < end && p[1] == '/') {
+                        while (p < end && *p != '\n' && *p != '\r') ++p;
+                        emit(TokenType::COMMENT, TokenKind::COMMENT, start);
+                    } else {
+                        ++p;
+                        emit(TokenType::OPERATOR, TokenKind::SLASH, start);
+                    }
+                    break;
+                case '=':
+                    if (p + 1 < end && p[1] == '=') { p += 2; emit(TokenType::OPERATOR, TokenKind::EQ, start); }
+                    else { ++p; emit(TokenType::OPERATOR, TokenKind::ASSIGN, start); }
+                    break;
+                case '<':
+                    if (p + 1 < end && p[1] == '=') { p += 2; emit(TokenType::OPERATOR, TokenKind::LE, start); }
+                    else { ++p; emit(TokenType::OPERATOR, TokenKind::LT, start); }
+                    break;
+                case '>':
+                    if (p + 1 < end && p[1] == '=') { p += 2; emit(TokenType::OPERATOR, TokenKind::GE, start); }
+                    else { ++p; emit(TokenType::OPERATOR, TokenKind::GT, start); }
+                    break;
+                case '!':
+                    if (p + 1 < end && p[1] == '=') { p += 2; emit(TokenType::OPERATOR, TokenKind::NE, start); }
+                    else { ++p; emit(TokenType::UNKNOWN, TokenKind::UNKNOWN, start); }
+                    break;
+                case '+': ++p; emit(TokenType::OPERATOR, TokenKind::PLUS, start); break;
+                case '-': ++p; emit(TokenType::OPERATOR, TokenKind::MINUS, start); break;
+                case '*': ++p; emit(TokenType::OPERATOR, TokenKind::STAR, start); break;
+                case '(': ++p; emit(TokenType::SEPARATOR, TokenKind::LPAREN, start); break;
+                case ')': ++p; emit(TokenType::SEPARATOR, TokenKind::RPAREN, start); break;
+                case '{': ++p; emit(TokenType::SEPARATOR, TokenKind::LBRACE, start); break;
+                case '}': ++p; emit(TokenType::SEPARATOR, TokenKind::RBRACE, start); break;
+                case '[': ++p; emit(TokenType::SEPARATOR, TokenKind::LBRACKET, start); break;
+                case ']': ++p; emit(TokenType::SEPARATOR, TokenKind::RBRACKET, start); break;
+                case ',': ++p; emit(TokenType::SEPARATOR, TokenKind::COMMA, start); break;
+                case ';': ++p; emit(TokenType::SEPARATOR, TokenKind::SEMICOLON, start); break;
+                case '"': {
+                    // String literals end on the same line; an unterminated
+                    // quote is reported as a single unknown character
+                    const char* q = p + 1;
+                    while (q < end && *q != '"' && *q != '\n') {
+                        if (*q == '\\' && q + 1 < end && q[1] != '\n') ++q;
+                        ++q;
+                    }
+                    if (q < end && *q == '"') {
+                        p = q + 1;
+                        emit(TokenType::STRING_LITERAL, TokenKind::STRING_LITERAL, start);
+                    } else {
+                        ++p;
+                        emit(TokenType::UNKNOWN, TokenKind::UNKNOWN, start);
+                    }
+                    break;
+                }
+                default:
+                    ++p;
+                    emit(TokenType::UNKNOWN, TokenKind::UNKNOWN, start);
+                    break;
             }
-
-            searchStart += match.length();
         }
     }
 
@@ -1,7 +1,7 @@
 #pragma once
 #include <string>
+#include <string_view>
 #include <vector>
-#include <regex>
 
 // Token types for the lexer
 enum class TokenType {
@@ -15,15 +15,36 @@ enum class TokenType {
     UNKNOWN
 };
 
-// Token structure
+// Exact token kind, so the parser can branch without comparing text
+enum class TokenKind {
+    END,
+    IDENTIFIER,
+    NUMBER,
+    STRING_LITERAL,
+    COMMENT,
+    UNKNOWN,
+    // Keywords
+    KW_IF, KW_ELSE, KW_WHILE, KW_FOR, KW_RETURN, KW_PRINT,
+    KW_INT, KW_FLOAT, KW_CHAR, KW_VOID, KW_BOOL,
+    // Operators
+    PLUS, MINUS, STAR, SLASH, ASSIGN,
+    EQ, NE, LT, GT, LE, GE,
+    // Separators
+    LPAREN, RPAREN, LBRACE, RBRACE, LBRACKET, RBRACKET, COMMA, SEMICOLON
+};
+
+// Token structure. value is a view into the source buffer, which must
+// outlive the tokens.
 struct Token {
     TokenType type;
-    std::string value;
+    std::string_view value;
     int lineNumber;
+    TokenKind kind;
 };
 
-// Tokenize input code into a vector of tokens
-std::vector<Token> tokenize(const std::string& code);
+// Tokenize input code into a vector of tokens (single pass scanner).
+// firstLine numbers the first line, for code cut out of a larger source.
+std::vector<Token> tokenize(std::string_view code, int firstLine = 1);
 
 // Convert TokenType to string for display
-std::string tokenTypeToString(TokenType type); 
\ No newline at end of file
+std::string tokenTypeToString(TokenType type);
@@ -1,10 +1,32 @@
+#include <algorithm>
+#include <condition_variable>
+#include <filesystem>
 #include <iostream>
 #include <fstream>
+#include <map>
+#include <mutex>
 #include <sstream>
+#include <thread>
 #include "lexer.h"
 #include "parser.h"
 #include "interpreter.h"
 #include "ir.h"
+#include "iropt.h"
+#include "incremental.h"
+#include "parallel.h"
+#include "source.h"
+#include "stream.h"
+#include "bytecode.h"
+#include "jit.h"
+#include "regir.h"
+#include "ssa.h"
+#include "threadpool.h"
+#if defined(__unix__) || defined(__APPLE__)
+#define HYBRID_GLOB 1
+#include <glob.h>
+#else
+#define HYBRID_GLOB 0
+#endif
 using namespace std;
 
 void printMenu() {
@@ -12,78 +34,818 @@ void printMenu() {
     cout << "1. Interpret\n";
     cout << "2. Compile to IR and Run\n";
     cout << "3. Both\n";
-    cout << "Enter choice (1/2/3): ";
+    cout << "4. Compile to register IR and Run\n";
+    cout << "5. JIT compile to x86-64 and Run\n";
+    cout << "6. Optimize in SSA form, lower to register IR and Run\n";
+    cout << "Enter choice (1/2/3/4/5/6): ";
 }
 
-int main(int argc, char* argv[]) {
-    string filename;
-    if (argc > 1) {
-        filename = argv[1];
+template <typename Trace>
+bool runInterpreter(AST& tree, const ExecutionLimits& limits, Profiler* profiler, size_t jobs,
+                    uint64_t parallelThreshold, ostream& os, ostream& err) {
+    OutputWriter out(os);
+    if (profiler) profileSites(*profiler, tree);
+    Interpreter<Trace> interp(out, limits, profiler);
+    interp.parallelize(jobs, parallelThreshold);
+    try {
+        resolveSlots(tree);
+        interp.eval(tree);
+    } catch (const exception& e) {
+        out.flush();
+        err << "Interpreter error: " << e.what() << endl;
+        return false;
+    }
+    return true;
+}
+
+template <typename Trace>
+void runCompiler(const AST& tree, bool dump, const ExecutionLimits& limits, Profiler* profiler, size_t jobs,
+                 bool parallelFrontEnd, uint64_t parallelThreshold, ostream& os) {
+    // Independent top-level statements run as tasks when nothing needs the
+    // one program: no dumps, tracing, profiling or limits
+    if (jobs > 1 && !dump && !Trace::enabled && !profiler && !Budget(limits).limited()) {
+        ScheduledProgram scheduled = scheduleProgram(tree, parallelThreshold);
+        if (!scheduled.stages.empty()) {
+            OutputWriter out(os);
+            VMState state;
+            ThreadPool pool(jobs - 1);
+            runScheduled(scheduled, pool, state, out);
+            return;
+        }
+    }
+    if (parallelFrontEnd && !dump && !Trace::enabled && !profiler) {
+        OutputWriter out(os);
+        VMState state;
+        IRVM().run(compileParallel(tree, jobs), state, out, limits);
+        return;
+    }
+    IRProgram ir;
+    int labelCount = 0;
+    compileAST<Trace>(tree, ir, labelCount);
+    if (dump) {
+        os << "\n=== COMPILATION TO IR ===\n";
+        printIR(ir, os);
+        os << "==============================\n";
+        os << "\n=== PEEPHOLE OPTIMIZATION ===\n";
+    }
+    PeepholeStats stats = optimizeIR(ir);
+    if (dump) {
+        printPeepholeStats(stats, os);
+        printIR(ir, os);
+        os << "==============================\n";
+        os << "\n=== LINKED BYTECODE ===\n";
+    }
+    LinkedProgram linked = linkIR(ir, &tree);
+    if (dump) {
+        printLinked(linked, os);
+        os << "==============================\n";
+        os << "\n=== RUNNING IR VM ===\n";
+    }
+    OutputWriter out(os);
+    IRVM vm;
+    VMState state;
+    if (profiler) profileSites(*profiler, linked);
+    vm.run<Trace>(linked, state, out, limits, profiler);
+}
+
+template <typename Trace>
+void runRegisterCompiler(const AST& tree, bool dump, const ExecutionLimits& limits, ostream& os) {
+    RegProgram prog = compileToRegisters(tree);
+    if (dump) {
+        os << "\n=== COMPILATION TO REGISTER IR ===\n";
+        printRegIR(prog, os);
+        os << "==============================\n";
+        os << "\n=== RUNNING REGISTER VM ===\n";
+    }
+    OutputWriter out(os);
+    RegVM vm;
+    vm.run<Trace>(prog, out, limits);
+}
+
+template <typename Trace>
+void runJIT(const AST& tree, bool dump, ostream& os) {
+    IRProgram ir;
+    int labelCount = 0;
+    compileAST<Trace>(tree, ir, labelCount);
+    optimizeIR(ir);
+    LinkedProgram linked = linkIR(ir, &tree);
+    if (dump) {
+        os << "\n=== COMPILATION TO IR ===\n";
+        printLinked(linked, os);
+        os << "==============================\n";
+    }
+    OutputWriter out(os);
+    JITCode jit;
+    if (jit.compile<Trace>(linked)) {
+        if (dump) os << "\n=== RUNNING JIT CODE (" << jit.size() << " bytes) ===\n";
+        jit.run(out);
     } else {
-        cout << "Enter the .cpp file to process: ";
-        getline(cin, filename);
+        if (dump) {
+            os << "\n[JIT] Native code generation unavailable, falling back to the VM\n";
+            os << "\n=== RUNNING IR VM ===\n";
+        }
+        IRVM vm;
+        vm.run<Trace>(linked, out);
     }
-    ifstream file(filename);
-    if (!file) {
-        cerr << "Could not open file: " << filename << "\n";
-        return 1;
+}
+
+template <typename Trace>
+void runSSACompiler(const AST& tree, bool dump, const ExecutionLimits& limits, ostream& os) {
+    SSAFunction fn = buildSSA(tree);
+    if (dump) {
+        os << "\n=== SSA CONSTRUCTION ===\n";
+        printSSA(fn, os);
+        os << "==============================\n";
+        os << "\n=== SSA OPTIMIZATION ===\n";
     }
+    SSAStats stats = optimizeSSA(fn);
+    RegProgram prog = lowerToRegisters(fn);
+    if (dump) {
+        printSSAStats(stats, os);
+        printSSA(fn, os);
+        os << "==============================\n";
+        os << "\n=== LOWERED REGISTER IR ===\n";
+        printRegIR(prog, os);
+        os << "==============================\n";
+        os << "\n=== RUNNING REGISTER VM ===\n";
+    }
+    OutputWriter out(os);
+    RegVM vm;
+    vm.run<Trace>(prog, out, limits);
+}
 
-    stringstream buffer;
-    buffer << file.rdbuf();
-    string code = buffer.str();
+// Runs the file on the VM through the bytecode cache: a valid cache file is
+// mapped and run directly, otherwise the source is compiled and the result
+// stored for next time
+int runCached(string_view code, const string& cacheDir, int optLevel, const ExecutionLimits& limits,
+              ostream& os, ostream& err) {
+    uint64_t sourceHash = hashBytes(code.data(), code.size());
+    string path = bytecodeCachePath(cacheDir, sourceHash, optLevel);
+    LinkedProgram linked;
+    if (loadBytecode(path, sourceHash, optLevel, linked)) {
+        err << "[Cache] hit: " << path << "\n";
+    } else {
+        try {
+            auto tokens = tokenize(code);
+            AST tree = Parser(tokens).parse();
+            optimizeAST(tree, optLevel);
+            IRProgram ir;
+            int labelCount = 0;
+            compileAST(tree, ir, labelCount);
+            optimizeIR(ir);
+            linked = linkIR(ir, &tree);
+        } catch (const exception& e) {
+            err << "Parse error: " << e.what() << endl;
+            return 1;
+        }
+        ensureCacheDir(cacheDir);
+        bool stored = writeBytecode(path, linked, sourceHash, optLevel);
+        err << "[Cache] miss: " << (stored ? "stored " : "could not write ") << path << "\n";
+    }
+    OutputWriter out(os);
+    IRVM vm;
+    VMState state;
+    try {
+        vm.run(linked, state, out, limits);
+    } catch (const exception& e) {
+        out.flush();
+        err << "Runtime error: " << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
 
-    int choice = 0;
-    while (choice < 1 || choice > 3) {
-        printMenu();
-        string input;
-        getline(cin, input);
-        if (input == "1" || input == "2" || input == "3") {
-            choice = stoi(input);
-        } else {
-            cout << "Invalid choice. Please enter 1, 2, or 3.\n";
+// Runs the program on every backend and checks they print the same output
+// as the interpreter on the unoptimized tree. Returns false on any mismatch.
+bool runDifferential(AST& reference, AST& tree, ostream& os) {
+    auto capture = [](auto&& body) {
+        ostringstream os;
+        {
+            OutputWriter out(os);
+            try {
+                body(out);
+            } catch (const exception& e) {
+                out.flush();
+                os << "error: " << e.what() << "\n";
+            }
         }
+        return os.str();
+    };
+
+    IRProgram ir;
+    int labelCount = 0;
+    compileAST(tree, ir, labelCount);
+    optimizeIR(ir);
+    LinkedProgram linked = linkIR(ir, &tree);
+    JITCode jit;
+    bool native = jit.compile(linked);
+
+    vector<pair<string, string>> results;
+    results.push_back({"interpreter -O0", capture([&](OutputWriter& out) {
+        Interpreter<QuietTrace> interp(out);
+        resolveSlots(reference);
+        interp.eval(reference);
+    })});
+    results.push_back({"interpreter", capture([&](OutputWriter& out) {
+        Interpreter<QuietTrace> interp(out);
+        resolveSlots(tree);
+        interp.eval(tree);
+    })});
+    results.push_back({"vm", capture([&](OutputWriter& out) { IRVM().run(linked, out); })});
+    results.push_back({"register vm", capture([&](OutputWriter& out) {
+        RegVM().run(compileToRegisters(tree), out);
+    })});
+    results.push_back({"ssa register vm", capture([&](OutputWriter& out) {
+        RegVM().run(compileSSA(tree), out);
+    })});
+    if (native) {
+        results.push_back({"jit", capture([&](OutputWriter& out) { jit.run(out); })});
+    } else {
+        os << "[Diff] jit: unsupported on this target, skipped\n";
     }
 
-    cout << "\n==============================\n";
-    cout << "=== LEXICAL ANALYSIS ===\n";
-    auto tokens = tokenize(code);
-    for (const auto& token : tokens) {
-        cout << "Line " << token.lineNumber << ": "
-             << token.value << " [" << tokenTypeToString(token.type) << "]\n";
+    const string& expected = results[0].second;
+    bool ok = true;
+    for (const auto& [name, output] : results) {
+        size_t lines = count(output.begin(), output.end(), '\n');
+        if (output == expected) {
+            os << "[Diff] " << name << ": ok (" << lines << " line(s))\n";
+            continue;
+        }
+        ok = false;
+        size_t at = mismatch(expected.begin(), expected.end(), output.begin(), output.end()).first
+                    - expected.begin();
+        size_t line = count(expected.begin(), expected.begin() + at, '\n') + 1;
+        auto lineAt = [](const string& text, size_t pos) {
+            size_t start = text.rfind('\n', pos == 0 ? 0 : pos - 1);
+            start = (start == string::npos || pos == 0) ? 0 : start + 1;
+            return text.substr(start, text.find('\n', start) - start);
+        };
+        os << "[Diff] " << name << ": MISMATCH at output line " << line << "\n"
+             << "[Diff]   " << results[0].first << ": " << lineAt(expected, at) << "\n"
+             << "[Diff]   " << name << ": " << lineAt(output, at) << "\n";
     }
-    cout << "==============================\n";
+    return ok;
+}
+
+// Scripts from this size on are lexed, parsed and compiled in parallel
+constexpr size_t PARALLEL_MIN_BYTES = 1 << 20;
+
+// Settings shared by every script of a run
+struct Options {
+    int choice = 0;          // Menu choice (1-6); 0 asks interactively
+    bool dump = true;        // Tokens, trees, IR and optimizer stats
+    bool trace = false;
+    bool diff = false;
+    bool cache = false;
+    string cacheDir = ".hybrid_cache";
+    int optLevel = 1;
+    ExecutionLimits limits;  // Enforced by the interpreter and the stack VM
+    string profileOut;       // Collapsed stacks file; empty = no profiling
+    size_t jobs = ThreadPool::defaultThreads();
+    bool parallelFrontEnd = false; // Set per script: lex, parse and compile on `jobs` threads
+    uint64_t parallelThreshold = PARALLEL_THRESHOLD; // Statement cost worth a task (depend.h)
+    bool repl = false;       // Interactive session on the interpreter
+    bool watch = false;      // Re-run the script on the VM whenever it changes
+    bool stream = false;     // Run statement by statement while reading
+};
 
-    cout << "\n=== PARSING & BUILDING AST ===\n";
-    Parser parser(code);
-    auto tree = parser.parse();
-    cout << "\n=== PARSE TREE (ROTATED) ===\n";
-    printTree(tree);
-    cout << "==============================\n";
+// --mode= names, indexed by menu choice - 1
+const vector<string> MODE_NAMES = {"interp", "vm", "both", "reg", "jit", "ssa"};
 
+// The limits in `limits` that the engine of menu choice `choice` cannot
+// enforce; empty if there are none. The register VM (reg, ssa) has no
+// operand stack to bound, and the JIT charges no fuel.
+string unenforcedLimits(int choice, const ExecutionLimits& limits) {
+    vector<string> names;
+    if (choice == 5 && limits.maxSteps) names.push_back("--max-steps");
+    if (choice == 5 && limits.timeout.count()) names.push_back("--timeout");
+    if (choice >= 4 && limits.maxStackDepth) names.push_back("--max-depth");
+    string list;
+    for (const string& name : names) list += (list.empty() ? "" : ", ") + name;
+    return list;
+}
+
+template <typename Trace>
+bool runChoice(AST& tree, const Options& opts, ostream& os, ostream& err) {
+    int choice = opts.choice;
+    bool ok = true;
+    // Only the interpreter and the stack VM are profiled
+    bool profiling = Profiler::enabled && !opts.profileOut.empty();
+    Profiler interpProfile, vmProfile;
+    Profiler* interpProfiler = profiling ? &interpProfile : nullptr;
+    Profiler* vmProfiler = profiling ? &vmProfile : nullptr;
     if (choice == 1 || choice == 3) {
-        cout << "\n=== INTERPRETER OUTPUT ===\n";
-        Interpreter interp;
+        if (opts.dump) os << "\n=== INTERPRETER OUTPUT ===\n";
+        ok = runInterpreter<Trace>(tree, opts.limits, interpProfiler, opts.jobs, opts.parallelThreshold, os, err);
+        if (opts.dump) os << "==============================\n";
+    }
+    if (choice == 2 || choice == 3) {
+        runCompiler<Trace>(tree, opts.dump, opts.limits, vmProfiler, opts.jobs, opts.parallelFrontEnd,
+                           opts.parallelThreshold, os);
+    }
+    if (choice == 4) runRegisterCompiler<Trace>(tree, opts.dump, opts.limits, os);
+    if (choice == 5) runJIT<Trace>(tree, opts.dump, os);
+    if (choice == 6) runSSACompiler<Trace>(tree, opts.dump, opts.limits, os);
+    if (opts.dump && choice != 1) os << "==============================\n";
+    if (profiling && choice <= 3) {
+        ofstream folded(opts.profileOut);
+        if (choice != 2) {
+            interpProfile.report(os);
+            interpProfile.writeCollapsed(folded, "interp");
+        }
+        if (choice != 1) {
+            vmProfile.report(os);
+            vmProfile.writeCollapsed(folded, "vm");
+        }
+        if (!folded) err << "Could not write profile: " << opts.profileOut << "\n";
+        else os << "\n[Profile] collapsed stacks written to " << opts.profileOut << "\n";
+    }
+    return ok;
+}
+
+// Runs one script with its output going to `os` and errors to `err`.
+// Returns the exit status.
+int runScript(string_view code, const Options& opts, ostream& os, ostream& err) {
+    if (opts.cache) return runCached(code, opts.cacheDir, opts.optLevel, opts.limits, os, err);
+
+    if (opts.diff) {
+        try {
+            auto tokens = tokenize(code);
+            AST reference = Parser(tokens).parse();
+            AST tree = reference;
+            printOptimizeStats(optimizeAST(tree, opts.optLevel), os);
+            return runDifferential(reference, tree, os) ? 0 : 1;
+        } catch (const exception& e) {
+            err << "Parse error: " << e.what() << endl;
+            return 1;
+        }
+    }
+
+    // Large scripts run without dumps or tracing get the parallel front end
+    Options scriptOpts = opts;
+    scriptOpts.parallelFrontEnd = opts.jobs > 1 && !opts.dump && !opts.trace && code.size() >= PARALLEL_MIN_BYTES;
+
+    AST tree;
+    if (scriptOpts.parallelFrontEnd) {
+        try {
+            tree = parseParallel(code, scriptOpts.jobs);
+        } catch (const exception& e) {
+            err << "Parse error: " << e.what() << endl;
+            return 1;
+        }
+    } else {
+        auto tokens = tokenize(code);
+        if (opts.dump) {
+            os << "\n==============================\n";
+            os << "=== LEXICAL ANALYSIS ===\n";
+            for (const auto& token : tokens) {
+                os << "Line " << token.lineNumber << ": "
+                   << token.value << " [" << tokenTypeToString(token.type) << "]\n";
+            }
+            os << "==============================\n";
+            os << "\n=== PARSING & BUILDING AST ===\n";
+        }
+        try {
+            Parser parser(tokens);
+            tree = parser.parse();
+        } catch (const exception& e) {
+            err << "Parse error: " << e.what() << endl;
+            return 1;
+        }
+    }
+    if (opts.dump) {
+        os << "\n=== PARSE TREE (ROTATED) ===\n";
+        printTree(tree, tree.root, 0, os);
+        os << "==============================\n";
+    }
+
+    if (opts.optLevel > 0) {
+        OptimizeStats stats = optimizeAST(tree, opts.optLevel);
+        if (opts.dump) {
+            os << "\n=== AST OPTIMIZATION (-O" << opts.optLevel << ") ===\n";
+            printOptimizeStats(stats, os);
+            if (stats.nodesAfter != stats.nodesBefore) printTree(tree, tree.root, 0, os);
+            os << "==============================\n";
+        }
+    }
+
+    try {
+        bool ok = opts.trace ? runChoice<VerboseTrace>(tree, scriptOpts, os, err)
+                             : runChoice<QuietTrace>(tree, scriptOpts, os, err);
+        return ok ? 0 : 1;
+    } catch (const exception& e) {
+        os.flush();
+        err << "Runtime error: " << e.what() << endl;
+        return 1;
+    }
+}
+
+// Expands one command-line input into script paths: a directory yields its
+// regular files in name order, a pattern containing * ? or [ is expanded
+// with glob(3), anything else is taken as a file name
+void collectInputs(const string& arg, vector<string>& paths) {
+    error_code ec;
+    if (filesystem::is_directory(arg, ec)) {
+        vector<string> found;
+        for (const auto& entry : filesystem::directory_iterator(arg, ec)) {
+            if (entry.is_regular_file(ec)) found.push_back(entry.path().string());
+        }
+        sort(found.begin(), found.end());
+        paths.insert(paths.end(), found.begin(), found.end());
+        return;
+    }
+#if HYBRID_GLOB
+    if (arg.find_first_of("*?[") != string::npos && !filesystem::exists(arg, ec)) {
+        glob_t matches;
+        if (glob(arg.c_str(), 0, nullptr, &matches) == 0) {
+            for (size_t i = 0; i < matches.gl_pathc; ++i) paths.push_back(matches.gl_pathv[i]);
+            globfree(&matches);
+            return;
+        }
+        globfree(&matches);
+    }
+#endif
+    paths.push_back(arg);
+}
+
+// Output of one script, held until every earlier script has been written
+struct ScriptResult {
+    string out;
+    string err;
+    int status = 0;
+    bool done = false;
+};
+
+// Runs every script on the thread pool. Each task has its own engines and
+// buffers; results are written in input order as soon as the scripts before
+// them have finished.
+int runBatch(const vector<string>& paths, const Options& opts) {
+    // The scripts already keep every worker busy, so each one runs serially
+    Options scriptOpts = opts;
+    scriptOpts.jobs = 1;
+    vector<ScriptResult> results(paths.size());
+    mutex resultMutex;
+    condition_variable finished;
+    auto runOne = [&](size_t i) {
+        ostringstream os, err;
+        SourceFile source;
+        int status;
+        if (!source.open(paths[i])) {
+            err << "Could not open file: " << paths[i] << "\n";
+            status = 1;
+        } else {
+            try {
+                status = runScript(source.text(), scriptOpts, os, err);
+            } catch (const exception& e) {
+                err << "Error: " << e.what() << endl;
+                status = 1;
+            }
+        }
+        lock_guard<mutex> lock(resultMutex);
+        results[i].out = os.str();
+        results[i].err = err.str();
+        results[i].status = status;
+        results[i].done = true;
+        finished.notify_all();
+    };
+
+    int status = 0;
+    ThreadPool pool(min(opts.jobs, paths.size()));
+    for (size_t i = 0; i < paths.size(); ++i) pool.submit([&runOne, i] { runOne(i); });
+    for (size_t i = 0; i < paths.size(); ++i) {
+        ScriptResult result;
+        {
+            unique_lock<mutex> lock(resultMutex);
+            finished.wait(lock, [&] { return results[i].done; });
+            result = std::move(results[i]);
+        }
+        cout << "=== " << paths[i] << " ===\n" << result.out;
+        cout.flush();
+        cerr << result.err;
+        if (result.status != 0) status = 1;
+    }
+    return status;
+}
+
+// Interactive session on one interpreter: each complete input (braces
+// balanced, ending in `;` or `}`) is parsed and run at once, and variables
+// keep their values from one input to the next
+int runRepl(const Options& opts) {
+    OutputWriter out(cout);
+    Interpreter<QuietTrace> interp(out, opts.limits);
+    interp.keepVariables(true);
+    cout << "Hybrid REPL: statements run as soon as they are complete; an if waits for a possible else "
+            "(an empty line runs it); :vars lists variables, :quit exits\n";
+    string pending, line;
+    bool awaitingElse = false; // `pending` is a complete if that an else may still extend
+    auto runPending = [&] {
         try {
+            auto tokens = tokenize(pending);
+            AST tree = Parser(tokens).parse();
+            optimizeAST(tree, opts.optLevel, true);
+            resolveSlots(tree, [&](string_view name) { return interp.hasVariable(name); });
             interp.eval(tree);
         } catch (const exception& e) {
-            cerr << "Interpreter error: " << e.what() << endl;
+            out.flush();
+            cout << "Error: " << e.what() << "\n";
+        }
+        pending.clear();
+        awaitingElse = false;
+        out.flush();
+    };
+    for (;;) {
+        cout << (pending.empty() ? "> " : ". ") << flush;
+        if (!getline(cin, line)) {
+            if (awaitingElse) runPending();
+            break;
+        }
+        if (awaitingElse) {
+            // Comment lines say nothing yet; anything but `else` ends the if
+            size_t first = line.find_first_not_of(" \t\r");
+            if (first != string::npos && line.compare(first, 2, "//") == 0) {
+                pending += line;
+                pending += '\n';
+                continue;
+            }
+            if (parallel_detail::elseFollows(line, 0)) awaitingElse = false;
+            else runPending();
         }
-        cout << "==============================\n";
+        if (pending.empty() && line == ":quit") break;
+        if (pending.empty() && line == ":vars") {
+            map<string, Value> sorted(interp.variables().begin(), interp.variables().end());
+            for (const auto& [name, value] : sorted) cout << name << " = " << value << "\n";
+            continue;
+        }
+        pending += line;
+        pending += '\n';
+        try {
+            auto tokens = tokenize(pending);
+            int depth = 0;
+            bool ended = true;              // The last token ends a top-level statement
+            const Token* start = nullptr;   // First token of the last top-level statement
+            for (const Token& token : tokens) {
+                if (token.kind == TokenKind::COMMENT) continue;
+                if (ended && token.kind != TokenKind::KW_ELSE) start = &token;
+                if (token.kind == TokenKind::LBRACE) ++depth;
+                if (token.kind == TokenKind::RBRACE) --depth;
+                ended = depth <= 0 && (token.kind == TokenKind::SEMICOLON || token.kind == TokenKind::RBRACE);
+            }
+            if (!start) {
+                pending.clear();
+                continue;
+            }
+            if (!ended) continue;
+            if (start->kind == TokenKind::KW_IF) {
+                awaitingElse = true;
+                continue;
+            }
+        } catch (const exception& e) {
+            out.flush();
+            cout << "Error: " << e.what() << "\n";
+            pending.clear();
+            continue;
+        }
+        runPending();
     }
+    cout << "\n";
+    return 0;
+}
 
-    if (choice == 2 || choice == 3) {
-        cout << "\n=== COMPILATION TO IR ===\n";
-        IRProgram ir;
-        int labelCount = 0;
-        compileAST(tree, ir, labelCount);
-        printIR(ir);
-        cout << "==============================\n";
-        cout << "\n=== RUNNING IR VM ===\n";
-        IRVM vm;
-        vm.run(ir);
-        cout << "==============================\n";
+// Runs the script on the VM and again after every save, recompiling only
+// the regions the edit touched. Polls the file's modification time.
+int runWatch(const string& path, const Options& opts) {
+    IncrementalProgram program(opts.optLevel);
+    filesystem::file_time_type seen{};
+    for (;;) {
+        error_code ec;
+        auto stamp = filesystem::last_write_time(path, ec);
+        SourceFile source;
+        if (!ec && stamp != seen && source.open(path)) {
+            seen = stamp;
+            try {
+                EditStats stats = program.update(source.text());
+                cerr << "[Watch] rebuilt " << stats.rebuilt << " of " << stats.regions << " region(s), "
+                     << stats.lines << " line(s), in " << stats.ms << " ms\n";
+                OutputWriter out(cout);
+                VMState state;
+                IRVM().run(program.program(), state, out, opts.limits);
+            } catch (const exception& e) {
+                cout.flush();
+                cerr << "Error: " << e.what() << endl;
+            }
+            cout.flush();
+        }
+        this_thread::sleep_for(chrono::milliseconds(100));
     }
+}
 
+// Runs a script one top-level statement at a time as it is read, so memory
+// is bounded by the largest statement rather than the file. The interpreter
+// (default) or the VM (--mode=vm) keeps the variables between statements.
+int runStream(const string& path, const Options& opts) {
+    ifstream file(path, ios::binary);
+    if (!file) {
+        cerr << "Could not open file: " << path << "\n";
+        return 1;
+    }
+    StatementStream stream(file);
+    OutputWriter out(cout);
+    bool vm = opts.choice == 2;
+    Interpreter<QuietTrace> interp(out, opts.limits);
+    interp.keepVariables(true);
+    IRVM machine;
+    VMState state;
+    LinkedProgram linked; // slotNames: every variable seen so far, in frame order
+    unordered_map<string, int> slots;
+    vector<Token> tokens;
+    try {
+        while (stream.next(tokens)) {
+            AST tree = Parser(tokens).parse();
+            optimizeAST(tree, opts.optLevel, true);
+            if (!vm) {
+                resolveSlots(tree, [&](string_view name) { return interp.hasVariable(name); });
+                interp.eval(tree);
+                continue;
+            }
+            IRProgram ir;
+            int labelCount = 0;
+            compileAST(tree, ir, labelCount);
+            optimizeIR(ir);
+            LinkedProgram code = linkIR(ir);
+            // Map the statement's slots onto the session frame
+            vector<int> frameSlot;
+            for (const string& name : code.slotNames) {
+                auto [it, added] = slots.emplace(name, (int)linked.slotNames.size());
+                if (added) linked.slotNames.push_back(name);
+                frameSlot.push_back(it->second);
+            }
+            for (LinkedInstr& instr : code.code) {
+                OperandKinds kinds = operandKinds(instr.op);
+                int* operands[3] = {&instr.operand, &instr.operand2, &instr.operand3};
+                for (int k = 0; k < 3; ++k) {
+                    if (kinds[k] == OperandKind::VAR) *operands[k] = frameSlot[*operands[k]];
+                }
+            }
+            linked.code = std::move(code.code);
+            linked.lines = std::move(code.lines);
+            machine.run(linked, state, out, opts.limits);
+        }
+    } catch (const exception& e) {
+        out.flush();
+        cerr << "Error: " << e.what() << endl;
+        return 1;
+    }
     return 0;
 }
+
+int main(int argc, char* argv[]) {
+    // --mode=interp|vm|both|reg|jit|ssa picks the engine instead of the menu;
+    // --no-dump prints only program output; --jobs=N sets the worker count
+    // for multiple inputs (files, directories or patterns), large scripts
+    // and independent statements;
+    // --trace turns on the debug trace of the interpreter, compiler and VM;
+    // --diff checks that all backends agree instead of showing the menu;
+    // -O0/-O1/-O2 select the AST optimization level; --cache runs the VM on
+    // cached bytecode (--cache-dir=DIR, default .hybrid_cache);
+    // --max-steps=N, --timeout=MS and --max-depth=N limit each run;
+    // --par-threshold=N sets the estimated cost from which independent
+    // statements run in parallel (interp and vm, with --jobs above 1);
+    // --profile[=FILE] profiles the interpreter and VM (HYBRID_PROFILE builds);
+    // --repl starts an interactive session; --watch FILE re-runs FILE on
+    // every change, recompiling only what the edit touched; --stream runs
+    // a script statement by statement while reading it (interp or vm)
+    Options opts;
+    vector<string> paths;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--trace") opts.trace = true;
+        else if (arg == "--diff") opts.diff = true;
+        else if (arg == "--no-dump") opts.dump = false;
+        else if (arg == "--cache") opts.cache = true;
+        else if (arg == "--repl") opts.repl = true;
+        else if (arg == "--watch") opts.watch = true;
+        else if (arg == "--stream") opts.stream = true;
+        else if (arg.rfind("--cache-dir=", 0) == 0) {
+            opts.cache = true;
+            opts.cacheDir = arg.substr(12);
+        }
+        else if (arg.rfind("--mode=", 0) == 0) {
+            auto it = find(MODE_NAMES.begin(), MODE_NAMES.end(), arg.substr(7));
+            if (it == MODE_NAMES.end()) {
+                cerr << "Unknown mode: " << arg.substr(7) << " (expected interp, vm, both, reg, jit or ssa)\n";
+                return 1;
+            }
+            opts.choice = (int)(it - MODE_NAMES.begin()) + 1;
+        }
+        else if (arg.rfind("--jobs=", 0) == 0) {
+            try {
+                opts.jobs = stoul(arg.substr(7));
+            } catch (const exception&) {
+                opts.jobs = 0;
+            }
+            if (opts.jobs == 0) {
+                cerr << "Invalid job count: " << arg.substr(7) << "\n";
+                return 1;
+            }
+        }
+        else if (arg.rfind("--par-threshold=", 0) == 0) {
+            try {
+                opts.parallelThreshold = stoull(arg.substr(16));
+            } catch (const exception&) {
+                cerr << "Invalid threshold: " << arg.substr(16) << "\n";
+                return 1;
+            }
+        }
+        else if (arg.rfind("--max-steps=", 0) == 0 || arg.rfind("--timeout=", 0) == 0 ||
+                 arg.rfind("--max-depth=", 0) == 0) {
+            size_t eq = arg.find('=');
+            unsigned long long n = 0;
+            try {
+                n = stoull(arg.substr(eq + 1));
+            } catch (const exception&) {
+                cerr << "Invalid value: " << arg << "\n";
+                return 1;
+            }
+            string name = arg.substr(0, eq);
+            if (name == "--max-steps") opts.limits.maxSteps = n;
+            else if (name == "--timeout") opts.limits.timeout = chrono::milliseconds(n);
+            else opts.limits.maxStackDepth = n;
+        }
+        else if (arg == "--profile" || arg.rfind("--profile=", 0) == 0) {
+            if (!Profiler::enabled) {
+                cerr << "Profiling is not compiled in; rebuild with -DHYBRID_PROFILE\n";
+                return 1;
+            }
+            opts.profileOut = arg.size() > 10 ? arg.substr(10) : "profile.folded";
+        }
+        else if (arg == "-O0" || arg == "-O1" || arg == "-O2") opts.optLevel = arg[2] - '0';
+        else collectInputs(arg, paths);
+    }
+    if (opts.choice && !unenforcedLimits(opts.choice, opts.limits).empty()) {
+        cerr << "--mode=" << MODE_NAMES[opts.choice - 1] << " cannot enforce "
+             << unenforcedLimits(opts.choice, opts.limits) << "\n";
+        return 1;
+    }
+    if (!opts.profileOut.empty() && paths.size() > 1) {
+        cerr << "--profile takes a single script\n";
+        return 1;
+    }
+    if (opts.repl) return runRepl(opts);
+    if (opts.watch) {
+        if (paths.size() != 1) {
+            cerr << "--watch takes a single script\n";
+            return 1;
+        }
+        return runWatch(paths[0], opts);
+    }
+    if (opts.stream) {
+        if (paths.size() != 1 || opts.choice > 2) {
+            cerr << "--stream takes a single script and runs it with --mode=interp or --mode=vm\n";
+            return 1;
+        }
+        return runStream(paths[0], opts);
+    }
+    if (paths.empty()) {
+        string filename;
+        cout << "Enter the .cpp file to process: ";
+        getline(cin, filename);
+        paths.push_back(filename);
+    }
+    bool batch = paths.size() > 1;
+    if (batch && opts.choice == 0) opts.choice = 3;
+
+    // The trace is written straight to cout by the engines, so traced runs
+    // stay on this thread
+    if (batch && !opts.trace) return runBatch(paths, opts);
+
+    int status = 0;
+    for (const string& path : paths) {
+        SourceFile source;
+        if (!source.open(path)) {
+            cerr << "Could not open file: " << path << "\n";
+            status = 1;
+            continue;
+        }
+        if (batch) cout << "=== " << path << " ===\n";
+        if (opts.choice == 0 && !opts.diff && !opts.cache) {
+            while (opts.choice < 1 || opts.choice > 6) {
+                printMenu();
+                string input;
+                getline(cin, input);
+                if (input.size() == 1 && input[0] >= '1' && input[0] <= '6') {
+                    opts.choice = stoi(input);
+                    string unenforced = unenforcedLimits(opts.choice, opts.limits);
+                    if (!unenforced.empty()) {
+                        cout << "Option " << opts.choice << " cannot enforce " << unenforced << ".\n";
+                        opts.choice = 0;
+                    }
+                } else {
+                    cout << "Invalid choice. Please enter 1 to 6.\n";
+                }
+            }
+        }
+        if (runScript(source.text(), opts, cout, cerr) != 0) status = 1;
+    }
+    return status;
+}
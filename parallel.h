@@ -0,0 +1,345 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <exception>
+#include <string_view>
+#include <vector>
+#include "depend.h"
+#include "ir.h"
+#include "iropt.h"
+#include "lexer.h"
+#include "parser.h"
+#include "threadpool.h"
+using namespace std;
+
+// Parallel front end for large scripts, which are mostly long runs of
+// top-level statements. The source is cut at top-level statement
+// boundaries, the pieces are lexed and parsed on a thread pool, and their
+// trees are stitched into one Block in source order. Compilation splits the
+// top-level statements the same way: each group is compiled and linked on
+// its own, with labels numbered from zero, and the layout moves its jump
+// targets by the group's offset. Slots come from the tree's symbol table,
+// so the groups agree on them without remapping.
+
+// A stretch of source holding whole top-level statements
+struct SourceChunk {
+    string_view text;
+    int firstLine;
+};
+
+// Chunks per worker, so one slow chunk does not hold up the others
+constexpr size_t CHUNKS_PER_JOB = 4;
+
+namespace parallel_detail {
+
+inline bool isIdentStart(char c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_'; }
+inline bool isIdentChar(char c) { return isIdentStart(c) || (c >= '0' && c <= '9'); }
+
+// True if the next token from `i` on is `else`, which continues an if
+inline bool elseFollows(string_view s, size_t i) {
+    while (i < s.size()) {
+        char c = s[i];
+        if (c == ' ' || c == '\t' || c == '\n' || c == '\r') ++i;
+        else if (c == '/' && i + 1 < s.size() && s[i + 1] == '/') {
+            while (i < s.size() && s[i] != '\n' && s[i] != '\r') ++i;
+        } else break;
+    }
+    return s.compare(i, 4, "else") == 0 && (i + 4 == s.size() || !isIdentChar(s[i + 4]));
+}
+
+} // namespace parallel_detail
+
+// Cuts `source` into at most `count` chunks of similar size. A cut follows
+// a `;` or `}` outside comments and string literals that closes every
+// brace and is not followed by `else`. This is a byte scan that skips
+// comments and strings the way the lexer does, so cuts fall between tokens.
+inline vector<SourceChunk> splitTopLevel(string_view source, size_t count) {
+    using namespace parallel_detail;
+    vector<SourceChunk> chunks;
+    size_t target = source.size() / max<size_t>(count, 1) + 1;
+    size_t start = 0, i = 0, n = source.size();
+    int line = 1, startLine = 1, depth = 0;
+    while (i < n) {
+        char c = source[i];
+        if (c == '\n') {
+            ++line;
+            ++i;
+            continue;
+        }
+        if (c == '/' && i + 1 < n && source[i + 1] == '/') {
+            while (i < n && source[i] != '\n' && source[i] != '\r') ++i;
+            continue;
+        }
+        if (c == '"') {
+            // Strings end on their line; an unterminated quote is one character
+            size_t q = i + 1;
+            while (q < n && source[q] != '"' && source[q] != '\n') {
+                if (source[q] == '\\' && q + 1 < n && source[q + 1] != '\n') ++q;
+                ++q;
+            }
+            i = q < n && source[q] == '"' ? q + 1 : i + 1;
+            continue;
+        }
+        if (isIdentStart(c)) {
+            while (++i < n && isIdentChar(source[i])) {}
+            continue;
+        }
+        ++i;
+        if (c == '{') ++depth;
+        else if (c == '}') --depth;
+        else if (c != ';') continue;
+        if (depth > 0 || i - start < target || elseFollows(source, i)) continue;
+        chunks.push_back({source.substr(start, i - start), startLine});
+        start = i;
+        startLine = line;
+    }
+    if (start < n || chunks.empty()) chunks.push_back({source.substr(start), startLine});
+    return chunks;
+}
+
+// Appends `parts` to one tree, in order, with their top-level statements
+// gathered into a single root Block. Symbols are interned again, so every
+// name gets one SymbolId.
+inline AST stitchTrees(const vector<AST>& parts) {
+    AST tree;
+    size_t nodes = 1, lists = 0;
+    for (const AST& part : parts) {
+        nodes += part.nodes.size();
+        lists += part.lists.size();
+    }
+    tree.nodes.reserve(nodes);
+    tree.lines.reserve(nodes);
+    tree.lists.reserve(lists);
+
+    vector<NodeId> top;
+    vector<SymbolId> symbolMap;
+    for (const AST& part : parts) {
+        NodeId base = (NodeId)tree.nodes.size();
+        uint32_t listBase = (uint32_t)tree.lists.size();
+        symbolMap.resize(part.symbols.size());
+        for (SymbolId sym = 0; sym < part.symbols.size(); ++sym) symbolMap[sym] = tree.intern(part.symbols[sym]);
+        auto move = [base](NodeId& id) {
+            if (id != NO_NODE) id += base;
+        };
+        for (ASTNode node : part.nodes) {
+            switch (node.kind) {
+                case NodeKind::Identifier: node.identifier.name = symbolMap[node.identifier.name]; break;
+                case NodeKind::BinaryExpr: move(node.binary.left); move(node.binary.right); break;
+                case NodeKind::Assignment:
+                    node.assign.name = symbolMap[node.assign.name];
+                    move(node.assign.value);
+                    break;
+                case NodeKind::IfStmt:
+                    move(node.ifStmt.cond);
+                    move(node.ifStmt.thenBranch);
+                    move(node.ifStmt.elseBranch);
+                    break;
+                case NodeKind::WhileStmt: move(node.whileStmt.cond); move(node.whileStmt.body); break;
+                case NodeKind::Block: node.block.first += listBase; break;
+                case NodeKind::PrintStmt: move(node.print); break;
+                case NodeKind::Literal: break;
+            }
+            tree.nodes.push_back(node);
+        }
+        tree.lines.insert(tree.lines.end(), part.lines.begin(), part.lines.end());
+        for (NodeId id : part.lists) tree.lists.push_back(id + base);
+        if (part.root != NO_NODE) {
+            for (NodeId stmt : part.statements(part[part.root])) top.push_back(stmt + base);
+        }
+        tree.currentLine = part.currentLine;
+    }
+    tree.root = tree.addBlock(top.data(), top.size());
+    return tree;
+}
+
+// Lexes and parses `source` on `jobs` threads. Gives the same program as
+// Parser(tokenize(source)).parse(); if any chunk fails, the whole source is
+// parsed again serially so the error is the one the serial parser reports.
+inline AST parseParallel(string_view source, size_t jobs) {
+    vector<SourceChunk> chunks = splitTopLevel(source, jobs * CHUNKS_PER_JOB);
+    if (jobs < 2 || chunks.size() < 2) {
+        auto tokens = tokenize(source);
+        return Parser(tokens).parse();
+    }
+    vector<AST> parts(chunks.size());
+    atomic<bool> failed{false};
+    {
+        ThreadPool pool(min(jobs, chunks.size()));
+        for (size_t i = 0; i < chunks.size(); ++i) {
+            pool.submit([&, i] {
+                if (failed) return;
+                try {
+                    auto tokens = tokenize(chunks[i].text, chunks[i].firstLine);
+                    parts[i] = Parser(tokens).parse();
+                } catch (const exception&) {
+                    failed = true;
+                }
+            });
+        }
+    }
+    if (failed) {
+        auto tokens = tokenize(source);
+        return Parser(tokens).parse();
+    }
+    return stitchTrees(parts);
+}
+
+// Compiles the tree's top-level statements in groups on `jobs` threads and
+// lays the groups out into one program. Each group is peephole-optimized on
+// its own, so no fusion crosses a group boundary.
+inline LinkedProgram compileParallel(const AST& tree, size_t jobs) {
+    size_t statements = 0;
+    if (tree.root != NO_NODE && tree[tree.root].kind == NodeKind::Block) {
+        statements = tree.statements(tree[tree.root]).size();
+    }
+    size_t groups = min(statements, jobs * CHUNKS_PER_JOB);
+    if (jobs < 2 || groups < 2) {
+        IRProgram ir;
+        int labelCount = 0;
+        compileAST(tree, ir, labelCount);
+        optimizeIR(ir);
+        return linkIR(ir, &tree);
+    }
+
+    const NodeId* top = tree.statements(tree[tree.root]).begin();
+    vector<LinkedProgram> parts(groups);
+    vector<exception_ptr> errors(groups);
+    {
+        ThreadPool pool(min(jobs, groups));
+        for (size_t g = 0; g < groups; ++g) {
+            pool.submit([&, g] {
+                try {
+                    IRProgram ir;
+                    int labelCount = 0; // Labels are local to the group
+                    for (size_t i = statements * g / groups; i < statements * (g + 1) / groups; ++i) {
+                        compileStatement<QuietTrace>(tree, top[i], ir, labelCount);
+                    }
+                    optimizeIR(ir);
+                    parts[g] = linkIR(ir, &tree);
+                    parts[g].code.pop_back(); // HALT
+                    parts[g].lines.pop_back();
+                } catch (...) {
+                    errors[g] = current_exception();
+                }
+            });
+        }
+    }
+    for (const exception_ptr& error : errors) {
+        if (error) rethrow_exception(error);
+    }
+
+    LinkedProgram linked;
+    linked.slotNames = std::move(parts[0].slotNames);
+    for (const LinkedProgram& part : parts) appendLinked(linked, part);
+    linked.code.push_back({OpCode::HALT, 0, 0, 0});
+    linked.lines.push_back(0);
+    return linked;
+}
+
+// A stack VM program whose independent top-level statements run as tasks
+// (see depend.h). Stages run in order. A stage with one program runs on the
+// caller's state; the programs of a larger stage run at once, each on a
+// copy of the frame with its own output buffer, and are merged back in
+// statement order: output replayed, written variables copied. Every
+// program is linked against the tree's symbols, so slots agree throughout.
+struct ScheduledProgram {
+    struct Stage {
+        vector<LinkedProgram> tasks;
+        vector<vector<SymbolId>> writes; // Per task of a parallel stage
+    };
+    vector<Stage> stages;
+};
+
+// Cuts the tree's top-level statements into stages by planBlock(). Empty
+// when no statements can run in parallel, so callers compile as usual.
+inline ScheduledProgram scheduleProgram(const AST& tree, uint64_t threshold) {
+    ScheduledProgram scheduled;
+    if (tree.root == NO_NODE || tree[tree.root].kind != NodeKind::Block) return scheduled;
+    const ASTNode& root = tree[tree.root];
+    vector<StatementGroup> groups = planBlock(tree, root, threshold);
+    if (groups.empty()) return scheduled;
+
+    const NodeId* top = tree.statements(root).begin();
+    auto link = [&](size_t from, size_t to) {
+        IRProgram ir;
+        int labelCount = 0;
+        for (size_t i = from; i < to; ++i) compileStatement<QuietTrace>(tree, top[i], ir, labelCount);
+        optimizeIR(ir);
+        return linkIR(ir, &tree);
+    };
+    size_t next = 0;
+    for (StatementGroup& group : groups) {
+        if (next < group.first) scheduled.stages.push_back({{link(next, group.first)}, {}});
+        ScheduledProgram::Stage stage;
+        for (size_t i = 0; i < group.size(); ++i) stage.tasks.push_back(link(group.begin(i), group.ends[i]));
+        stage.writes = std::move(group.writes);
+        next = group.ends.back();
+        scheduled.stages.push_back(std::move(stage));
+    }
+    size_t statements = tree.statements(root).size();
+    if (next < statements) scheduled.stages.push_back({{link(next, statements)}, {}});
+    return scheduled;
+}
+
+// Runs `program` without limits; the caller's thread takes the first task
+// of every parallel stage. A task that throws keeps its effects, drops
+// those of the tasks after it and rethrows, as if the statements had run
+// in order. It also cancels the tasks after it, which would otherwise hold
+// up the error until they finish, or forever.
+inline void runScheduled(const ScheduledProgram& program, ThreadPool& pool, VMState& state, OutputWriter& out) {
+    uint64_t steps = 0;
+    for (const ScheduledProgram::Stage& stage : program.stages) {
+        if (stage.tasks.size() == 1) {
+            IRVM().run(stage.tasks[0], state, out, ExecutionLimits());
+            steps += state.steps;
+            continue;
+        }
+        struct Task {
+            vector<int> printed;
+            VMState state;
+            exception_ptr error;
+        };
+        vector<Task> tasks(stage.tasks.size());
+        vector<atomic<bool>> cancel(stage.tasks.size());
+        auto run = [&](size_t i) {
+            Task& task = tasks[i];
+            try {
+                OutputWriter buffer([&task](int value) { task.printed.push_back(value); });
+                ExecutionLimits limits;
+                limits.cancel = &cancel[i];
+                task.state.frame = state.frame;
+                IRVM().run(stage.tasks[i], task.state, buffer, limits);
+            } catch (...) {
+                task.error = current_exception();
+            }
+            if (task.error) {
+                for (size_t j = i + 1; j < cancel.size(); ++j) cancel[j] = true;
+            }
+        };
+        TaskLatch latch(tasks.size() - 1);
+        for (size_t i = 1; i < tasks.size(); ++i) {
+            pool.submit([&, i] {
+                run(i);
+                latch.countDown();
+            });
+        }
+        run(0);
+        latch.wait();
+
+        state.prepare(stage.tasks[0]);
+        for (size_t i = 0; i < tasks.size(); ++i) {
+            Task& task = tasks[i];
+            for (int value : task.printed) out.print(value);
+            if (task.state.frame.size() == state.frame.size()) {
+                for (SymbolId slot : stage.writes[i]) state.frame[slot] = task.state.frame[slot];
+            }
+            steps += task.state.steps;
+            if (task.error) {
+                state.steps = steps;
+                rethrow_exception(task.error);
+            }
+        }
+    }
+    state.steps = steps;
+}
@@ -1,73 +1,155 @@
 #pragma once
-#include <memory>
+#include "lexer.h"
+#include <cstdint>
+#include <functional>
+#include <iostream>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
 using namespace std;
 
-// Base AST node
-struct ASTNode {
-    virtual ~ASTNode() = default;
-};
+// Nodes live in a contiguous arena owned by AST and refer to each other by index
+using NodeId = uint32_t;
+using SymbolId = uint32_t;
+constexpr NodeId NO_NODE = UINT32_MAX;
+constexpr uint32_t NO_SLOT = UINT32_MAX;
 
-// Expression nodes
-struct Literal : ASTNode {
-    int value;
-    Literal(int v) : value(v) {}
+// Node kind tag, used by the tree walkers to dispatch with a single switch
+enum class NodeKind : uint8_t {
+    Literal,
+    Identifier,
+    BinaryExpr,
+    Assignment,
+    IfStmt,
+    WhileStmt,
+    Block,
+    PrintStmt
 };
 
-struct Identifier : ASTNode {
-    string name;
-    Identifier(const string& n) : name(n) {}
+// Binary operators
+enum class BinOp : uint8_t {
+    Add, Sub, Mul, Div,
+    Eq, Ne, Lt, Gt, Le, Ge
 };
 
-struct BinaryExpr : ASTNode {
-    string op;
-    shared_ptr<ASTNode> left, right;
-    BinaryExpr(const string& o, shared_ptr<ASTNode> l, shared_ptr<ASTNode> r)
-        : op(o), left(l), right(r) {}
-};
+const char* binOpName(BinOp op);
 
-// Statement nodes
-struct Assignment : ASTNode {
-    string name;
-    shared_ptr<ASTNode> value;
-    Assignment(const string& n, shared_ptr<ASTNode> v) : name(n), value(v) {}
+// AST node (16 bytes). The payload used depends on kind.
+struct ASTNode {
+    NodeKind kind;
+    BinOp op; // BinaryExpr only
+    union {
+        int literal;                                          // Literal
+        // Slots and `unset` are filled in by resolveSlots(); `unset` marks
+        // reads that may run before any assignment to the variable
+        struct { SymbolId name; uint32_t slot; bool unset; } identifier;
+        struct { NodeId left, right; } binary;                // BinaryExpr
+        struct { SymbolId name; NodeId value; uint32_t slot; } assign;
+        struct { NodeId cond, thenBranch, elseBranch; } ifStmt;
+        struct { NodeId cond, body; } whileStmt;
+        struct { uint32_t first, count; } block;              // Range in AST::lists
+        NodeId print;                                         // PrintStmt
+    };
 };
 
-struct IfStmt : ASTNode {
-    shared_ptr<ASTNode> condition;
-    shared_ptr<ASTNode> thenBranch;
-    shared_ptr<ASTNode> elseBranch;
-    IfStmt(shared_ptr<ASTNode> cond, shared_ptr<ASTNode> thenB, shared_ptr<ASTNode> elseB = nullptr)
-        : condition(cond), thenBranch(thenB), elseBranch(elseB) {}
+// Statement range of a Block, usable in range-for
+struct NodeSpan {
+    const NodeId* first;
+    const NodeId* last;
+    const NodeId* begin() const { return first; }
+    const NodeId* end() const { return last; }
+    size_t size() const { return last - first; }
 };
 
-struct WhileStmt : ASTNode {
-    shared_ptr<ASTNode> condition;
-    shared_ptr<ASTNode> body;
-    WhileStmt(shared_ptr<ASTNode> cond, shared_ptr<ASTNode> b)
-        : condition(cond), body(b) {}
-};
+// Arena holding a whole tree: nodes, block statement lists and interned
+// identifier names. Everything is released together with the AST.
+// Symbol names are views into the token text, which must outlive the tree;
+// a SymbolId is also the frame slot of the variable in every engine.
+class AST {
+public:
+    vector<ASTNode> nodes;
+    vector<NodeId> lists;
+    vector<string_view> symbols;
+    vector<uint32_t> lines; // Source line per node, kept beside the 16-byte nodes
+    NodeId root = NO_NODE;
+    uint32_t currentLine = 0; // Line recorded for nodes added from now on
+    vector<SymbolId> slots;   // Symbol of each frame slot, filled by resolveSlots()
+    bool resolved = false;    // Slots are current; cleared by optimizeAST
+
+    const ASTNode& operator[](NodeId id) const { return nodes[id]; }
+    ASTNode& operator[](NodeId id) { return nodes[id]; }
+    uint32_t lineOf(NodeId id) const { return id < lines.size() ? lines[id] : 0; }
 
-struct Block : ASTNode {
-    vector<shared_ptr<ASTNode>> statements;
-    Block(const vector<shared_ptr<ASTNode>>& stmts) : statements(stmts) {}
+    SymbolId intern(string_view name);
+    string_view name(SymbolId sym) const { return symbols[sym]; }
+    NodeSpan statements(const ASTNode& block) const {
+        const NodeId* first = lists.data() + block.block.first;
+        return {first, first + block.block.count};
+    }
+
+    NodeId addLiteral(int value);
+    NodeId addIdentifier(SymbolId sym);
+    NodeId addBinary(BinOp op, NodeId left, NodeId right);
+    NodeId addAssignment(SymbolId sym, NodeId value);
+    NodeId addIf(NodeId cond, NodeId thenB, NodeId elseB = NO_NODE);
+    NodeId addWhile(NodeId cond, NodeId body);
+    NodeId addBlock(const NodeId* stmts, size_t count);
+    NodeId addPrint(NodeId expr);
+
+private:
+    unordered_map<string_view, SymbolId> symbolIds;
+    NodeId add(NodeKind kind);
 };
 
-struct PrintStmt : ASTNode {
-    shared_ptr<ASTNode> expr;
-    PrintStmt(shared_ptr<ASTNode> e) : expr(e) {}
+// Lines spanned by a top-level statement, from its first to its last token
+struct StatementLines {
+    uint32_t first;
+    uint32_t last;
 };
 
-// Parser interface
+// Parser interface. Works on the lexer's token stream, which (like the
+// source it points into) must outlive the parser.
 class Parser {
 public:
-    Parser(const string& input);
+    Parser(const vector<Token>& tokens);
     ~Parser();
-    shared_ptr<ASTNode> parse(); // Parse the whole program/file
+    AST parse(); // Parse the whole program/file
+    // Also reports the lines of each top-level statement, in order
+    AST parse(vector<StatementLines>& topLevel);
 private:
     class ParserImpl; // Forward declaration
     ParserImpl* impl;
 };
 
-void printTree(const shared_ptr<ASTNode>& node, int depth = 0); 
\ No newline at end of file
+void printTree(const AST& ast, NodeId node, int depth = 0, ostream& os = cout);
+
+// What optimizeAST changed
+struct OptimizeStats {
+    int level = 0;
+    size_t nodesBefore = 0;
+    size_t nodesAfter = 0;
+    int folded = 0;          // Arithmetic replaced by a literal
+    int propagated = 0;      // Variable reads replaced by a known constant
+    int branchesRemoved = 0; // if/while decided at compile time
+    int deadStatements = 0;  // Dead stores and effect-free expression statements
+};
+
+// Rewrites the tree in place. Levels:
+//   0: nothing
+//   1: constant folding, comparison folding, unreachable branch removal
+//   2: adds constant propagation and dead store elimination
+// keepFinalValues treats every variable as read after the program ends, for
+// hosts that inspect variables once it has run.
+OptimizeStats optimizeAST(AST& ast, int level = 2, bool keepFinalValues = false);
+void printOptimizeStats(const OptimizeStats& stats, ostream& os = cout);
+
+// Gives every variable its frame slot (its SymbolId, the layout the stack
+// and register VMs use too) and stores it on its Identifier and Assignment
+// nodes. Reads that definite-assignment analysis cannot prove initialized
+// are marked for a run-time check. Throws runtime_error for a read of a
+// variable that no statement assigns when the read is outside every if
+// branch and loop body, so it is certain to run. Run after optimizeAST; the
+// interpreter requires it. `predefined` names variables that already hold
+// a value when the tree starts (a REPL's earlier inputs).
+void resolveSlots(AST& ast, const function<bool(string_view)>& predefined = nullptr);
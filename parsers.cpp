@@ -1,306 +1,840 @@
 #include "parser.h"
 #include <iostream>
-#include <cctype>
+#include <charconv>
+#include <climits>
 #include <stdexcept>
 using namespace std;
 
-shared_ptr<ASTNode> optimizeAST(const shared_ptr<ASTNode>& node) {
-    if (!node) return nullptr;
-
-    if (auto bin = dynamic_pointer_cast<BinaryExpr>(node)) {
-        auto left = optimizeAST(bin->left);
-        auto right = optimizeAST(bin->right);
-
-        if (auto lval = dynamic_pointer_cast<Literal>(left)) {
-            if (auto rval = dynamic_pointer_cast<Literal>(right)) {
-                int result = 0;
-                if (bin->op == "+") result = lval->value + rval->value;
-                else if (bin->op == "-") result = lval->value - rval->value;
-                else if (bin->op == "*") result = lval->value * rval->value;
-                else if (bin->op == "/") {
-                    if (rval->value == 0) throw runtime_error("Division by zero in constant folding");
-                    result = lval->value / rval->value;
-                } else return make_shared<BinaryExpr>(bin->op, left, right);
-                return make_shared<Literal>(result);
+const char* binOpName(BinOp op) {
+    switch (op) {
+        case BinOp::Add: return "+";
+        case BinOp::Sub: return "-";
+        case BinOp::Mul: return "*";
+        case BinOp::Div: return "/";
+        case BinOp::Eq: return "==";
+        case BinOp::Ne: return "!=";
+        case BinOp::Lt: return "<";
+        case BinOp::Gt: return ">";
+        case BinOp::Le: return "<=";
+        case BinOp::Ge: return ">=";
+    }
+    return "?";
+}
+
+SymbolId AST::intern(string_view name) {
+    auto it = symbolIds.find(name);
+    if (it != symbolIds.end()) return it->second;
+    SymbolId sym = (SymbolId)symbols.size();
+    symbols.push_back(name);
+    symbolIds.emplace(name, sym);
+    return sym;
+}
+
+NodeId AST::add(NodeKind kind) {
+    NodeId id = (NodeId)nodes.size();
+    nodes.emplace_back();
+    nodes.back().kind = kind;
+    lines.push_back(currentLine);
+    return id;
+}
+
+NodeId AST::addLiteral(int value) {
+    NodeId id = add(NodeKind::Literal);
+    nodes[id].literal = value;
+    return id;
+}
+
+NodeId AST::addIdentifier(SymbolId sym) {
+    NodeId id = add(NodeKind::Identifier);
+    nodes[id].identifier = {sym, NO_SLOT, true};
+    return id;
+}
+
+NodeId AST::addBinary(BinOp op, NodeId left, NodeId right) {
+    NodeId id = add(NodeKind::BinaryExpr);
+    nodes[id].op = op;
+    nodes[id].binary = {left, right};
+    return id;
+}
+
+NodeId AST::addAssignment(SymbolId sym, NodeId value) {
+    NodeId id = add(NodeKind::Assignment);
+    nodes[id].assign = {sym, value, NO_SLOT};
+    return id;
+}
+
+NodeId AST::addIf(NodeId cond, NodeId thenB, NodeId elseB) {
+    NodeId id = add(NodeKind::IfStmt);
+    nodes[id].ifStmt = {cond, thenB, elseB};
+    return id;
+}
+
+NodeId AST::addWhile(NodeId cond, NodeId body) {
+    NodeId id = add(NodeKind::WhileStmt);
+    nodes[id].whileStmt = {cond, body};
+    return id;
+}
+
+NodeId AST::addBlock(const NodeId* stmts, size_t count) {
+    NodeId id = add(NodeKind::Block);
+    nodes[id].block = {(uint32_t)lists.size(), (uint32_t)count};
+    lists.insert(lists.end(), stmts, stmts + count);
+    return id;
+}
+
+NodeId AST::addPrint(NodeId expr) {
+    NodeId id = add(NodeKind::PrintStmt);
+    nodes[id].print = expr;
+    return id;
+}
+
+// ---- AST optimizer ----
+// Nodes are only rewritten, never added, so references stay valid while a
+// pass runs. Statements return the (possibly replaced) node, or NO_NODE if
+// they were removed; blocks are compacted in place and never removed.
+
+namespace {
+
+// Compile-time value of an expression. Comparison results are tracked
+// separately: the interpreter keeps them as bool, so they are only used to
+// decide branches and never turned into int literals.
+struct Known {
+    bool known = false;
+    bool isBool = false;
+    int value = 0;
+};
+
+using ConstEnv = unordered_map<SymbolId, Known>;
+using LiveSet = vector<bool>; // Indexed by SymbolId
+
+struct OptContext {
+    AST& ast;
+    bool propagate; // -O2: use and track known variable values
+    OptimizeStats& stats;
+};
+
+// Sets `unset` on the reads that may run before their variable is assigned
+// (defined with the slot resolver below)
+void markUnsetReads(AST& ast);
+
+// Fold an expression in place. Arithmetic wraps like the VMs do; divisions
+// that would trap are left for run time.
+Known foldExpr(OptContext& ctx, NodeId id, const ConstEnv& env) {
+    ASTNode& node = ctx.ast[id];
+    switch (node.kind) {
+        case NodeKind::Literal:
+            return {true, false, node.literal};
+        case NodeKind::Identifier: {
+            if (!ctx.propagate) return {};
+            auto it = env.find(node.identifier.name);
+            if (it == env.end()) return {};
+            if (!it->second.isBool) {
+                node.kind = NodeKind::Literal;
+                node.literal = it->second.value;
+                ++ctx.stats.propagated;
+            }
+            return it->second;
+        }
+        case NodeKind::BinaryExpr: {
+            Known l = foldExpr(ctx, node.binary.left, env);
+            Known r = foldExpr(ctx, node.binary.right, env);
+            // Bools take part as 0 and 1, as in every engine
+            if (!l.known || !r.known) return {};
+            unsigned a = (unsigned)l.value, b = (unsigned)r.value;
+            int result = 0;
+            switch (node.op) {
+                case BinOp::Add: result = (int)(a + b); break;
+                case BinOp::Sub: result = (int)(a - b); break;
+                case BinOp::Mul: result = (int)(a * b); break;
+                case BinOp::Div:
+                    if (r.value == 0 || (l.value == INT_MIN && r.value == -1)) return {};
+                    result = l.value / r.value;
+                    break;
+                case BinOp::Eq: return {true, true, l.value == r.value};
+                case BinOp::Ne: return {true, true, l.value != r.value};
+                case BinOp::Lt: return {true, true, l.value < r.value};
+                case BinOp::Gt: return {true, true, l.value > r.value};
+                case BinOp::Le: return {true, true, l.value <= r.value};
+                case BinOp::Ge: return {true, true, l.value >= r.value};
+            }
+            node.kind = NodeKind::Literal;
+            node.literal = result;
+            ++ctx.stats.folded;
+            return {true, false, result};
+        }
+        default:
+            return {};
+    }
+}
+
+void collectAssigned(const AST& ast, NodeId id, vector<SymbolId>& out) {
+    if (id == NO_NODE) return;
+    const ASTNode& node = ast[id];
+    switch (node.kind) {
+        case NodeKind::Assignment: out.push_back(node.assign.name); break;
+        case NodeKind::IfStmt:
+            collectAssigned(ast, node.ifStmt.thenBranch, out);
+            collectAssigned(ast, node.ifStmt.elseBranch, out);
+            break;
+        case NodeKind::WhileStmt: collectAssigned(ast, node.whileStmt.body, out); break;
+        case NodeKind::Block:
+            for (NodeId stmt : ast.statements(node)) collectAssigned(ast, stmt, out);
+            break;
+        default: break;
+    }
+}
+
+// Keep only the facts that hold on both paths
+void intersect(ConstEnv& env, const ConstEnv& other) {
+    for (auto it = env.begin(); it != env.end(); ) {
+        auto o = other.find(it->first);
+        bool same = o != other.end() && o->second.isBool == it->second.isBool &&
+                    o->second.value == it->second.value;
+        it = same ? next(it) : env.erase(it);
+    }
+}
+
+// Forward pass: folding, constant propagation and branch resolution.
+// A loop kills every variable its body assigns, so conditions that only
+// depend on loop-invariant constants still resolve inside the loop.
+NodeId optimizeStmt(OptContext& ctx, NodeId id, ConstEnv& env) {
+    if (id == NO_NODE) return NO_NODE;
+    AST& ast = ctx.ast;
+    ASTNode& node = ast[id];
+
+    switch (node.kind) {
+        case NodeKind::Assignment: {
+            Known value = foldExpr(ctx, node.assign.value, env);
+            if (!ctx.propagate) return id;
+            if (value.known) env[node.assign.name] = value;
+            else env.erase(node.assign.name);
+            return id;
+        }
+
+        case NodeKind::IfStmt: {
+            Known cond = foldExpr(ctx, node.ifStmt.cond, env);
+            if (cond.known) {
+                ++ctx.stats.branchesRemoved;
+                return optimizeStmt(ctx, cond.value ? node.ifStmt.thenBranch : node.ifStmt.elseBranch, env);
+            }
+            ConstEnv elseEnv = env;
+            node.ifStmt.thenBranch = optimizeStmt(ctx, node.ifStmt.thenBranch, env);
+            node.ifStmt.elseBranch = optimizeStmt(ctx, node.ifStmt.elseBranch, elseEnv);
+            intersect(env, elseEnv);
+            return id;
+        }
+
+        case NodeKind::WhileStmt: {
+            vector<SymbolId> assigned;
+            collectAssigned(ast, node.whileStmt.body, assigned);
+            for (SymbolId sym : assigned) env.erase(sym);
+            Known cond = foldExpr(ctx, node.whileStmt.cond, env);
+            if (cond.known && cond.value == 0) {
+                ++ctx.stats.branchesRemoved;
+                return NO_NODE;
+            }
+            ConstEnv bodyEnv = env;
+            node.whileStmt.body = optimizeStmt(ctx, node.whileStmt.body, bodyEnv);
+            return id;
+        }
+
+        case NodeKind::Block: {
+            uint32_t first = node.block.first;
+            uint32_t out = first;
+            for (uint32_t i = first; i < first + node.block.count; ++i) {
+                NodeId stmt = optimizeStmt(ctx, ast.lists[i], env);
+                if (stmt != NO_NODE) ast.lists[out++] = stmt;
+            }
+            ast[id].block.count = out - first;
+            return id;
+        }
+
+        case NodeKind::PrintStmt:
+            foldExpr(ctx, node.print, env);
+            return id;
+
+        case NodeKind::Literal:
+        case NodeKind::Identifier:
+        case NodeKind::BinaryExpr:
+            foldExpr(ctx, id, env);
+            return id;
+    }
+    return id;
+}
+
+void addUses(const AST& ast, NodeId id, LiveSet& live) {
+    const ASTNode& node = ast[id];
+    if (node.kind == NodeKind::Identifier) {
+        live[node.identifier.name] = true;
+    } else if (node.kind == NodeKind::BinaryExpr) {
+        addUses(ast, node.binary.left, live);
+        addUses(ast, node.binary.right, live);
+    }
+}
+
+// Expression that cannot trap, so dropping it is unobservable. Reads
+// marked `unset` may fail with "Undefined variable" and are kept.
+bool isPure(const AST& ast, NodeId id) {
+    const ASTNode& node = ast[id];
+    if (node.kind == NodeKind::Identifier) return !node.identifier.unset;
+    if (node.kind != NodeKind::BinaryExpr) return true;
+    if (node.op == BinOp::Div) {
+        const ASTNode& divisor = ast[node.binary.right];
+        if (divisor.kind != NodeKind::Literal || divisor.literal == 0 || divisor.literal == -1) return false;
+    }
+    return isPure(ast, node.binary.left) && isPure(ast, node.binary.right);
+}
+
+// Backward liveness pass. `live` holds the variables read later on entry and
+// those read by or after the statement on exit. Stores to variables that are
+// not live and effect-free expression statements are dropped when `rewrite`
+// is set; with it clear the pass only computes liveness (used for the loop
+// fixpoint).
+NodeId eliminateDead(OptContext& ctx, NodeId id, LiveSet& live, bool rewrite) {
+    if (id == NO_NODE) return NO_NODE;
+    AST& ast = ctx.ast;
+    ASTNode& node = ast[id];
+
+    switch (node.kind) {
+        case NodeKind::Assignment:
+            if (!live[node.assign.name] && isPure(ast, node.assign.value)) {
+                if (rewrite) ++ctx.stats.deadStatements;
+                return rewrite ? NO_NODE : id;
+            }
+            live[node.assign.name] = false;
+            addUses(ast, node.assign.value, live);
+            return id;
+
+        case NodeKind::PrintStmt:
+            addUses(ast, node.print, live);
+            return id;
+
+        case NodeKind::IfStmt: {
+            LiveSet elseLive = live;
+            NodeId thenB = eliminateDead(ctx, node.ifStmt.thenBranch, live, rewrite);
+            NodeId elseB = eliminateDead(ctx, node.ifStmt.elseBranch, elseLive, rewrite);
+            for (size_t i = 0; i < live.size(); ++i) live[i] = live[i] || elseLive[i];
+            addUses(ast, node.ifStmt.cond, live);
+            if (!rewrite) return id;
+            node.ifStmt.thenBranch = thenB;
+            node.ifStmt.elseBranch = elseB;
+            return id;
+        }
+
+        case NodeKind::WhileStmt: {
+            // Live at the loop head = read by the condition, after the loop,
+            // or by the body before being written; iterate to a fixpoint
+            LiveSet exitLive = live;
+            LiveSet head = exitLive;
+            addUses(ast, node.whileStmt.cond, head);
+            for (;;) {
+                LiveSet bodyLive = head;
+                eliminateDead(ctx, node.whileStmt.body, bodyLive, false);
+                LiveSet next = exitLive;
+                addUses(ast, node.whileStmt.cond, next);
+                for (size_t i = 0; i < next.size(); ++i) next[i] = next[i] || bodyLive[i];
+                if (next == head) break;
+                head = std::move(next);
+            }
+            if (rewrite) {
+                LiveSet bodyLive = head;
+                node.whileStmt.body = eliminateDead(ctx, node.whileStmt.body, bodyLive, true);
+            }
+            live = std::move(head);
+            return id;
+        }
+
+        case NodeKind::Block: {
+            uint32_t first = node.block.first;
+            uint32_t count = node.block.count;
+            for (uint32_t i = first + count; i-- > first; ) {
+                NodeId stmt = eliminateDead(ctx, ast.lists[i], live, rewrite);
+                if (rewrite) ast.lists[i] = stmt;
+            }
+            if (!rewrite) return id;
+            uint32_t out = first;
+            for (uint32_t i = first; i < first + count; ++i) {
+                if (ast.lists[i] != NO_NODE) ast.lists[out++] = ast.lists[i];
+            }
+            node.block.count = out - first;
+            return id;
+        }
+
+        case NodeKind::Literal:
+        case NodeKind::Identifier:
+        case NodeKind::BinaryExpr:
+            // Expression statement: its value is discarded
+            if (isPure(ast, id)) {
+                if (rewrite) ++ctx.stats.deadStatements;
+                return rewrite ? NO_NODE : id;
             }
+            addUses(ast, id, live);
+            return id;
+    }
+    return id;
+}
+
+size_t countNodes(const AST& ast, NodeId id) {
+    if (id == NO_NODE) return 0;
+    const ASTNode& node = ast[id];
+    switch (node.kind) {
+        case NodeKind::BinaryExpr:
+            return 1 + countNodes(ast, node.binary.left) + countNodes(ast, node.binary.right);
+        case NodeKind::Assignment: return 1 + countNodes(ast, node.assign.value);
+        case NodeKind::IfStmt:
+            return 1 + countNodes(ast, node.ifStmt.cond) + countNodes(ast, node.ifStmt.thenBranch) +
+                   countNodes(ast, node.ifStmt.elseBranch);
+        case NodeKind::WhileStmt:
+            return 1 + countNodes(ast, node.whileStmt.cond) + countNodes(ast, node.whileStmt.body);
+        case NodeKind::Block: {
+            size_t n = 1;
+            for (NodeId stmt : ast.statements(node)) n += countNodes(ast, stmt);
+            return n;
+        }
+        case NodeKind::PrintStmt: return 1 + countNodes(ast, node.print);
+        default: return 1;
+    }
+}
+
+} // namespace
+
+OptimizeStats optimizeAST(AST& ast, int level, bool keepFinalValues) {
+    OptimizeStats stats;
+    stats.level = level;
+    stats.nodesBefore = countNodes(ast, ast.root);
+    if (level > 0) {
+        OptContext ctx{ast, level >= 2, stats};
+        ConstEnv env;
+        ast.root = optimizeStmt(ctx, ast.root, env);
+        if (level >= 2) {
+            markUnsetReads(ast);
+            LiveSet live(ast.symbols.size(), keepFinalValues);
+            ast.root = eliminateDead(ctx, ast.root, live, true);
         }
-        return make_shared<BinaryExpr>(bin->op, left, right);
     }
+    stats.nodesAfter = countNodes(ast, ast.root);
+    if (level > 0) ast.resolved = false;
+    return stats;
+}
 
-    if (auto assign = dynamic_pointer_cast<Assignment>(node)) {
-        auto newVal = optimizeAST(assign->value);
-        return make_shared<Assignment>(assign->name, newVal);
+void printOptimizeStats(const OptimizeStats& stats, ostream& os) {
+    os << "[Optimizer] -O" << stats.level << ": folded " << stats.folded << ", propagated "
+         << stats.propagated << ", removed " << stats.branchesRemoved << " branch(es) and "
+         << stats.deadStatements << " dead statement(s)\n";
+    os << "[Optimizer] " << stats.nodesBefore << " -> " << stats.nodesAfter << " nodes ("
+         << stats.nodesBefore - stats.nodesAfter << " removed)\n";
+}
+
+
+namespace {
+
+// Definite assignment over the statement tree. `assigned` holds the
+// variables certainly written on every path to the current point; `trail`
+// records the order they were set in, so a branch can be undone without
+// copying the whole set. `branches` counts the if branches and loop bodies
+// around the current point: reads outside them are certain to run.
+class SlotResolver {
+public:
+    explicit SlotResolver(AST& ast)
+        : ast(ast), assigned(ast.symbols.size(), false),
+          everAssigned(ast.symbols.size(), false), inThen(ast.symbols.size(), false),
+          certainRead(ast.symbols.size(), NO_NODE) {}
+
+    // Slots and `unset` marks, without the undefined variable check
+    void mark(const function<bool(string_view)>& predefined) {
+        // Slot n holds symbol n, the layout every engine uses
+        ast.slots.resize(ast.symbols.size());
+        for (SymbolId sym = 0; sym < ast.symbols.size(); ++sym) ast.slots[sym] = sym;
+        if (predefined) {
+            for (SymbolId sym = 0; sym < ast.symbols.size(); ++sym) {
+                if (predefined(ast.symbols[sym])) assign(sym);
+            }
+        }
+        if (ast.root != NO_NODE) statement(ast.root);
     }
 
-    if (auto ifstmt = dynamic_pointer_cast<IfStmt>(node)) {
-        auto cond = optimizeAST(ifstmt->condition);
-        auto thenB = optimizeAST(ifstmt->thenBranch);
-        auto elseB = optimizeAST(ifstmt->elseBranch);
-        if (auto condLit = dynamic_pointer_cast<Literal>(cond)) {
-            return condLit->value ? thenB : elseB;
+    void run(const function<bool(string_view)>& predefined) {
+        mark(predefined);
+        // Report the earliest certain read of a variable that is never
+        // written; other reads of it fail at run time, if they run at all
+        NodeId undefined = NO_NODE;
+        for (SymbolId sym = 0; sym < certainRead.size(); ++sym) {
+            if (certainRead[sym] != NO_NODE && !everAssigned[sym] && certainRead[sym] < undefined) {
+                undefined = certainRead[sym];
+            }
+        }
+        if (undefined != NO_NODE) {
+            throw runtime_error("Undefined variable: " + string(ast.name(ast[undefined].identifier.name)) +
+                                " at line " + to_string(ast.lineOf(undefined)));
         }
-        return make_shared<IfStmt>(cond, thenB, elseB);
+        ast.resolved = true;
+    }
+
+private:
+    AST& ast;
+    vector<bool> assigned;    // Indexed by SymbolId
+    vector<SymbolId> trail;
+    vector<bool> everAssigned;
+    vector<bool> inThen;        // Scratch for intersecting if/else branches
+    vector<NodeId> certainRead; // First read outside any branch, by SymbolId
+    vector<NodeId> pending;     // Expression walk stack
+    uint32_t branches = 0;
+
+    uint32_t slot(SymbolId sym) { return sym; }
+
+    void assign(SymbolId sym) {
+        everAssigned[sym] = true;
+        if (assigned[sym]) return;
+        assigned[sym] = true;
+        trail.push_back(sym);
     }
 
-    if (auto wh = dynamic_pointer_cast<WhileStmt>(node)) {
-        auto cond = optimizeAST(wh->condition);
-        auto body = optimizeAST(wh->body);
-        if (auto condLit = dynamic_pointer_cast<Literal>(cond)) {
-            if (condLit->value == 0) return nullptr;
+    void undo(size_t mark) {
+        while (trail.size() > mark) {
+            assigned[trail.back()] = false;
+            trail.pop_back();
         }
-        return make_shared<WhileStmt>(cond, body);
     }
 
-    if (auto blk = dynamic_pointer_cast<Block>(node)) {
-        vector<shared_ptr<ASTNode>> newStmts;
-        for (auto& stmt : blk->statements) {
-            auto opt = optimizeAST(stmt);
-            if (opt) newStmts.push_back(opt);
+    // Expressions only read, so they are walked without recursion
+    void expression(NodeId root) {
+        pending.push_back(root);
+        while (!pending.empty()) {
+            NodeId id = pending.back();
+            pending.pop_back();
+            ASTNode& node = ast[id];
+            if (node.kind == NodeKind::Identifier) {
+                SymbolId sym = node.identifier.name;
+                node.identifier.slot = slot(sym);
+                node.identifier.unset = !assigned[sym];
+                if (branches == 0 && certainRead[sym] == NO_NODE) certainRead[sym] = id;
+            } else if (node.kind == NodeKind::BinaryExpr) {
+                pending.push_back(node.binary.right);
+                pending.push_back(node.binary.left);
+            }
         }
-        return make_shared<Block>(newStmts);
     }
 
-    if (auto print = dynamic_pointer_cast<PrintStmt>(node)) {
-        return make_shared<PrintStmt>(optimizeAST(print->expr));
+    void statement(NodeId id) {
+        ASTNode& node = ast[id];
+        switch (node.kind) {
+            case NodeKind::Assignment:
+                expression(node.assign.value);
+                node.assign.slot = slot(node.assign.name);
+                assign(node.assign.name);
+                break;
+            case NodeKind::IfStmt: {
+                expression(node.ifStmt.cond);
+                size_t mark = trail.size();
+                ++branches;
+                if (node.ifStmt.thenBranch != NO_NODE) statement(node.ifStmt.thenBranch);
+                vector<SymbolId> thenAssigned(trail.begin() + mark, trail.end());
+                undo(mark);
+                if (node.ifStmt.elseBranch != NO_NODE) statement(node.ifStmt.elseBranch);
+                --branches;
+                // Only variables written by both branches are certainly set
+                for (SymbolId sym : thenAssigned) inThen[sym] = true;
+                vector<SymbolId> both;
+                for (size_t i = mark; i < trail.size(); ++i) {
+                    if (inThen[trail[i]]) both.push_back(trail[i]);
+                }
+                for (SymbolId sym : thenAssigned) inThen[sym] = false;
+                undo(mark);
+                for (SymbolId sym : both) assign(sym);
+                break;
+            }
+            case NodeKind::WhileStmt: {
+                expression(node.whileStmt.cond);
+                // The body may run zero times
+                size_t mark = trail.size();
+                ++branches;
+                if (node.whileStmt.body != NO_NODE) statement(node.whileStmt.body);
+                --branches;
+                undo(mark);
+                break;
+            }
+            case NodeKind::Block:
+                for (NodeId stmt : ast.statements(node)) statement(stmt);
+                break;
+            case NodeKind::PrintStmt: expression(node.print); break;
+            default: expression(id); break;
+        }
     }
+};
 
-    return node;
+void markUnsetReads(AST& ast) {
+    SlotResolver(ast).mark(nullptr);
 }
 
+} // namespace
+
+void resolveSlots(AST& ast, const function<bool(string_view)>& predefined) {
+    SlotResolver(ast).run(predefined);
+}
 
 class Parser::ParserImpl {
 public:
-    ParserImpl(const string& in) : input(in), pos(0) {}
+    ParserImpl(const vector<Token>& toks) : tokens(toks), pos(0) {
+        // Roughly one node per token; sized once up front
+        ast.nodes.reserve(tokens.size() + 1);
+        ast.lines.reserve(tokens.size() + 1);
+        skipComments();
+    }
 
-    shared_ptr<ASTNode> parse() {
-        auto stmts = parseStatements();
-        return make_shared<Block>(stmts);
+    AST parse(vector<StatementLines>* topLevel = nullptr) {
+        ast.root = parseStatements(topLevel);
+        if (peek().kind != TokenKind::END) fail("Unexpected '" + string(peek().value) + "'");
+        return std::move(ast);
     }
 
 private:
-    string input;
+    const vector<Token>& tokens;
     size_t pos;
+    AST ast;
+    vector<NodeId> pending; // Statements of the blocks currently being parsed
 
-    void skipWhitespace() {
-        while (pos < input.size() && isspace(input[pos])) pos++;
+    const Token& peek() const {
+        static const Token endToken{TokenType::UNKNOWN, "", 0, TokenKind::END};
+        return pos < tokens.size() ? tokens[pos] : endToken;
     }
 
-    char peek() {
-        skipWhitespace();
-        if (pos < input.size()) return input[pos];
-        return '\0';
+    const Token& get() {
+        const Token& tok = peek();
+        if (pos < tokens.size()) {
+            // Expressions take the line of their last token
+            ast.currentLine = (uint32_t)tok.lineNumber;
+            ++pos;
+            skipComments();
+        }
+        return tok;
     }
 
-    char get() {
-        skipWhitespace();
-        if (pos < input.size()) return input[pos++];
-        return '\0';
+    void skipComments() {
+        while (pos < tokens.size() && tokens[pos].kind == TokenKind::COMMENT) ++pos;
     }
 
-    bool match(const string& kw) {
-        skipWhitespace();
-        size_t len = kw.size();
-        if (input.substr(pos, len) == kw) {
-            pos += len;
-            return true;
-        }
-        return false;
+    bool match(TokenKind kind) {
+        if (peek().kind != kind) return false;
+        get();
+        return true;
     }
 
-    vector<shared_ptr<ASTNode>> parseStatements() {
-        vector<shared_ptr<ASTNode>> stmts;
-        while (peek() && peek() != '}') {
-            stmts.push_back(parseStatement());
+    [[noreturn]] void fail(const string& message) const {
+        int line = pos < tokens.size() ? tokens[pos].lineNumber
+                 : tokens.empty() ? 1 : tokens.back().lineNumber;
+        throw runtime_error(message + " at line " + to_string(line));
+    }
+
+    // Parse statements up to '}' or end of input into a Block node
+    NodeId parseStatements(vector<StatementLines>* spans = nullptr) {
+        size_t mark = pending.size();
+        while (peek().kind != TokenKind::END && peek().kind != TokenKind::RBRACE) {
+            uint32_t first = (uint32_t)peek().lineNumber;
+            NodeId stmt = parseStatement();
+            pending.push_back(stmt);
+            // get() leaves currentLine at the statement's last token
+            if (spans) spans->push_back({first, ast.currentLine});
         }
-        return stmts;
-    }
-
-    shared_ptr<ASTNode> parseStatement() {
-        if (match("if")) return parseIf();
-        if (match("while")) return parseWhile();
-        if (match("print")) return parsePrint();
-        if (peek() == '{') return parseBlock();
-        if (isalpha(peek()) || peek() == '_') {
-            size_t save = pos;
-            string name = parseIdentifier();
-            skipWhitespace();
-            if (peek() == '=') {
-                pos = save;
-                return parseAssignment();
-            } else {
-                pos = save;
-                auto expr = parseExpression();
-                expect(';');
-                return expr;
-            }
+        NodeId block = ast.addBlock(pending.data() + mark, pending.size() - mark);
+        pending.resize(mark);
+        return block;
+    }
+
+    // Statements take the line they start on
+    NodeId parseStatement() {
+        uint32_t line = (uint32_t)peek().lineNumber;
+        NodeId stmt = parseStatementAt();
+        ast.lines[stmt] = line;
+        return stmt;
+    }
+
+    NodeId parseStatementAt() {
+        switch (peek().kind) {
+            case TokenKind::KW_IF: get(); return parseIf();
+            case TokenKind::KW_WHILE: get(); return parseWhile();
+            case TokenKind::KW_PRINT: get(); return parsePrint();
+            case TokenKind::LBRACE: return parseBlock();
+            case TokenKind::IDENTIFIER:
+                if (pos + 1 < tokens.size() && tokens[pos + 1].kind == TokenKind::ASSIGN)
+                    return parseAssignment();
+                break;
+            default:
+                break;
         }
         auto expr = parseExpression();
-        expect(';');
+        expect(TokenKind::SEMICOLON, ";");
         return expr;
     }
 
-    shared_ptr<ASTNode> parseAssignment() {
-        string name = parseIdentifier();
-        expect('=');
+    NodeId parseAssignment() {
+        SymbolId name = ast.intern(get().value);
+        expect(TokenKind::ASSIGN, "=");
         auto value = parseExpression();
-        expect(';');
-        return make_shared<Assignment>(name, value);
+        expect(TokenKind::SEMICOLON, ";");
+        return ast.addAssignment(name, value);
     }
 
-    shared_ptr<ASTNode> parseIf() {
-        expect('(');
+    NodeId parseIf() {
+        expect(TokenKind::LPAREN, "(");
         auto cond = parseExpression();
-        expect(')');
+        expect(TokenKind::RPAREN, ")");
         auto thenB = parseStatement();
-        shared_ptr<ASTNode> elseB = nullptr;
-        if (match("else")) {
+        NodeId elseB = NO_NODE;
+        if (match(TokenKind::KW_ELSE)) {
             elseB = parseStatement();
         }
-        return make_shared<IfStmt>(cond, thenB, elseB);
+        return ast.addIf(cond, thenB, elseB);
     }
 
-    shared_ptr<ASTNode> parseWhile() {
-        expect('(');
+    NodeId parseWhile() {
+        expect(TokenKind::LPAREN, "(");
         auto cond = parseExpression();
-        expect(')');
+        expect(TokenKind::RPAREN, ")");
         auto body = parseStatement();
-        return make_shared<WhileStmt>(cond, body);
+        return ast.addWhile(cond, body);
     }
 
-    shared_ptr<ASTNode> parseBlock() {
-        expect('{');
-        auto stmts = parseStatements();
-        expect('}');
-        return make_shared<Block>(stmts);
+    NodeId parseBlock() {
+        expect(TokenKind::LBRACE, "{");
+        auto block = parseStatements();
+        expect(TokenKind::RBRACE, "}");
+        return block;
     }
 
-    shared_ptr<ASTNode> parseExpression() {
+    NodeId parseExpression() {
         return parseEquality();
     }
 
-    shared_ptr<ASTNode> parseEquality() {
+    NodeId parseEquality() {
         auto node = parseRelational();
         while (true) {
-            if (match("==")) node = make_shared<BinaryExpr>("==", node, parseRelational());
-            else if (match("!=")) node = make_shared<BinaryExpr>("!=", node, parseRelational());
+            if (match(TokenKind::EQ)) node = ast.addBinary(BinOp::Eq, node, parseRelational());
+            else if (match(TokenKind::NE)) node = ast.addBinary(BinOp::Ne, node, parseRelational());
             else return node;
         }
     }
 
-    shared_ptr<ASTNode> parseRelational() {
+    NodeId parseRelational() {
         auto node = parseAdditive();
         while (true) {
-            if (match("<")) node = make_shared<BinaryExpr>("<", node, parseAdditive());
-            else if (match(">")) node = make_shared<BinaryExpr>(">", node, parseAdditive());
-            else if (match("<=")) node = make_shared<BinaryExpr>("<=", node, parseAdditive());
-            else if (match(">=")) node = make_shared<BinaryExpr>(">=", node, parseAdditive());
+            if (match(TokenKind::LT)) node = ast.addBinary(BinOp::Lt, node, parseAdditive());
+            else if (match(TokenKind::GT)) node = ast.addBinary(BinOp::Gt, node, parseAdditive());
+            else if (match(TokenKind::LE)) node = ast.addBinary(BinOp::Le, node, parseAdditive());
+            else if (match(TokenKind::GE)) node = ast.addBinary(BinOp::Ge, node, parseAdditive());
             else return node;
         }
     }
 
-    shared_ptr<ASTNode> parseAdditive() {
+    NodeId parseAdditive() {
         auto node = parseTerm();
         while (true) {
-            if (match("+")) node = make_shared<BinaryExpr>("+", node, parseTerm());
-            else if (match("-")) node = make_shared<BinaryExpr>("-", node, parseTerm());
+            if (match(TokenKind::PLUS)) node = ast.addBinary(BinOp::Add, node, parseTerm());
+            else if (match(TokenKind::MINUS)) node = ast.addBinary(BinOp::Sub, node, parseTerm());
             else return node;
         }
     }
 
-    shared_ptr<ASTNode> parseTerm() {
+    NodeId parseTerm() {
         auto node = parseFactor();
         while (true) {
-            if (match("*")) node = make_shared<BinaryExpr>("*", node, parseFactor());
-            else if (match("/")) node = make_shared<BinaryExpr>("/", node, parseFactor());
+            if (match(TokenKind::STAR)) node = ast.addBinary(BinOp::Mul, node, parseFactor());
+            else if (match(TokenKind::SLASH)) node = ast.addBinary(BinOp::Div, node, parseFactor());
             else return node;
         }
     }
 
-    shared_ptr<ASTNode> parseFactor() {
-        if (isdigit(peek())) {
-            int val = 0;
-            while (isdigit(peek())) val = val * 10 + (get() - '0');
-            return make_shared<Literal>(val);
-        } else if (peek() == '(') {
-            get();
-            auto node = parseExpression();
-            expect(')');
-            return node;
-        } else if (isalpha(peek()) || peek() == '_') {
-            string name = parseIdentifier();
-            return make_shared<Identifier>(name);
-        } else {
-            throw runtime_error("Unexpected character in factor");
-        }
-    }
-
-    string parseIdentifier() {
-        skipWhitespace();
-        string name;
-        if (isalpha(peek()) || peek() == '_') {
-            name += get();
-            while (isalnum(peek()) || peek() == '_') name += get();
-        } else {
-            throw runtime_error("Expected identifier");
+    NodeId parseFactor() {
+        const Token& tok = peek();
+        switch (tok.kind) {
+            case TokenKind::NUMBER: {
+                int val = 0;
+                auto [end, ec] = from_chars(tok.value.data(), tok.value.data() + tok.value.size(), val);
+                if (ec != errc() || end != tok.value.data() + tok.value.size())
+                    fail("Invalid integer literal '" + string(tok.value) + "'");
+                get();
+                return ast.addLiteral(val);
+            }
+            case TokenKind::LPAREN: {
+                get();
+                auto node = parseExpression();
+                expect(TokenKind::RPAREN, ")");
+                return node;
+            }
+            case TokenKind::IDENTIFIER:
+                return ast.addIdentifier(ast.intern(get().value));
+            default:
+                if (tok.kind == TokenKind::END) fail("Unexpected end of input in factor");
+                fail("Unexpected '" + string(tok.value) + "' in factor");
         }
-        return name;
     }
 
-    void expect(char c) {
-        skipWhitespace();
-        if (get() != c) throw runtime_error(string("Expected '") + c + "'");
+    void expect(TokenKind kind, const char* spelling) {
+        if (!match(kind)) fail(string("Expected '") + spelling + "'");
     }
 
-    shared_ptr<ASTNode> parsePrint() {
+    NodeId parsePrint() {
         auto expr = parseExpression();
-        expect(';');
-        return make_shared<PrintStmt>(expr);
+        expect(TokenKind::SEMICOLON, ";");
+        return ast.addPrint(expr);
     }
 };
 
-Parser::Parser(const string& in) : impl(new ParserImpl(in)) {}
+Parser::Parser(const vector<Token>& tokens) : impl(new ParserImpl(tokens)) {}
 
 Parser::~Parser() { delete impl; }
 
-shared_ptr<ASTNode> Parser::parse() { return impl->parse(); }
+AST Parser::parse() { return impl->parse(); }
 
-void printTree(const shared_ptr<ASTNode>& node, int depth) {
-    if (!node) return;
+AST Parser::parse(vector<StatementLines>& topLevel) { return impl->parse(&topLevel); }
+
+void printTree(const AST& ast, NodeId id, int depth, ostream& os) {
+    if (id == NO_NODE) return;
     string indent(depth * 4, ' ');
-    if (auto lit = dynamic_pointer_cast<Literal>(node)) {
-        cout << indent << "Literal: " << lit->value << "\n";
-    } else if (auto id = dynamic_pointer_cast<Identifier>(node)) {
-        cout << indent << "Identifier: " << id->name << "\n";
-    } else if (auto bin = dynamic_pointer_cast<BinaryExpr>(node)) {
-        cout << indent << "BinaryExpr: " << bin->op << "\n";
-        printTree(bin->left, depth + 1);
-        printTree(bin->right, depth + 1);
-    } else if (auto assign = dynamic_pointer_cast<Assignment>(node)) {
-        cout << indent << "Assignment: " << assign->name << "\n";
-        printTree(assign->value, depth + 1);
-    } else if (auto iff = dynamic_pointer_cast<IfStmt>(node)) {
-        cout << indent << "IfStmt\n";
-        cout << indent << "  Condition:\n";
-        printTree(iff->condition, depth + 2);
-        cout << indent << "  Then:\n";
-        printTree(iff->thenBranch, depth + 2);
-        if (iff->elseBranch) {
-            cout << indent << "  Else:\n";
-            printTree(iff->elseBranch, depth + 2);
-        }
-    } else if (auto wh = dynamic_pointer_cast<WhileStmt>(node)) {
-        cout << indent << "WhileStmt\n";
-        cout << indent << "  Condition:\n";
-        printTree(wh->condition, depth + 2);
-        cout << indent << "  Body:\n";
-        printTree(wh->body, depth + 2);
-    } else if (auto block = dynamic_pointer_cast<Block>(node)) {
-        cout << indent << "Block\n";
-        for (auto& stmt : block->statements) printTree(stmt, depth + 1);
-    } else if (auto print = dynamic_pointer_cast<PrintStmt>(node)) {
-        cout << indent << "PrintStmt\n";
-        printTree(print->expr, depth + 1);
-    } else {
-        cout << indent << "Unknown node\n";
+    const ASTNode& node = ast[id];
+    switch (node.kind) {
+        case NodeKind::Literal:
+            os << indent << "Literal: " << node.literal << "\n";
+            break;
+        case NodeKind::Identifier:
+            os << indent << "Identifier: " << ast.name(node.identifier.name) << "\n";
+            break;
+        case NodeKind::BinaryExpr:
+            os << indent << "BinaryExpr: " << binOpName(node.op) << "\n";
+            printTree(ast, node.binary.left, depth + 1, os);
+            printTree(ast, node.binary.right, depth + 1, os);
+            break;
+        case NodeKind::Assignment:
+            os << indent << "Assignment: " << ast.name(node.assign.name) << "\n";
+            printTree(ast, node.assign.value, depth + 1, os);
+            break;
+        case NodeKind::IfStmt:
+            os << indent << "IfStmt\n";
+            os << indent << "  Condition:\n";
+            printTree(ast, node.ifStmt.cond, depth + 2, os);
+            os << indent << "  Then:\n";
+            printTree(ast, node.ifStmt.thenBranch, depth + 2, os);
+            if (node.ifStmt.elseBranch != NO_NODE) {
+                os << indent << "  Else:\n";
+                printTree(ast, node.ifStmt.elseBranch, depth + 2, os);
+            }
+            break;
+        case NodeKind::WhileStmt:
+            os << indent << "WhileStmt\n";
+            os << indent << "  Condition:\n";
+            printTree(ast, node.whileStmt.cond, depth + 2, os);
+            os << indent << "  Body:\n";
+            printTree(ast, node.whileStmt.body, depth + 2, os);
+            break;
+        case NodeKind::Block:
+            os << indent << "Block\n";
+            for (NodeId stmt : ast.statements(node)) printTree(ast, stmt, depth + 1, os);
+            break;
+        case NodeKind::PrintStmt:
+            os << indent << "PrintStmt\n";
+            printTree(ast, node.print, depth + 1, os);
+            break;
+        default:
+            os << indent << "Unknown node\n";
+            break;
     }
 }
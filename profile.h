@@ -0,0 +1,223 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+#include "parser.h"
+using namespace std;
+
+// Profiler for the interpreter and the stack VM, built only with
+// -DHYBRID_PROFILE. Engines guard every hook with
+// `if constexpr (Profiler::enabled)`, so without the flag no profiling code
+// is compiled in at all.
+//
+// A profile is kept per site: a linked instruction for the VM, an AST node
+// for the interpreter. Each site counts how often it ran and the cycles
+// until the next site started (self time). Loop sites also count
+// iterations. Reports roll the sites up by opcode or node kind, by source
+// line and by loop.
+#if defined(HYBRID_PROFILE)
+#define HYBRID_PROFILE_ENABLED 1
+#else
+#define HYBRID_PROFILE_ENABLED 0
+#endif
+
+#if HYBRID_PROFILE_ENABLED && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+// Time stamp counter; cycles on every x86 made in the last decade
+inline uint64_t readCycles() { return __rdtsc(); }
+#else
+// Nanoseconds stand in for cycles where there is no cheap cycle counter
+inline uint64_t readCycles() {
+    return (uint64_t)chrono::duration_cast<chrono::nanoseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count();
+}
+#endif
+
+inline const char* nodeKindName(NodeKind kind) {
+    switch (kind) {
+        case NodeKind::Literal: return "Literal";
+        case NodeKind::Identifier: return "Identifier";
+        case NodeKind::BinaryExpr: return "BinaryExpr";
+        case NodeKind::Assignment: return "Assignment";
+        case NodeKind::IfStmt: return "IfStmt";
+        case NodeKind::WhileStmt: return "WhileStmt";
+        case NodeKind::Block: return "Block";
+        case NodeKind::PrintStmt: return "PrintStmt";
+    }
+    return "?";
+}
+
+class Profiler {
+public:
+    static constexpr bool enabled = HYBRID_PROFILE_ENABLED != 0;
+
+    // Site table, filled by profileSites() for the engine being profiled
+    void reset(const string& engineName, size_t sites) {
+        engine = engineName;
+        counts.assign(sites, 0);
+        cycles.assign(sites, 0);
+        iterations.assign(sites, 0);
+        names.assign(sites, "?");
+        lines.assign(sites, 0);
+        parent.assign(sites, -1);
+        isLoop.assign(sites, false);
+        loopLines.assign(sites, 0);
+        current = NONE;
+    }
+    // `loop` is the innermost enclosing loop site, or -1
+    void describe(size_t site, const char* name, int line, int loop) {
+        names[site] = name;
+        lines[site] = line;
+        parent[site] = loop;
+    }
+    void markLoop(size_t site, int headLine) {
+        isLoop[site] = true;
+        loopLines[site] = headLine;
+    }
+
+    // Hot path: site `site` starts now; the previous site's self time ends
+    void enter(size_t site) {
+        uint64_t now = readCycles();
+        if (current != NONE) cycles[current] += now - stamp;
+        current = site;
+        stamp = now;
+        ++counts[site];
+    }
+
+    void iteration(size_t loopSite) { ++iterations[loopSite]; }
+
+    // Charge the last site; call when the run ends (normally or not)
+    void finish() {
+        if (current != NONE) cycles[current] += readCycles() - stamp;
+        current = NONE;
+    }
+
+    // Flat report: by opcode (or node kind), by line and by loop
+    void report(ostream& os) const {
+        uint64_t totalCount = 0, totalCycles = 0;
+        for (size_t i = 0; i < counts.size(); ++i) {
+            totalCount += counts[i];
+            totalCycles += cycles[i];
+        }
+        auto percent = [&](uint64_t c) { return totalCycles ? 100.0 * c / totalCycles : 0.0; };
+        os << "\n=== PROFILE (" << engine << ") ===\n";
+        os << "Total: " << totalCount << (engine == "vm" ? " instructions, " : " nodes, ")
+           << totalCycles << " cycles\n";
+
+        map<string, pair<uint64_t, uint64_t>> byName;
+        map<int, pair<uint64_t, uint64_t>> byLine;
+        for (size_t i = 0; i < counts.size(); ++i) {
+            if (!counts[i]) continue;
+            auto& n = byName[names[i]];
+            n.first += counts[i];
+            n.second += cycles[i];
+            auto& l = byLine[lines[i]];
+            l.first += counts[i];
+            l.second += cycles[i];
+        }
+        auto byCycles = [](const auto& table) {
+            vector<pair<typename decay_t<decltype(table)>::key_type, pair<uint64_t, uint64_t>>> rows(
+                table.begin(), table.end());
+            stable_sort(rows.begin(), rows.end(), [](const auto& a, const auto& b) {
+                return a.second.second > b.second.second;
+            });
+            return rows;
+        };
+        os << fixed << setprecision(1);
+        os << (engine == "vm" ? "\nBy opcode:\n" : "\nBy node kind:\n");
+        os << "  " << setw(16) << left << "name" << right << setw(14) << "count" << setw(16) << "cycles"
+           << setw(8) << "%" << "\n";
+        for (const auto& [name, stat] : byCycles(byName)) {
+            os << "  " << setw(16) << left << name << right << setw(14) << stat.first << setw(16)
+               << stat.second << setw(7) << percent(stat.second) << "%\n";
+        }
+        os << "\nHot lines:\n";
+        os << "  " << setw(6) << "line" << setw(14) << "count" << setw(16) << "cycles" << setw(8) << "%" << "\n";
+        for (const auto& [line, stat] : byCycles(byLine)) {
+            os << "  " << setw(6) << line << setw(14) << stat.first << setw(16) << stat.second
+               << setw(7) << percent(stat.second) << "%\n";
+        }
+        os << "\nLoops:\n";
+        bool any = false;
+        for (size_t i = 0; i < iterations.size(); ++i) {
+            if (!isLoop[i]) continue;
+            any = true;
+            os << "  while at line " << loopLines[i] << ": " << iterations[i] << " iteration(s)\n";
+        }
+        if (!any) os << "  (none)\n";
+        os << defaultfloat;
+    }
+
+    // Collapsed stacks ("root;while@L3;L5 ADD <cycles>"), the input format of
+    // flamegraph.pl and speedscope. Loop frames follow the static nesting.
+    void writeCollapsed(ostream& os, const string& root) const {
+        map<string, uint64_t> stacks;
+        for (size_t i = 0; i < counts.size(); ++i) {
+            if (!cycles[i]) continue;
+            string path = "L" + to_string(lines[i]) + " " + names[i];
+            // A loop's own site (its head or backward jump) runs inside the loop
+            if (isLoop[i]) path = "while@L" + to_string(loopLines[i]) + ";" + path;
+            for (int loop = parent[i]; loop >= 0; loop = parent[loop]) {
+                path = "while@L" + to_string(loopLines[loop]) + ";" + path;
+            }
+            stacks[root + ";" + path] += cycles[i];
+        }
+        for (const auto& [stack, weight] : stacks) os << stack << " " << weight << "\n";
+    }
+
+private:
+    static constexpr size_t NONE = SIZE_MAX;
+
+    string engine;
+    vector<uint64_t> counts;
+    vector<uint64_t> cycles;
+    vector<uint64_t> iterations;
+    vector<const char*> names;
+    vector<int> lines;
+    vector<int> parent;      // Innermost enclosing loop site, or -1
+    vector<bool> isLoop;
+    vector<int> loopLines;   // Line of the loop head, for loop sites
+    size_t current = NONE;
+    uint64_t stamp = 0;
+};
+
+// Interpreter sites: every node, with WhileStmts as loops
+inline void profileSites(Profiler& profiler, const AST& ast) {
+    profiler.reset("interp", ast.nodes.size());
+    vector<pair<NodeId, int>> pending;
+    if (ast.root != NO_NODE) pending.push_back({ast.root, -1});
+    while (!pending.empty()) {
+        auto [id, loop] = pending.back();
+        pending.pop_back();
+        const ASTNode& node = ast[id];
+        profiler.describe(id, nodeKindName(node.kind), (int)ast.lineOf(id), loop);
+        int inner = loop;
+        if (node.kind == NodeKind::WhileStmt) {
+            profiler.markLoop(id, (int)ast.lineOf(id));
+            inner = (int)id;
+        }
+        auto visit = [&](NodeId child) {
+            if (child != NO_NODE) pending.push_back({child, inner});
+        };
+        switch (node.kind) {
+            case NodeKind::BinaryExpr: visit(node.binary.left); visit(node.binary.right); break;
+            case NodeKind::Assignment: visit(node.assign.value); break;
+            case NodeKind::IfStmt:
+                visit(node.ifStmt.cond);
+                visit(node.ifStmt.thenBranch);
+                visit(node.ifStmt.elseBranch);
+                break;
+            case NodeKind::WhileStmt: visit(node.whileStmt.cond); visit(node.whileStmt.body); break;
+            case NodeKind::Block:
+                for (NodeId stmt : ast.statements(node)) visit(stmt);
+                break;
+            case NodeKind::PrintStmt: visit(node.print); break;
+            default: break;
+        }
+    }
+}
@@ -0,0 +1,358 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <iostream>
+#include <stdexcept>
+#include "budget.h"
+#include "parser.h"
+#include "trace.h"
+#include "value.h"
+using namespace std;
+
+// Three-address register IR. Registers are laid out as
+// [variables][constants][temporaries]; variables and constants are fixed,
+// temporaries are handed out stack-wise while compiling an expression.
+enum class RegOp : uint8_t {
+    LOADI,  // a = imm
+    MOV,    // a = b
+    ADD,    // a = b + c
+    SUB,    // a = b - c
+    MUL,    // a = b * c
+    DIV,    // a = b / c
+    ADDI,   // a = b + imm
+    SUBI,   // a = b - imm
+    EQ,     // a = b == c
+    NE,     // a = b != c
+    LT,     // a = b < c
+    GT,     // a = b > c
+    LE,     // a = b <= c
+    GE,     // a = b >= c
+    JZ,     // if a == 0 goto imm
+    JMP,    // goto imm
+    PRINT   // print a
+};
+
+struct RegInstr {
+    RegOp op;
+    uint16_t a, b, c;
+    int imm;
+};
+
+struct RegProgram {
+    vector<RegInstr> code;
+    vector<string> varNames; // Registers 0..varNames.size()-1 hold variables
+    int registerCount = 0;
+};
+
+inline const char* regOpName(RegOp op) {
+    switch (op) {
+        case RegOp::LOADI: return "LOADI";
+        case RegOp::MOV: return "MOV";
+        case RegOp::ADD: return "ADD";
+        case RegOp::SUB: return "SUB";
+        case RegOp::MUL: return "MUL";
+        case RegOp::DIV: return "DIV";
+        case RegOp::ADDI: return "ADDI";
+        case RegOp::SUBI: return "SUBI";
+        case RegOp::EQ: return "EQ";
+        case RegOp::NE: return "NE";
+        case RegOp::LT: return "LT";
+        case RegOp::GT: return "GT";
+        case RegOp::LE: return "LE";
+        case RegOp::GE: return "GE";
+        case RegOp::JZ: return "JZ";
+        case RegOp::JMP: return "JMP";
+        case RegOp::PRINT: return "PRINT";
+    }
+    return "?";
+}
+
+inline void printRegInstr(ostream& os, const RegInstr& instr) {
+    os << regOpName(instr.op);
+    switch (instr.op) {
+        case RegOp::LOADI: os << " r" << instr.a << ", " << instr.imm; break;
+        case RegOp::MOV: os << " r" << instr.a << ", r" << instr.b; break;
+        case RegOp::ADDI:
+        case RegOp::SUBI: os << " r" << instr.a << ", r" << instr.b << ", " << instr.imm; break;
+        case RegOp::JZ: os << " r" << instr.a << ", " << instr.imm; break;
+        case RegOp::JMP: os << " " << instr.imm; break;
+        case RegOp::PRINT: os << " r" << instr.a; break;
+        default: os << " r" << instr.a << ", r" << instr.b << ", r" << instr.c; break;
+    }
+}
+
+inline void printRegIR(const RegProgram& prog, ostream& os = cout) {
+    os << "; " << prog.registerCount << " registers";
+    for (size_t i = 0; i < prog.varNames.size(); ++i) os << ", r" << i << "=" << prog.varNames[i];
+    os << "\n";
+    for (size_t i = 0; i < prog.code.size(); ++i) {
+        os << i << ": ";
+        printRegInstr(os, prog.code[i]);
+        os << "\n";
+    }
+}
+
+// Compiles an AST to register IR, allocating virtual registers for
+// variables, literal constants and expression temporaries
+class RegCompiler {
+public:
+    explicit RegCompiler(const AST& ast) : ast(ast) {}
+
+    RegProgram compile() {
+        RegProgram prog;
+        // Every interned symbol is a variable and keeps its symbol id as register
+        varCount = (int)ast.symbols.size();
+        prog.varNames.assign(ast.symbols.begin(), ast.symbols.end());
+        collectConstants(ast.root);
+        for (size_t i = 0; i < constantValues.size(); ++i) {
+            prog.code.push_back({RegOp::LOADI, (uint16_t)(varCount + i), 0, 0, constantValues[i]});
+        }
+        tempBase = tempTop = varCount + (int)constants.size();
+        maxRegister = tempBase;
+        code = &prog.code;
+        compileStmt(ast.root);
+        prog.registerCount = maxRegister;
+        if (prog.registerCount > UINT16_MAX) throw runtime_error("Too many registers");
+        return prog;
+    }
+
+private:
+    const AST& ast;
+    vector<RegInstr>* code = nullptr;
+    unordered_map<int, int> constants; // Literal value -> register
+    vector<int> constantValues;        // In register order
+    int varCount = 0;
+    int tempBase = 0;
+    int tempTop = 0;
+    int maxRegister = 0;
+
+    void collectConstants(NodeId id) {
+        if (id == NO_NODE) return;
+        const ASTNode& node = ast[id];
+        switch (node.kind) {
+            case NodeKind::Literal:
+                if (!constants.count(node.literal)) {
+                    int reg = varCount + (int)constants.size();
+                    constants.emplace(node.literal, reg);
+                    constantValues.push_back(node.literal);
+                }
+                break;
+            case NodeKind::Identifier: break;
+            case NodeKind::BinaryExpr:
+                collectConstants(node.binary.left);
+                collectConstants(node.binary.right);
+                break;
+            case NodeKind::Assignment: collectConstants(node.assign.value); break;
+            case NodeKind::IfStmt:
+                collectConstants(node.ifStmt.cond);
+                collectConstants(node.ifStmt.thenBranch);
+                collectConstants(node.ifStmt.elseBranch);
+                break;
+            case NodeKind::WhileStmt:
+                collectConstants(node.whileStmt.cond);
+                collectConstants(node.whileStmt.body);
+                break;
+            case NodeKind::Block:
+                for (NodeId stmt : ast.statements(node)) collectConstants(stmt);
+                break;
+            case NodeKind::PrintStmt: collectConstants(node.print); break;
+        }
+    }
+
+    int allocTemp() {
+        int reg = tempTop++;
+        if (tempTop > maxRegister) maxRegister = tempTop;
+        return reg;
+    }
+
+    void release(int reg) {
+        if (reg >= tempBase) tempTop = reg;
+    }
+
+    void emit(RegOp op, int a, int b = 0, int c = 0, int imm = 0) {
+        code->push_back({op, (uint16_t)a, (uint16_t)b, (uint16_t)c, imm});
+    }
+
+    static RegOp binOpReg(BinOp op) {
+        switch (op) {
+            case BinOp::Add: return RegOp::ADD;
+            case BinOp::Sub: return RegOp::SUB;
+            case BinOp::Mul: return RegOp::MUL;
+            case BinOp::Div: return RegOp::DIV;
+            case BinOp::Eq: return RegOp::EQ;
+            case BinOp::Ne: return RegOp::NE;
+            case BinOp::Lt: return RegOp::LT;
+            case BinOp::Gt: return RegOp::GT;
+            case BinOp::Le: return RegOp::LE;
+            case BinOp::Ge: return RegOp::GE;
+        }
+        return RegOp::ADD;
+    }
+
+    // Evaluate an expression and return the register holding it. With a
+    // target (>= 0) the value is guaranteed to end up in that register.
+    int compileExpr(NodeId id, int target = -1) {
+        const ASTNode& node = ast[id];
+        switch (node.kind) {
+            case NodeKind::Literal: {
+                if (target < 0) return constants.at(node.literal);
+                emit(RegOp::LOADI, target, 0, 0, node.literal);
+                return target;
+            }
+            case NodeKind::Identifier: {
+                int reg = (int)node.identifier.name;
+                if (target < 0 || target == reg) return reg;
+                emit(RegOp::MOV, target, reg);
+                return target;
+            }
+            case NodeKind::BinaryExpr: {
+                const ASTNode& right = ast[node.binary.right];
+                if ((node.op == BinOp::Add || node.op == BinOp::Sub) && right.kind == NodeKind::Literal) {
+                    int l = compileExpr(node.binary.left);
+                    release(l);
+                    int dst = target >= 0 ? target : allocTemp();
+                    emit(node.op == BinOp::Add ? RegOp::ADDI : RegOp::SUBI, dst, l, 0, right.literal);
+                    return dst;
+                }
+                int l = compileExpr(node.binary.left);
+                int r = compileExpr(node.binary.right);
+                release(r);
+                release(l);
+                int dst = target >= 0 ? target : allocTemp();
+                emit(binOpReg(node.op), dst, l, r);
+                return dst;
+            }
+            default:
+                throw runtime_error("Statement used as expression");
+        }
+    }
+
+    void patch(size_t at, size_t target) {
+        (*code)[at].imm = (int)target;
+    }
+
+    void compileStmt(NodeId id) {
+        if (id == NO_NODE) return;
+        const ASTNode& node = ast[id];
+        switch (node.kind) {
+            case NodeKind::Block:
+                for (NodeId stmt : ast.statements(node)) compileStmt(stmt);
+                break;
+            case NodeKind::Assignment:
+                compileExpr(node.assign.value, (int)node.assign.name);
+                break;
+            case NodeKind::PrintStmt: {
+                int reg = compileExpr(node.print);
+                release(reg);
+                emit(RegOp::PRINT, reg);
+                break;
+            }
+            case NodeKind::IfStmt: {
+                int cond = compileExpr(node.ifStmt.cond);
+                release(cond);
+                size_t jz = code->size();
+                emit(RegOp::JZ, cond);
+                compileStmt(node.ifStmt.thenBranch);
+                if (node.ifStmt.elseBranch != NO_NODE) {
+                    size_t jmp = code->size();
+                    emit(RegOp::JMP, 0);
+                    patch(jz, code->size());
+                    compileStmt(node.ifStmt.elseBranch);
+                    patch(jmp, code->size());
+                } else {
+                    patch(jz, code->size());
+                }
+                break;
+            }
+            case NodeKind::WhileStmt: {
+                size_t start = code->size();
+                int cond = compileExpr(node.whileStmt.cond);
+                release(cond);
+                size_t jz = code->size();
+                emit(RegOp::JZ, cond);
+                compileStmt(node.whileStmt.body);
+                emit(RegOp::JMP, 0, 0, 0, (int)start);
+                patch(jz, code->size());
+                break;
+            }
+            default: {
+                // Expression statement: evaluated for its (absent) side effects
+                int reg = compileExpr(id);
+                release(reg);
+                break;
+            }
+        }
+    }
+};
+
+inline RegProgram compileToRegisters(const AST& ast) {
+    return RegCompiler(ast).compile();
+}
+
+// Register VM; Trace selects the tracing policy. Steps and timeout are
+// charged at backward jumps, one step per instruction of the loop; there is
+// no operand stack, so `limits.maxStackDepth` does not apply.
+class RegVM {
+public:
+    template <typename Trace = QuietTrace>
+    void run(const RegProgram& prog, OutputWriter& out, const ExecutionLimits& limits = ExecutionLimits());
+};
+
+template <typename Trace>
+inline void RegVM::run(const RegProgram& prog, OutputWriter& out, const ExecutionLimits& limits) {
+    Budget budget(limits);
+    const RegInstr* code = prog.code.data();
+    const size_t size = prog.code.size();
+    vector<int> regs(prog.registerCount, 0);
+    int* r = regs.data();
+    for (size_t ip = 0; ip < size; ) {
+        const RegInstr& instr = code[ip++];
+        if constexpr (Trace::enabled) {
+            cout << "[RegVM] Executing: ";
+            printRegInstr(cout, instr);
+            cout << "\n";
+        }
+        switch (instr.op) {
+            case RegOp::LOADI: r[instr.a] = instr.imm; break;
+            case RegOp::MOV: r[instr.a] = r[instr.b]; break;
+            // Wrapping arithmetic, computed unsigned as in value.h
+            case RegOp::ADD: r[instr.a] = (int)((unsigned)r[instr.b] + (unsigned)r[instr.c]); break;
+            case RegOp::SUB: r[instr.a] = (int)((unsigned)r[instr.b] - (unsigned)r[instr.c]); break;
+            case RegOp::MUL: r[instr.a] = (int)((unsigned)r[instr.b] * (unsigned)r[instr.c]); break;
+            case RegOp::DIV: r[instr.a] = divideInt(r[instr.b], r[instr.c]); break;
+            case RegOp::ADDI: r[instr.a] = (int)((unsigned)r[instr.b] + (unsigned)instr.imm); break;
+            case RegOp::SUBI: r[instr.a] = (int)((unsigned)r[instr.b] - (unsigned)instr.imm); break;
+            case RegOp::EQ: r[instr.a] = r[instr.b] == r[instr.c]; break;
+            case RegOp::NE: r[instr.a] = r[instr.b] != r[instr.c]; break;
+            case RegOp::LT: r[instr.a] = r[instr.b] < r[instr.c]; break;
+            case RegOp::GT: r[instr.a] = r[instr.b] > r[instr.c]; break;
+            case RegOp::LE: r[instr.a] = r[instr.b] <= r[instr.c]; break;
+            case RegOp::GE: r[instr.a] = r[instr.b] >= r[instr.c]; break;
+            case RegOp::JZ:
+                if (r[instr.a] != 0) break;
+                if ((size_t)instr.imm < ip) budget.charge((int64_t)(ip - instr.imm));
+                ip = instr.imm;
+                break;
+            case RegOp::JMP:
+                if ((size_t)instr.imm < ip) budget.charge((int64_t)(ip - instr.imm));
+                ip = instr.imm;
+                break;
+            case RegOp::PRINT:
+                out.print(r[instr.a]);
+                if constexpr (Trace::enabled) out.flush();
+                break;
+        }
+        if constexpr (Trace::enabled) {
+            cout << "[RegVM] Vars: ";
+            for (size_t i = 0; i < prog.varNames.size(); ++i) cout << prog.varNames[i] << "=" << r[i] << " ";
+            cout << "\n";
+        }
+    }
+    if constexpr (Trace::enabled) {
+        cout << "\n=== RegVM Variable State ===\n";
+        for (size_t i = 0; i < prog.varNames.size(); ++i) {
+            cout << prog.varNames[i] << " = " << r[i] << "\n";
+        }
+    }
+}
@@ -0,0 +1,108 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <utility>
+#if defined(__unix__) || defined(__APPLE__)
+#define HYBRID_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#define HYBRID_MMAP 0
+#include <fstream>
+#include <iterator>
+#endif
+using namespace std;
+
+// A script file loaded for the front end. On POSIX systems a regular file
+// is mapped read-only, so loading copies nothing: tokens, symbol names and
+// diagnostics all point into the mapping. Pipes, other special files and
+// non-POSIX builds are read into one buffer instead.
+//
+// The text stays valid while the SourceFile lives; every token and AST
+// built from it must be dropped first. A file truncated by another process
+// while mapped faults on access, so callers that outlive edits (--watch)
+// copy what they keep.
+class SourceFile {
+public:
+    SourceFile() = default;
+    SourceFile(const SourceFile&) = delete;
+    SourceFile& operator=(const SourceFile&) = delete;
+    SourceFile(SourceFile&& other) noexcept { swap(other); }
+    SourceFile& operator=(SourceFile&& other) noexcept {
+        SourceFile moved(std::move(other));
+        swap(moved);
+        return *this;
+    }
+    ~SourceFile() { close(); }
+
+    // False if the file cannot be opened or read
+    bool open(const string& path) {
+        close();
+#if HYBRID_MMAP
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        bool ok = fstat(fd, &st) == 0;
+        if (ok && S_ISREG(st.st_mode)) {
+            size = (size_t)st.st_size;
+            if (size > 0) {
+                void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+                ok = mapping != MAP_FAILED;
+                if (ok) {
+                    // The lexer reads front to back
+                    madvise(mapping, size, MADV_SEQUENTIAL);
+                    data = static_cast<const char*>(mapping);
+                    mapped = true;
+                }
+            }
+        } else if (ok) {
+            char block[1 << 16];
+            ssize_t n;
+            while ((n = read(fd, block, sizeof block)) > 0) buffer.append(block, (size_t)n);
+            ok = n == 0;
+            data = buffer.data();
+            size = buffer.size();
+        }
+        ::close(fd);
+        if (!ok) close();
+        return ok;
+#else
+        ifstream in(path, ios::binary);
+        if (!in) return false;
+        buffer.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+        data = buffer.data();
+        size = buffer.size();
+        return true;
+#endif
+    }
+
+    string_view text() const { return string_view(data, size); }
+
+private:
+    const char* data = nullptr;
+    size_t size = 0;
+    bool mapped = false;
+    string buffer; // Contents when not mapped
+
+    void close() {
+#if HYBRID_MMAP
+        if (mapped) munmap(const_cast<char*>(data), size);
+#endif
+        data = nullptr;
+        size = 0;
+        mapped = false;
+        buffer.clear();
+    }
+
+    void swap(SourceFile& other) noexcept {
+        std::swap(data, other.data);
+        std::swap(size, other.size);
+        std::swap(mapped, other.mapped);
+        std::swap(buffer, other.buffer);
+        // A moved buffer keeps its characters only if it was heap-allocated
+        if (!mapped) data = buffer.data();
+        if (!other.mapped) other.data = other.buffer.data();
+    }
+};
@@ -0,0 +1,1083 @@
+#pragma once
+#include <algorithm>
+#include <climits>
+#include <iostream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+#include "parser.h"
+#include "regir.h"
+using namespace std;
+
+// SSA mid-level IR: a control-flow graph of basic blocks whose values are
+// defined exactly once, with phi nodes at join points. Built from the AST,
+// optimized with SCCP, GVN, LICM and dead value elimination, then lowered
+// to the register VM.
+
+enum class SSAOp : uint8_t {
+    Const,  // imm
+    Phi,    // one argument per predecessor, in `preds` order
+    Add, Sub, Mul, Div,
+    Eq, Ne, Lt, Gt, Le, Ge,
+    Print,  // print a
+    Nop     // Removed; uses have been redirected through SSAFunction::forward
+};
+
+using ValueId = int;
+constexpr ValueId NO_VALUE = -1;
+
+struct SSAInstr {
+    SSAOp op;
+    int block;                // Owning block
+    ValueId a = NO_VALUE;     // Operands of binary ops / Print
+    ValueId b = NO_VALUE;
+    int imm = 0;              // Const
+    vector<ValueId> args;     // Phi
+};
+
+enum class Terminator : uint8_t {
+    Jump,   // goto succ[0]
+    Branch, // goto cond != 0 ? succ[0] : succ[1]
+    Exit
+};
+
+struct BasicBlock {
+    vector<ValueId> code; // Phis first
+    vector<int> preds;
+    Terminator term = Terminator::Exit;
+    ValueId cond = NO_VALUE;
+    int succ[2] = {-1, -1};
+    bool dead = false;    // Unreachable, removed by SCCP
+};
+
+// A `while` loop: the preheader is the only block entering the header from
+// outside the loop
+struct SSALoop {
+    int preheader;
+    int header;
+};
+
+struct SSAFunction {
+    vector<SSAInstr> values;
+    vector<BasicBlock> blocks;
+    vector<SSALoop> loops;   // Innermost first
+    vector<ValueId> forward; // Replaced value -> replacement, or NO_VALUE
+
+    ValueId add(SSAOp op, int block, ValueId a = NO_VALUE, ValueId b = NO_VALUE, int imm = 0) {
+        values.push_back({op, block, a, b, imm, {}});
+        forward.push_back(NO_VALUE);
+        return (ValueId)values.size() - 1;
+    }
+
+    ValueId resolve(ValueId v) const {
+        while (v != NO_VALUE && forward[v] != NO_VALUE) v = forward[v];
+        return v;
+    }
+
+    void replace(ValueId v, ValueId with) {
+        forward[v] = with;
+        values[v].op = SSAOp::Nop;
+    }
+
+    // Constant placed at the top of the entry block, which dominates everything
+    ValueId constant(int value) {
+        ValueId v = add(SSAOp::Const, 0, NO_VALUE, NO_VALUE, value);
+        blocks[0].code.insert(blocks[0].code.begin(), v);
+        return v;
+    }
+
+    int succCount(int b) const {
+        switch (blocks[b].term) {
+            case Terminator::Jump: return 1;
+            case Terminator::Branch: return 2;
+            case Terminator::Exit: return 0;
+        }
+        return 0;
+    }
+
+    // Drop the index-th incoming edge of a block together with its phi arguments
+    void removePred(int b, size_t index) {
+        BasicBlock& block = blocks[b];
+        block.preds.erase(block.preds.begin() + index);
+        for (ValueId v : block.code) {
+            if (values[v].op == SSAOp::Phi) values[v].args.erase(values[v].args.begin() + index);
+        }
+    }
+
+    // Rewrite operands through `forward` and drop removed values from blocks
+    void applyReplacements() {
+        for (auto& instr : values) {
+            if (instr.op == SSAOp::Nop) continue;
+            instr.a = resolve(instr.a);
+            instr.b = resolve(instr.b);
+            for (ValueId& arg : instr.args) arg = resolve(arg);
+        }
+        for (auto& block : blocks) {
+            block.cond = resolve(block.cond);
+            block.code.erase(remove_if(block.code.begin(), block.code.end(),
+                                       [&](ValueId v) { return values[v].op == SSAOp::Nop; }),
+                             block.code.end());
+        }
+    }
+
+    // Replace phis whose arguments are all the same value (or the phi
+    // itself) by that value, until none are left. Returns true on change.
+    bool removeTrivialPhis() {
+        bool changed = false;
+        for (bool again = true; again; ) {
+            again = false;
+            for (ValueId v = 0; v < (ValueId)values.size(); ++v) {
+                if (values[v].op != SSAOp::Phi) continue;
+                ValueId same = NO_VALUE;
+                bool trivial = true;
+                for (ValueId arg : values[v].args) {
+                    arg = resolve(arg);
+                    if (arg == v || arg == same) continue;
+                    if (same != NO_VALUE) {
+                        trivial = false;
+                        break;
+                    }
+                    same = arg;
+                }
+                if (!trivial) continue;
+                // Only reachable through itself: the variable was never assigned
+                if (same == NO_VALUE) same = constant(0);
+                replace(v, same);
+                again = changed = true;
+            }
+        }
+        return changed;
+    }
+};
+
+inline const char* ssaOpName(SSAOp op) {
+    switch (op) {
+        case SSAOp::Const: return "const";
+        case SSAOp::Phi: return "phi";
+        case SSAOp::Add: return "add";
+        case SSAOp::Sub: return "sub";
+        case SSAOp::Mul: return "mul";
+        case SSAOp::Div: return "div";
+        case SSAOp::Eq: return "eq";
+        case SSAOp::Ne: return "ne";
+        case SSAOp::Lt: return "lt";
+        case SSAOp::Gt: return "gt";
+        case SSAOp::Le: return "le";
+        case SSAOp::Ge: return "ge";
+        case SSAOp::Print: return "print";
+        case SSAOp::Nop: return "nop";
+    }
+    return "?";
+}
+
+inline void printSSA(const SSAFunction& fn, ostream& os = cout) {
+    for (size_t b = 0; b < fn.blocks.size(); ++b) {
+        const BasicBlock& block = fn.blocks[b];
+        if (block.dead) continue;
+        os << "B" << b << ":";
+        if (!block.preds.empty()) {
+            os << " ; preds";
+            for (int p : block.preds) os << " B" << p;
+        }
+        os << "\n";
+        for (ValueId v : block.code) {
+            const SSAInstr& instr = fn.values[v];
+            os << "  ";
+            if (instr.op != SSAOp::Print) os << "v" << v << " = ";
+            os << ssaOpName(instr.op);
+            if (instr.op == SSAOp::Const) {
+                os << " " << instr.imm;
+            } else if (instr.op == SSAOp::Phi) {
+                for (size_t i = 0; i < instr.args.size(); ++i) {
+                    os << (i ? ", " : " ") << "[v" << instr.args[i] << ", B" << block.preds[i] << "]";
+                }
+            } else {
+                if (instr.a != NO_VALUE) os << " v" << instr.a;
+                if (instr.b != NO_VALUE) os << ", v" << instr.b;
+            }
+            os << "\n";
+        }
+        switch (block.term) {
+            case Terminator::Jump: os << "  jump B" << block.succ[0] << "\n"; break;
+            case Terminator::Branch:
+                os << "  branch v" << block.cond << " ? B" << block.succ[0] << " : B" << block.succ[1] << "\n";
+                break;
+            case Terminator::Exit: os << "  exit\n"; break;
+        }
+    }
+}
+
+// Builds SSA directly from the AST (Braun et al., "Simple and Efficient
+// Construction of Static Single Assignment Form"). Variables are looked up
+// per block; a block is sealed once all its predecessors are known, and
+// reads in unsealed blocks create phis that are completed on sealing.
+class SSABuilder {
+public:
+    explicit SSABuilder(const AST& ast) : ast(ast) {}
+
+    SSAFunction build() {
+        current = newBlock();
+        seal(current);
+        buildStmt(ast.root);
+        fn.blocks[current].term = Terminator::Exit;
+        fn.removeTrivialPhis();
+        fn.applyReplacements();
+        return std::move(fn);
+    }
+
+private:
+    const AST& ast;
+    SSAFunction fn;
+    int current = 0;
+    vector<unordered_map<SymbolId, ValueId>> currentDef; // Per block
+    vector<bool> sealed;
+    vector<vector<pair<SymbolId, ValueId>>> incompletePhis; // Per block
+    unordered_map<int, ValueId> constants;
+
+    int newBlock() {
+        fn.blocks.emplace_back();
+        currentDef.emplace_back();
+        sealed.push_back(false);
+        incompletePhis.emplace_back();
+        return (int)fn.blocks.size() - 1;
+    }
+
+    void jump(int from, int to) {
+        fn.blocks[from].term = Terminator::Jump;
+        fn.blocks[from].succ[0] = to;
+        fn.blocks[to].preds.push_back(from);
+    }
+
+    void branch(int from, ValueId cond, int ifTrue, int ifFalse) {
+        BasicBlock& block = fn.blocks[from];
+        block.term = Terminator::Branch;
+        block.cond = cond;
+        block.succ[0] = ifTrue;
+        block.succ[1] = ifFalse;
+        fn.blocks[ifTrue].preds.push_back(from);
+        fn.blocks[ifFalse].preds.push_back(from);
+    }
+
+    ValueId emit(SSAOp op, ValueId a = NO_VALUE, ValueId b = NO_VALUE) {
+        ValueId v = fn.add(op, current, a, b);
+        fn.blocks[current].code.push_back(v);
+        return v;
+    }
+
+    ValueId constant(int value) {
+        auto it = constants.find(value);
+        if (it != constants.end()) return it->second;
+        ValueId v = fn.constant(value);
+        constants.emplace(value, v);
+        return v;
+    }
+
+    ValueId newPhi(int block) {
+        ValueId v = fn.add(SSAOp::Phi, block);
+        auto& code = fn.blocks[block].code;
+        auto pos = find_if(code.begin(), code.end(), [&](ValueId c) { return fn.values[c].op != SSAOp::Phi; });
+        code.insert(pos, v);
+        return v;
+    }
+
+    void writeVariable(SymbolId var, int block, ValueId v) {
+        currentDef[block][var] = v;
+    }
+
+    ValueId readVariable(SymbolId var, int block) {
+        auto it = currentDef[block].find(var);
+        if (it != currentDef[block].end()) return fn.resolve(it->second);
+        ValueId v;
+        const auto& preds = fn.blocks[block].preds;
+        if (!sealed[block]) {
+            v = newPhi(block);
+            incompletePhis[block].push_back({var, v});
+        } else if (preds.empty()) {
+            v = constant(0); // Read before any assignment; the VMs see 0
+        } else if (preds.size() == 1) {
+            v = readVariable(var, preds[0]);
+        } else {
+            v = newPhi(block);
+            writeVariable(var, block, v); // Breaks cycles through loops
+            v = addPhiOperands(var, v);
+        }
+        writeVariable(var, block, v);
+        return v;
+    }
+
+    ValueId addPhiOperands(SymbolId var, ValueId phi) {
+        int block = fn.values[phi].block;
+        for (int pred : fn.blocks[block].preds) {
+            ValueId arg = readVariable(var, pred);
+            fn.values[phi].args.push_back(arg);
+        }
+        return tryRemoveTrivialPhi(phi);
+    }
+
+    ValueId tryRemoveTrivialPhi(ValueId phi) {
+        ValueId same = NO_VALUE;
+        for (ValueId arg : fn.values[phi].args) {
+            arg = fn.resolve(arg);
+            if (arg == same || arg == phi) continue;
+            if (same != NO_VALUE) return phi;
+            same = arg;
+        }
+        if (same == NO_VALUE) same = constant(0);
+        fn.replace(phi, same);
+        return same;
+    }
+
+    void seal(int block) {
+        for (auto [var, phi] : incompletePhis[block]) addPhiOperands(var, phi);
+        incompletePhis[block].clear();
+        sealed[block] = true;
+    }
+
+    static SSAOp binOpSSA(BinOp op) {
+        switch (op) {
+            case BinOp::Add: return SSAOp::Add;
+            case BinOp::Sub: return SSAOp::Sub;
+            case BinOp::Mul: return SSAOp::Mul;
+            case BinOp::Div: return SSAOp::Div;
+            case BinOp::Eq: return SSAOp::Eq;
+            case BinOp::Ne: return SSAOp::Ne;
+            case BinOp::Lt: return SSAOp::Lt;
+            case BinOp::Gt: return SSAOp::Gt;
+            case BinOp::Le: return SSAOp::Le;
+            case BinOp::Ge: return SSAOp::Ge;
+        }
+        return SSAOp::Add;
+    }
+
+    ValueId buildExpr(NodeId id) {
+        const ASTNode& node = ast[id];
+        switch (node.kind) {
+            case NodeKind::Literal: return constant(node.literal);
+            case NodeKind::Identifier: return readVariable(node.identifier.name, current);
+            case NodeKind::BinaryExpr: {
+                ValueId l = buildExpr(node.binary.left);
+                ValueId r = buildExpr(node.binary.right);
+                return emit(binOpSSA(node.op), l, r);
+            }
+            default:
+                throw runtime_error("Statement used as expression");
+        }
+    }
+
+    void buildStmt(NodeId id) {
+        if (id == NO_NODE) return;
+        const ASTNode& node = ast[id];
+        switch (node.kind) {
+            case NodeKind::Block:
+                for (NodeId stmt : ast.statements(node)) buildStmt(stmt);
+                break;
+            case NodeKind::Assignment:
+                writeVariable(node.assign.name, current, buildExpr(node.assign.value));
+                break;
+            case NodeKind::PrintStmt:
+                emit(SSAOp::Print, buildExpr(node.print));
+                break;
+            case NodeKind::IfStmt: {
+                ValueId cond = buildExpr(node.ifStmt.cond);
+                int thenB = newBlock();
+                int elseB = node.ifStmt.elseBranch != NO_NODE ? newBlock() : -1;
+                int join = newBlock();
+                branch(current, cond, thenB, elseB >= 0 ? elseB : join);
+                seal(thenB);
+                current = thenB;
+                buildStmt(node.ifStmt.thenBranch);
+                jump(current, join);
+                if (elseB >= 0) {
+                    seal(elseB);
+                    current = elseB;
+                    buildStmt(node.ifStmt.elseBranch);
+                    jump(current, join);
+                }
+                seal(join);
+                current = join;
+                break;
+            }
+            case NodeKind::WhileStmt: {
+                // The block before the loop becomes its preheader
+                int preheader = current;
+                int header = newBlock();
+                jump(preheader, header);
+                current = header;
+                ValueId cond = buildExpr(node.whileStmt.cond);
+                int body = newBlock();
+                int exit = newBlock();
+                branch(header, cond, body, exit);
+                seal(body);
+                current = body;
+                buildStmt(node.whileStmt.body);
+                jump(current, header);
+                seal(header);
+                seal(exit);
+                current = exit;
+                fn.loops.push_back({preheader, header});
+                break;
+            }
+            default:
+                buildExpr(id); // Expression statement
+                break;
+        }
+    }
+};
+
+inline SSAFunction buildSSA(const AST& ast) {
+    return SSABuilder(ast).build();
+}
+
+struct SSAStats {
+    int constants = 0;         // SCCP: values proven constant
+    int branchesFolded = 0;    // SCCP: branches with a constant condition
+    int unreachableBlocks = 0; // SCCP: blocks never executed
+    int redundant = 0;         // GVN: values equal to a dominating one
+    int hoisted = 0;           // LICM: values moved to a loop preheader
+    int deadValues = 0;        // DCE: values whose result is never used
+};
+
+inline void printSSAStats(const SSAStats& stats, ostream& os = cout) {
+    os << "[SSA] SCCP: " << stats.constants << " constant(s), " << stats.branchesFolded
+         << " branch(es) folded, " << stats.unreachableBlocks << " unreachable block(s)\n";
+    os << "[SSA] GVN: " << stats.redundant << " redundant value(s); LICM: " << stats.hoisted
+         << " hoisted; DCE: " << stats.deadValues << " removed\n";
+}
+
+// Constant result of a binary op; false when it would trap at run time
+inline bool foldSSA(SSAOp op, int l, int r, int& result) {
+    unsigned a = (unsigned)l, b = (unsigned)r;
+    switch (op) {
+        case SSAOp::Add: result = (int)(a + b); return true;
+        case SSAOp::Sub: result = (int)(a - b); return true;
+        case SSAOp::Mul: result = (int)(a * b); return true;
+        case SSAOp::Div:
+            if (r == 0 || (l == INT_MIN && r == -1)) return false;
+            result = l / r;
+            return true;
+        case SSAOp::Eq: result = l == r; return true;
+        case SSAOp::Ne: result = l != r; return true;
+        case SSAOp::Lt: result = l < r; return true;
+        case SSAOp::Gt: result = l > r; return true;
+        case SSAOp::Le: result = l <= r; return true;
+        case SSAOp::Ge: result = l >= r; return true;
+        default: return false;
+    }
+}
+
+inline bool isBinarySSA(SSAOp op) {
+    return op >= SSAOp::Add && op <= SSAOp::Ge;
+}
+
+// Binary op that can never trap, so it may be removed or executed speculatively
+inline bool isSafeSSA(const SSAFunction& fn, const SSAInstr& instr) {
+    if (instr.op != SSAOp::Div) return instr.op != SSAOp::Print;
+    const SSAInstr& divisor = fn.values[instr.b];
+    return divisor.op == SSAOp::Const && divisor.imm != 0 && divisor.imm != -1;
+}
+
+// Sparse conditional constant propagation (Wegman & Zadeck). Values start
+// at Top and only move down to Const and then Bottom; blocks are visited
+// only once an edge into them is known to execute.
+inline void runSCCP(SSAFunction& fn, SSAStats& stats) {
+    enum : uint8_t { TOP, CONST, BOTTOM };
+    const size_t n = fn.values.size();
+    vector<uint8_t> state(n, TOP);
+    vector<int> cval(n, 0);
+    vector<bool> reached(fn.blocks.size(), false);
+    vector<vector<bool>> edgeExec(fn.blocks.size());
+    for (size_t b = 0; b < fn.blocks.size(); ++b) edgeExec[b].assign(fn.blocks[b].preds.size(), false);
+
+    vector<vector<ValueId>> users(n);
+    vector<vector<int>> condUsers(n);
+    for (ValueId v = 0; v < (ValueId)n; ++v) {
+        const SSAInstr& instr = fn.values[v];
+        if (instr.op == SSAOp::Nop) continue;
+        if (instr.a != NO_VALUE) users[instr.a].push_back(v);
+        if (instr.b != NO_VALUE) users[instr.b].push_back(v);
+        for (ValueId arg : instr.args) users[arg].push_back(v);
+    }
+    for (size_t b = 0; b < fn.blocks.size(); ++b) {
+        if (fn.blocks[b].term == Terminator::Branch) condUsers[fn.blocks[b].cond].push_back((int)b);
+    }
+
+    vector<pair<int, int>> flowWork{{-1, 0}};
+    vector<ValueId> ssaWork;
+
+    // Move v down the lattice (TOP < CONST < BOTTOM); never back up
+    auto lower = [&](ValueId v, uint8_t newState, int c) {
+        if (newState == CONST && state[v] == CONST && cval[v] != c) newState = BOTTOM;
+        if (newState <= state[v]) return;
+        state[v] = newState;
+        cval[v] = c;
+        ssaWork.push_back(v);
+    };
+
+    auto evaluate = [&](ValueId v) {
+        const SSAInstr& instr = fn.values[v];
+        if (instr.op == SSAOp::Const) {
+            lower(v, CONST, instr.imm);
+        } else if (instr.op == SSAOp::Phi) {
+            uint8_t result = TOP;
+            int c = 0;
+            for (size_t i = 0; i < instr.args.size(); ++i) {
+                if (!edgeExec[instr.block][i]) continue;
+                ValueId arg = instr.args[i];
+                if (state[arg] == TOP) continue;
+                if (state[arg] == BOTTOM || (result == CONST && c != cval[arg])) {
+                    result = BOTTOM;
+                    break;
+                }
+                result = CONST;
+                c = cval[arg];
+            }
+            if (result != TOP) lower(v, result, c);
+        } else if (isBinarySSA(instr.op)) {
+            uint8_t l = state[instr.a], r = state[instr.b];
+            if (l == BOTTOM || r == BOTTOM) {
+                lower(v, BOTTOM, 0);
+            } else if (l == CONST && r == CONST) {
+                int result;
+                if (foldSSA(instr.op, cval[instr.a], cval[instr.b], result)) lower(v, CONST, result);
+                else lower(v, BOTTOM, 0);
+            }
+        }
+    };
+
+    auto visitTerminator = [&](int b) {
+        const BasicBlock& block = fn.blocks[b];
+        if (block.term == Terminator::Jump) {
+            flowWork.push_back({b, block.succ[0]});
+        } else if (block.term == Terminator::Branch) {
+            uint8_t s = state[block.cond];
+            if (s == CONST) {
+                flowWork.push_back({b, cval[block.cond] ? block.succ[0] : block.succ[1]});
+            } else if (s == BOTTOM) {
+                flowWork.push_back({b, block.succ[0]});
+                flowWork.push_back({b, block.succ[1]});
+            }
+        }
+    };
+
+    while (!flowWork.empty() || !ssaWork.empty()) {
+        while (!flowWork.empty()) {
+            auto [from, to] = flowWork.back();
+            flowWork.pop_back();
+            if (from >= 0) {
+                bool newEdge = false;
+                const auto& preds = fn.blocks[to].preds;
+                for (size_t i = 0; i < preds.size(); ++i) {
+                    if (preds[i] == from && !edgeExec[to][i]) {
+                        edgeExec[to][i] = true;
+                        newEdge = true;
+                    }
+                }
+                if (!newEdge) continue;
+            }
+            if (!reached[to]) {
+                reached[to] = true;
+                for (ValueId v : fn.blocks[to].code) evaluate(v);
+                visitTerminator(to);
+            } else {
+                for (ValueId v : fn.blocks[to].code) {
+                    if (fn.values[v].op == SSAOp::Phi) evaluate(v);
+                }
+            }
+        }
+        while (!ssaWork.empty()) {
+            ValueId v = ssaWork.back();
+            ssaWork.pop_back();
+            for (ValueId u : users[v]) {
+                if (reached[fn.values[u].block]) evaluate(u);
+            }
+            for (int b : condUsers[v]) {
+                if (reached[b]) visitTerminator(b);
+            }
+        }
+    }
+
+    // Rewrite: constant values, constant branches, unreachable blocks
+    for (ValueId v = 0; v < (ValueId)n; ++v) {
+        SSAInstr& instr = fn.values[v];
+        if (instr.op == SSAOp::Const || instr.op == SSAOp::Print || instr.op == SSAOp::Nop) continue;
+        if (state[v] != CONST || !reached[instr.block]) continue;
+        instr.op = SSAOp::Const;
+        instr.imm = cval[v];
+        instr.a = instr.b = NO_VALUE;
+        instr.args.clear();
+        ++stats.constants;
+    }
+    for (size_t b = 0; b < fn.blocks.size(); ++b) {
+        BasicBlock& block = fn.blocks[b];
+        if (!reached[b] || block.term != Terminator::Branch || state[block.cond] != CONST) continue;
+        int taken = cval[block.cond] ? block.succ[0] : block.succ[1];
+        int untaken = cval[block.cond] ? block.succ[1] : block.succ[0];
+        block.term = Terminator::Jump;
+        block.succ[0] = taken;
+        block.succ[1] = -1;
+        block.cond = NO_VALUE;
+        if (untaken != taken) {
+            const auto& preds = fn.blocks[untaken].preds;
+            auto it = find(preds.begin(), preds.end(), (int)b);
+            if (it != preds.end()) fn.removePred(untaken, it - preds.begin());
+        }
+        ++stats.branchesFolded;
+    }
+    for (size_t b = 0; b < fn.blocks.size(); ++b) {
+        BasicBlock& block = fn.blocks[b];
+        if (reached[b] || block.dead) continue;
+        for (ValueId v : block.code) fn.values[v].op = SSAOp::Nop;
+        block = BasicBlock();
+        block.dead = true;
+        ++stats.unreachableBlocks;
+    }
+    for (size_t b = 0; b < fn.blocks.size(); ++b) {
+        if (fn.blocks[b].dead) continue;
+        for (size_t i = fn.blocks[b].preds.size(); i-- > 0; ) {
+            if (fn.blocks[fn.blocks[b].preds[i]].dead) fn.removePred((int)b, i);
+        }
+    }
+    fn.removeTrivialPhis();
+    fn.applyReplacements();
+}
+
+// Reachable blocks in reverse postorder. Successors are walked last to
+// first so a branch's taken side directly follows it in the layout.
+inline vector<int> reversePostorder(const SSAFunction& fn) {
+    vector<int> order;
+    vector<bool> seen(fn.blocks.size(), false);
+    vector<pair<int, int>> stack{{0, fn.succCount(0)}}; // Block, successors left
+    seen[0] = true;
+    while (!stack.empty()) {
+        auto& [b, left] = stack.back();
+        if (left > 0) {
+            int s = fn.blocks[b].succ[--left];
+            if (!seen[s]) {
+                seen[s] = true;
+                stack.push_back({s, fn.succCount(s)});
+            }
+        } else {
+            order.push_back(b);
+            stack.pop_back();
+        }
+    }
+    reverse(order.begin(), order.end());
+    return order;
+}
+
+// Immediate dominators (Cooper, Harvey & Kennedy); -1 for unreachable blocks
+inline vector<int> computeDominators(const SSAFunction& fn, const vector<int>& rpo) {
+    vector<int> index(fn.blocks.size(), -1);
+    for (size_t i = 0; i < rpo.size(); ++i) index[rpo[i]] = (int)i;
+    vector<int> idom(fn.blocks.size(), -1);
+    idom[0] = 0;
+    auto intersect = [&](int a, int b) {
+        while (a != b) {
+            while (index[a] > index[b]) a = idom[a];
+            while (index[b] > index[a]) b = idom[b];
+        }
+        return a;
+    };
+    for (bool changed = true; changed; ) {
+        changed = false;
+        for (size_t i = 1; i < rpo.size(); ++i) {
+            int b = rpo[i];
+            int newIdom = -1;
+            for (int p : fn.blocks[b].preds) {
+                if (idom[p] == -1) continue;
+                newIdom = newIdom == -1 ? p : intersect(p, newIdom);
+            }
+            if (idom[b] != newIdom) {
+                idom[b] = newIdom;
+                changed = true;
+            }
+        }
+    }
+    return idom;
+}
+
+// Global value numbering over the dominator tree: a value computed by a
+// dominating block with the same operation and operands is reused.
+inline void runGVN(SSAFunction& fn, SSAStats& stats) {
+    vector<int> rpo = reversePostorder(fn);
+    vector<int> idom = computeDominators(fn, rpo);
+    vector<vector<int>> children(fn.blocks.size());
+    for (int b : rpo) {
+        if (b != 0) children[idom[b]].push_back(b);
+    }
+
+    using Key = tuple<SSAOp, int, int>;
+    map<Key, ValueId> table;
+    vector<pair<int, vector<Key>>> stack; // Block, keys it added
+    stack.push_back({0, {}});
+    bool entering = true;
+    vector<size_t> nextChild(fn.blocks.size(), 0);
+
+    while (!stack.empty()) {
+        int b = stack.back().first;
+        if (entering) {
+            vector<ValueId> phis;
+            for (ValueId v : fn.blocks[b].code) {
+                SSAInstr& instr = fn.values[v];
+                if (instr.op == SSAOp::Phi) {
+                    for (ValueId& arg : instr.args) arg = fn.resolve(arg);
+                    auto same = find_if(phis.begin(), phis.end(),
+                                        [&](ValueId p) { return fn.values[p].args == instr.args; });
+                    if (same != phis.end()) {
+                        fn.replace(v, *same);
+                        ++stats.redundant;
+                    } else {
+                        phis.push_back(v);
+                    }
+                    continue;
+                }
+                Key key;
+                if (instr.op == SSAOp::Const) {
+                    key = {SSAOp::Const, instr.imm, 0};
+                } else if (isBinarySSA(instr.op)) {
+                    instr.a = fn.resolve(instr.a);
+                    instr.b = fn.resolve(instr.b);
+                    bool commutative = instr.op == SSAOp::Add || instr.op == SSAOp::Mul ||
+                                       instr.op == SSAOp::Eq || instr.op == SSAOp::Ne;
+                    int a = instr.a, c = instr.b;
+                    if (commutative && a > c) swap(a, c);
+                    key = {instr.op, a, c};
+                } else {
+                    continue;
+                }
+                auto it = table.find(key);
+                if (it != table.end()) {
+                    fn.replace(v, it->second);
+                    ++stats.redundant;
+                } else {
+                    table.emplace(key, v);
+                    stack.back().second.push_back(key);
+                }
+            }
+        }
+        if (nextChild[b] < children[b].size()) {
+            stack.push_back({children[b][nextChild[b]++], {}});
+            entering = true;
+        } else {
+            for (const Key& key : stack.back().second) table.erase(key);
+            stack.pop_back();
+            entering = false;
+        }
+    }
+    fn.removeTrivialPhis();
+    fn.applyReplacements();
+}
+
+// Loop-invariant code motion: non-trapping values in a loop whose operands
+// are all defined outside it move to the loop's preheader. Loops are
+// handled innermost first, so values can climb several levels.
+inline void runLICM(SSAFunction& fn, SSAStats& stats) {
+    for (const SSALoop& loop : fn.loops) {
+        const BasicBlock& pre = fn.blocks[loop.preheader];
+        if (fn.blocks[loop.header].dead || pre.dead || pre.term != Terminator::Jump ||
+            pre.succ[0] != loop.header) {
+            continue;
+        }
+        vector<bool> inLoop(fn.blocks.size(), false);
+        inLoop[loop.header] = true;
+        vector<int> work;
+        for (int p : fn.blocks[loop.header].preds) {
+            if (p != loop.preheader) work.push_back(p);
+        }
+        while (!work.empty()) {
+            int b = work.back();
+            work.pop_back();
+            if (inLoop[b]) continue;
+            inLoop[b] = true;
+            for (int p : fn.blocks[b].preds) work.push_back(p);
+        }
+
+        auto definedOutside = [&](ValueId v) { return !inLoop[fn.values[v].block]; };
+        for (bool changed = true; changed; ) {
+            changed = false;
+            for (size_t b = 0; b < fn.blocks.size(); ++b) {
+                if (!inLoop[b]) continue;
+                auto& code = fn.blocks[b].code;
+                for (size_t i = 0; i < code.size(); ) {
+                    ValueId v = code[i];
+                    const SSAInstr& instr = fn.values[v];
+                    bool invariant = instr.op == SSAOp::Const ||
+                                     (isBinarySSA(instr.op) && isSafeSSA(fn, instr) &&
+                                      definedOutside(instr.a) && definedOutside(instr.b));
+                    if (!invariant) {
+                        ++i;
+                        continue;
+                    }
+                    code.erase(code.begin() + i);
+                    fn.blocks[loop.preheader].code.push_back(v);
+                    fn.values[v].block = loop.preheader;
+                    ++stats.hoisted;
+                    changed = true;
+                }
+            }
+        }
+    }
+}
+
+// Remove values that nothing observable depends on. Prints, branch
+// conditions and divisions that may trap are the roots.
+inline void removeDeadValues(SSAFunction& fn, SSAStats& stats) {
+    vector<bool> live(fn.values.size(), false);
+    vector<ValueId> work;
+    auto mark = [&](ValueId v) {
+        if (v != NO_VALUE && !live[v]) {
+            live[v] = true;
+            work.push_back(v);
+        }
+    };
+    for (const auto& block : fn.blocks) {
+        if (block.dead) continue;
+        if (block.term == Terminator::Branch) mark(block.cond);
+        for (ValueId v : block.code) {
+            const SSAInstr& instr = fn.values[v];
+            if (instr.op == SSAOp::Print || (isBinarySSA(instr.op) && !isSafeSSA(fn, instr))) mark(v);
+        }
+    }
+    while (!work.empty()) {
+        const SSAInstr& instr = fn.values[work.back()];
+        work.pop_back();
+        mark(instr.a);
+        mark(instr.b);
+        for (ValueId arg : instr.args) mark(arg);
+    }
+    for (auto& block : fn.blocks) {
+        for (ValueId v : block.code) {
+            if (live[v]) continue;
+            fn.values[v].op = SSAOp::Nop;
+            ++stats.deadValues;
+        }
+    }
+    fn.applyReplacements();
+}
+
+inline SSAStats optimizeSSA(SSAFunction& fn) {
+    SSAStats stats;
+    runSCCP(fn, stats);
+    runGVN(fn, stats);
+    runLICM(fn, stats);
+    removeDeadValues(fn, stats);
+    return stats;
+}
+
+// Give every edge from a multi-successor block into a block with phis its
+// own block, so phi copies have a place that runs only on that edge
+inline void splitCriticalEdges(SSAFunction& fn) {
+    size_t count = fn.blocks.size();
+    for (size_t b = 0; b < count; ++b) {
+        if (fn.blocks[b].dead || fn.blocks[b].term != Terminator::Branch) continue;
+        for (int k = 0; k < 2; ++k) {
+            int s = fn.blocks[b].succ[k];
+            bool hasPhis = any_of(fn.blocks[s].code.begin(), fn.blocks[s].code.end(),
+                                  [&](ValueId v) { return fn.values[v].op == SSAOp::Phi; });
+            if (fn.blocks[s].preds.size() < 2 || !hasPhis) continue;
+            int split = (int)fn.blocks.size();
+            fn.blocks.emplace_back();
+            fn.blocks[split].preds.push_back((int)b);
+            fn.blocks[split].term = Terminator::Jump;
+            fn.blocks[split].succ[0] = s;
+            fn.blocks[b].succ[k] = split;
+            auto& preds = fn.blocks[s].preds;
+            *find(preds.begin(), preds.end(), (int)b) = split;
+        }
+    }
+}
+
+// Out of SSA onto the register VM: one register per value, phis become
+// parallel copies at the end of each predecessor
+inline RegProgram lowerToRegisters(SSAFunction& fn) {
+    splitCriticalEdges(fn);
+    vector<int> order = reversePostorder(fn);
+
+    // Coalesce a value into the phi it feeds when it is computed in the
+    // predecessor, used only by that phi, and the phi's old value is dead
+    // from there on; the copy then disappears.
+    vector<int> useCount(fn.values.size(), 0);
+    for (int b : order) {
+        const BasicBlock& block = fn.blocks[b];
+        if (block.term == Terminator::Branch) ++useCount[block.cond];
+        for (ValueId v : block.code) {
+            const SSAInstr& instr = fn.values[v];
+            if (instr.a != NO_VALUE) ++useCount[instr.a];
+            if (instr.b != NO_VALUE) ++useCount[instr.b];
+            for (ValueId arg : instr.args) ++useCount[arg];
+        }
+    }
+    vector<ValueId> coalesced(fn.values.size(), NO_VALUE); // Value -> phi sharing its register
+    for (int s : order) {
+        const BasicBlock& target = fn.blocks[s];
+        for (size_t i = 0; i < target.preds.size(); ++i) {
+            const BasicBlock& pred = fn.blocks[target.preds[i]];
+            for (ValueId phi : target.code) {
+                const SSAInstr& p = fn.values[phi];
+                if (p.op != SSAOp::Phi) continue;
+                ValueId v = p.args[i];
+                const SSAInstr& def = fn.values[v];
+                if (def.block != target.preds[i] || !isBinarySSA(def.op) || useCount[v] != 1) continue;
+                // The phi's value must not be read after v is defined, by
+                // the predecessor or by the other copies on this edge
+                auto at = find(pred.code.begin(), pred.code.end(), v);
+                bool phiRead = any_of(at + 1, pred.code.end(), [&](ValueId u) {
+                    return fn.values[u].a == phi || fn.values[u].b == phi;
+                });
+                for (ValueId other : target.code) {
+                    if (fn.values[other].op == SSAOp::Phi && fn.values[other].args[i] == phi) phiRead = true;
+                }
+                if (!phiRead) coalesced[v] = phi;
+            }
+        }
+    }
+
+    vector<int> reg(fn.values.size(), -1);
+    int registers = 0;
+    for (int b : order) {
+        for (ValueId v : fn.blocks[b].code) {
+            if (fn.values[v].op != SSAOp::Print && coalesced[v] == NO_VALUE) reg[v] = registers++;
+        }
+    }
+    for (ValueId v = 0; v < (ValueId)fn.values.size(); ++v) {
+        if (coalesced[v] != NO_VALUE) reg[v] = reg[coalesced[v]];
+    }
+    const int scratch = registers++; // Breaks cycles in parallel copies
+    if (registers > UINT16_MAX) throw runtime_error("Too many registers");
+
+    auto isConst = [&](ValueId v) { return fn.values[v].op == SSAOp::Const; };
+    // Operand folded into ADDI/SUBI: 2 = b, 1 = a (add only), 0 = none
+    auto immediateOperand = [&](const SSAInstr& instr) {
+        if (instr.op == SSAOp::Add || instr.op == SSAOp::Sub) {
+            if (isConst(instr.b)) return 2;
+            if (instr.op == SSAOp::Add && isConst(instr.a)) return 1;
+        }
+        return 0;
+    };
+
+    // Constants only need a LOADI if some use reads them from a register
+    vector<bool> materialize(fn.values.size(), false);
+    for (int b : order) {
+        const BasicBlock& block = fn.blocks[b];
+        if (block.term == Terminator::Branch) materialize[block.cond] = true;
+        for (ValueId v : block.code) {
+            const SSAInstr& instr = fn.values[v];
+            if (instr.op == SSAOp::Print) materialize[instr.a] = true;
+            if (isBinarySSA(instr.op)) {
+                int imm = immediateOperand(instr);
+                if (imm != 1) materialize[instr.a] = true;
+                if (imm != 2) materialize[instr.b] = true;
+            }
+        }
+    }
+
+    RegProgram prog;
+    auto& code = prog.code;
+    auto emit = [&](RegOp op, int a, int b = 0, int c = 0, int imm = 0) {
+        code.push_back({op, (uint16_t)a, (uint16_t)b, (uint16_t)c, imm});
+    };
+
+    auto emitPhiCopies = [&](int from, int to) {
+        const BasicBlock& target = fn.blocks[to];
+        size_t index = find(target.preds.begin(), target.preds.end(), from) - target.preds.begin();
+        vector<pair<int, int>> moves;     // dst <- src register
+        vector<pair<int, int>> constants; // dst <- imm
+        for (ValueId v : target.code) {
+            const SSAInstr& instr = fn.values[v];
+            if (instr.op != SSAOp::Phi) continue;
+            ValueId src = instr.args[index];
+            if (isConst(src)) constants.push_back({reg[v], fn.values[src].imm});
+            else if (reg[src] != reg[v]) moves.push_back({reg[v], reg[src]});
+        }
+        while (!moves.empty()) {
+            auto ready = find_if(moves.begin(), moves.end(), [&](const pair<int, int>& m) {
+                return none_of(moves.begin(), moves.end(), [&](const pair<int, int>& o) { return o.second == m.first; });
+            });
+            if (ready == moves.end()) {
+                // Every destination is still read by another move: save one
+                int saved = moves.front().first;
+                emit(RegOp::MOV, scratch, saved);
+                for (auto& m : moves) {
+                    if (m.second == saved) m.second = scratch;
+                }
+                continue;
+            }
+            emit(RegOp::MOV, ready->first, ready->second);
+            moves.erase(ready);
+        }
+        for (auto [dst, imm] : constants) emit(RegOp::LOADI, dst, 0, 0, imm);
+    };
+
+    vector<int> start(fn.blocks.size(), -1);
+    vector<pair<size_t, int>> fixups; // Instruction -> target block (-1 = end)
+    for (size_t i = 0; i < order.size(); ++i) {
+        int b = order[i];
+        int next = i + 1 < order.size() ? order[i + 1] : -1;
+        const BasicBlock& block = fn.blocks[b];
+        start[b] = (int)code.size();
+        for (ValueId v : block.code) {
+            const SSAInstr& instr = fn.values[v];
+            switch (instr.op) {
+                case SSAOp::Phi: break;
+                case SSAOp::Const:
+                    if (materialize[v]) emit(RegOp::LOADI, reg[v], 0, 0, instr.imm);
+                    break;
+                case SSAOp::Print: emit(RegOp::PRINT, reg[instr.a]); break;
+                case SSAOp::Nop: break;
+                default: {
+                    int imm = immediateOperand(instr);
+                    if (imm == 2) {
+                        emit(instr.op == SSAOp::Add ? RegOp::ADDI : RegOp::SUBI, reg[v], reg[instr.a], 0,
+                             fn.values[instr.b].imm);
+                    } else if (imm == 1) {
+                        emit(RegOp::ADDI, reg[v], reg[instr.b], 0, fn.values[instr.a].imm);
+                    } else {
+                        static const RegOp ops[] = {RegOp::ADD, RegOp::SUB, RegOp::MUL, RegOp::DIV, RegOp::EQ,
+                                                    RegOp::NE, RegOp::LT, RegOp::GT, RegOp::LE, RegOp::GE};
+                        emit(ops[(int)instr.op - (int)SSAOp::Add], reg[v], reg[instr.a], reg[instr.b]);
+                    }
+                    break;
+                }
+            }
+        }
+        switch (block.term) {
+            case Terminator::Jump:
+                emitPhiCopies(b, block.succ[0]);
+                if (block.succ[0] != next) {
+                    fixups.push_back({code.size(), block.succ[0]});
+                    emit(RegOp::JMP, 0);
+                }
+                break;
+            case Terminator::Branch:
+                fixups.push_back({code.size(), block.succ[1]});
+                emit(RegOp::JZ, reg[block.cond]);
+                if (block.succ[0] != next) {
+                    fixups.push_back({code.size(), block.succ[0]});
+                    emit(RegOp::JMP, 0);
+                }
+                break;
+            case Terminator::Exit:
+                if (next != -1) {
+                    fixups.push_back({code.size(), -1});
+                    emit(RegOp::JMP, 0);
+                }
+                break;
+        }
+    }
+    for (auto [at, target] : fixups) {
+        code[at].imm = target >= 0 ? start[target] : (int)code.size();
+    }
+    prog.registerCount = registers;
+    return prog;
+}
+
+// AST -> SSA -> optimized SSA -> register IR
+inline RegProgram compileSSA(const AST& ast, SSAStats* stats = nullptr) {
+    SSAFunction fn = buildSSA(ast);
+    SSAStats s = optimizeSSA(fn);
+    if (stats) *stats = s;
+    return lowerToRegisters(fn);
+}
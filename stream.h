@@ -0,0 +1,114 @@
+#pragma once
+#include <algorithm>
+#include <istream>
+#include <string>
+#include <vector>
+#include "lexer.h"
+using namespace std;
+
+// Splits a script read from a stream into its top-level statements, for
+// inputs too large to hold in memory. The input is read in fixed-size
+// blocks and only complete lines are lexed, since no token spans a line
+// break. A statement ends at a `;` or `}` that leaves no brace open, unless
+// the next token is `else`.
+//
+// Memory is bounded by the largest statement: the buffer holds the
+// unconsumed text and one block, and the token vector one lexed batch.
+// A statement that runs past a batch is lexed again with the next one; the
+// block size grows with the pending text, so that stays linear.
+class StatementStream {
+public:
+    explicit StatementStream(istream& in, size_t blockSize = 1 << 16) : in(in), blockSize(blockSize) {}
+
+    // The next top-level statement's tokens (with any comments before it).
+    // Their text stays valid until the next call. False at the end of input.
+    bool next(vector<Token>& statement) {
+        for (;;) {
+            size_t end;
+            if (findEnd(end)) {
+                statement.assign(tokens.begin() + cursor, tokens.begin() + end);
+                cursor = end;
+                return true;
+            }
+            if (atEnd) {
+                // Whatever is left does not end a statement; the parser reports it
+                statement.assign(tokens.begin() + cursor, tokens.end());
+                cursor = tokens.size();
+                return !statement.empty();
+            }
+            refill();
+        }
+    }
+
+    // Largest amount of text buffered at once, in bytes
+    size_t peakBuffered() const { return peak; }
+
+private:
+    istream& in;
+    size_t blockSize;
+    string buffer;         // Text from the first unconsumed token on
+    size_t lexedEnd = 0;   // Bytes of buffer covered by tokens
+    int nextLine = 1;      // Line number at lexedEnd
+    vector<Token> tokens;  // Views into buffer
+    size_t cursor = 0;     // First token not yet returned
+    bool atEnd = false;    // Input exhausted and fully lexed
+    size_t peak = 0;
+
+    // Finds the end of the statement starting at cursor; false if the lexed
+    // tokens do not reach it yet
+    bool findEnd(size_t& end) const {
+        int depth = 0;
+        for (size_t i = cursor; i < tokens.size(); ++i) {
+            TokenKind kind = tokens[i].kind;
+            if (kind == TokenKind::LBRACE) ++depth;
+            else if (kind == TokenKind::RBRACE) --depth;
+            else if (kind != TokenKind::SEMICOLON) continue;
+            if (depth > 0) continue;
+            // An `else` continues the statement; comments in between belong to it
+            size_t j = i + 1;
+            while (j < tokens.size() && tokens[j].kind == TokenKind::COMMENT) ++j;
+            if (j == tokens.size() && !atEnd) return false;
+            if (j < tokens.size() && tokens[j].kind == TokenKind::KW_ELSE) {
+                i = j;
+                continue;
+            }
+            end = i + 1;
+            return true;
+        }
+        return false;
+    }
+
+    // Drops the consumed text, reads at least one more line and lexes from
+    // the first unconsumed token
+    void refill() {
+        size_t keep = lexedEnd;
+        int line = nextLine;
+        if (cursor < tokens.size()) {
+            keep = (size_t)(tokens[cursor].value.data() - buffer.data());
+            line = tokens[cursor].lineNumber;
+        }
+        size_t lexedKept = lexedEnd - keep;
+        tokens.clear();
+        cursor = 0;
+        buffer.erase(0, keep);
+
+        size_t complete = string::npos;
+        bool eof = false;
+        while (!eof) {
+            size_t old = buffer.size();
+            buffer.resize(old + max(blockSize, old));
+            in.read(&buffer[old], (streamsize)(buffer.size() - old));
+            buffer.resize(old + (size_t)in.gcount());
+            eof = !in;
+            complete = buffer.rfind('\n');
+            if (complete != string::npos && complete >= lexedKept) break;
+        }
+        peak = max(peak, buffer.size());
+
+        lexedEnd = eof ? buffer.size() : complete + 1;
+        string_view text(buffer.data(), lexedEnd);
+        tokens = tokenize(text, line);
+        nextLine = line + (int)count(text.begin(), text.end(), '\n');
+        atEnd = eof;
+    }
+};
@@ -0,0 +1,5 @@
+a = 10;
+b = a - 10;
+print a / 2;
+print a / b;
+print a;
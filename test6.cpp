@@ -0,0 +1,14 @@
+x = 0;
+i = 0;
+s = 0;
+while (i < 0) {
+    q = 100 / x;
+    s = s + q;
+}
+while (i < 3) {
+    s = s + i;
+    i = i + 1;
+}
+print s;
+d = s / x;
+print 1;
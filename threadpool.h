@@ -0,0 +1,129 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+using namespace std;
+
+// Work-stealing thread pool. Each worker owns a deque: it pops its own work
+// from the back and, when that is empty, steals from the front of the other
+// workers' deques. Tasks submitted from outside the pool are spread
+// round-robin. Tasks must not throw.
+class ThreadPool {
+public:
+    explicit ThreadPool(size_t threads = defaultThreads()) {
+        if (threads == 0) threads = 1;
+        for (size_t i = 0; i < threads; ++i) queues.push_back(make_unique<WorkQueue>());
+        for (size_t i = 0; i < threads; ++i) workers.emplace_back([this, i] { workerLoop(i); });
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // Runs every task already submitted, then joins the workers
+    ~ThreadPool() {
+        {
+            lock_guard<mutex> lock(sleepMutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& worker : workers) worker.join();
+    }
+
+    static size_t defaultThreads() {
+        size_t n = thread::hardware_concurrency();
+        return n ? n : 1;
+    }
+
+    size_t size() const { return workers.size(); }
+
+    void submit(function<void()> task) {
+        WorkQueue& q = *queues[next++ % queues.size()];
+        {
+            lock_guard<mutex> lock(q.m);
+            q.tasks.push_back(std::move(task));
+        }
+        {
+            // Counted under sleepMutex so a worker about to sleep sees it
+            lock_guard<mutex> lock(sleepMutex);
+            ++queued;
+        }
+        wake.notify_one();
+    }
+
+private:
+    struct WorkQueue {
+        mutex m;
+        deque<function<void()>> tasks;
+    };
+
+    vector<unique_ptr<WorkQueue>> queues;
+    vector<thread> workers;
+    atomic<size_t> next{0};
+    atomic<size_t> queued{0};
+    mutex sleepMutex;
+    condition_variable wake;
+    bool stopping = false;
+
+    bool popLocal(size_t self, function<void()>& task) {
+        WorkQueue& q = *queues[self];
+        lock_guard<mutex> lock(q.m);
+        if (q.tasks.empty()) return false;
+        task = std::move(q.tasks.back());
+        q.tasks.pop_back();
+        return true;
+    }
+
+    bool steal(size_t self, function<void()>& task) {
+        for (size_t k = 1; k < queues.size(); ++k) {
+            WorkQueue& q = *queues[(self + k) % queues.size()];
+            lock_guard<mutex> lock(q.m);
+            if (q.tasks.empty()) continue;
+            task = std::move(q.tasks.front());
+            q.tasks.pop_front();
+            return true;
+        }
+        return false;
+    }
+
+    void workerLoop(size_t self) {
+        function<void()> task;
+        while (true) {
+            if (popLocal(self, task) || steal(self, task)) {
+                --queued;
+                task();
+                task = nullptr;
+                continue;
+            }
+            unique_lock<mutex> lock(sleepMutex);
+            wake.wait(lock, [&] { return stopping || queued > 0; });
+            if (stopping && queued == 0) return;
+        }
+    }
+};
+
+// Lets a caller wait for a batch of tasks on a pool that keeps running:
+// each task calls countDown() as its last step
+class TaskLatch {
+public:
+    explicit TaskLatch(size_t count) : left(count) {}
+
+    void countDown() {
+        lock_guard<mutex> lock(m);
+        if (--left == 0) done.notify_all();
+    }
+
+    void wait() {
+        unique_lock<mutex> lock(m);
+        done.wait(lock, [this] { return left == 0; });
+    }
+
+private:
+    mutex m;
+    condition_variable done;
+    size_t left;
+};
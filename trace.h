@@ -0,0 +1,48 @@
+#pragma once
+#include <functional>
+#include <iostream>
+#include <string>
+using namespace std;
+
+// Compile-time trace policies. Engines are instantiated once per policy, so
+// the quiet build carries no tracing code at all.
+struct QuietTrace {
+    static constexpr bool enabled = false;
+};
+
+struct VerboseTrace {
+    static constexpr bool enabled = true;
+};
+
+// Buffered sink for `print` output. Either formats values as text onto a
+// stream, or hands each value to a callback (for embedding hosts).
+class OutputWriter {
+public:
+    explicit OutputWriter(ostream& os = cout) : os(&os) { buffer.reserve(Capacity); }
+    explicit OutputWriter(function<void(int)> sink) : os(nullptr), sink(std::move(sink)) {}
+    ~OutputWriter() { flush(); }
+
+    void print(int value) {
+        if (!os) {
+            sink(value);
+            return;
+        }
+        buffer += "print: ";
+        buffer += to_string(value);
+        buffer += '\n';
+        if (buffer.size() >= Capacity) flush();
+    }
+
+    void flush() {
+        if (buffer.empty()) return;
+        os->write(buffer.data(), buffer.size());
+        os->flush();
+        buffer.clear();
+    }
+
+private:
+    static constexpr size_t Capacity = 1 << 16;
+    ostream* os;
+    function<void(int)> sink;
+    string buffer;
+};
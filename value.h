@@ -0,0 +1,183 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+#include <stdexcept>
+using namespace std;
+
+// 64-bit tagged value shared by the interpreter and the stack VM (NaN
+// boxing). A double is stored as itself; every other type lives in the
+// payload of a negative quiet NaN, which no double produced here ever uses
+// because NaNs are canonicalized on the way in:
+//
+//   bits 63..48   tag      0xFFF9 int, 0xFFFA bool, 0xFFFC object
+//   bits 47..0    payload  int and bool: zero-extended 32 bits;
+//                          object: a heap pointer (48-bit address space)
+//
+// Type checks are a shift and a compare. Ints and bools keep their value in
+// the low 32 bits, so reading either as an int is a plain truncation.
+class Value {
+public:
+    enum class Type : uint8_t { Int, Bool, Double, Object };
+
+    Value() : bits(INT_TAG) {} // Int 0
+
+    static Value fromInt(int value) { return Value(INT_TAG | (uint32_t)value); }
+    static Value fromBool(bool value) { return Value(BOOL_TAG | (uint64_t)value); }
+    static Value fromDouble(double value) {
+        uint64_t raw;
+        memcpy(&raw, &value, sizeof raw);
+        if (value != value) raw = CANONICAL_NAN;
+        return Value(raw);
+    }
+    static Value fromObject(const void* object) {
+        return Value(OBJECT_TAG | ((uint64_t)(uintptr_t)object & PAYLOAD_MASK));
+    }
+
+    Type type() const {
+        if (isDouble()) return Type::Double;
+        return tag() == INT_TAG >> 48 ? Type::Int : tag() == BOOL_TAG >> 48 ? Type::Bool : Type::Object;
+    }
+    bool isInt() const { return tag() == INT_TAG >> 48; }
+    bool isBool() const { return tag() == BOOL_TAG >> 48; }
+    bool isDouble() const { return tag() < INT_TAG >> 48; }
+    bool isObject() const { return tag() == OBJECT_TAG >> 48; }
+    // Both operands are ints: one AND, shift and compare. No double has the
+    // int tag's bits set and the other tags each clear one of them.
+    static bool bothInt(Value a, Value b) { return ((a.bits & b.bits) >> 48) == INT_TAG >> 48; }
+
+    // Unchecked payload accessors; the caller knows the type
+    int asInt() const { return (int32_t)(uint32_t)bits; }
+    bool asBool() const { return (bits & 1) != 0; }
+    double asDouble() const {
+        double value;
+        memcpy(&value, &bits, sizeof value);
+        return value;
+    }
+    void* asObject() const { return (void*)(uintptr_t)(bits & PAYLOAD_MASK); }
+
+    // Numeric conversions used by print and arithmetic: bools count as 0
+    // and 1, doubles truncate. Objects have no numeric value.
+    int toInt() const {
+        if (!isDouble() && !isObject()) return asInt();
+        if (isDouble()) return (int)asDouble();
+        throw runtime_error("Value is not a number");
+    }
+    double toDouble() const { return isDouble() ? asDouble() : (double)toInt(); }
+
+    // Conditions: zero, false and 0.0 are false; objects are true
+    bool truthy() const { return isDouble() ? asDouble() != 0.0 : (bits & PAYLOAD_MASK) != 0; }
+
+    uint64_t raw() const { return bits; }
+
+private:
+    static constexpr uint64_t INT_TAG = 0xFFF9ull << 48;
+    static constexpr uint64_t BOOL_TAG = 0xFFFAull << 48;
+    static constexpr uint64_t OBJECT_TAG = 0xFFFCull << 48;
+    static constexpr uint64_t PAYLOAD_MASK = (1ull << 48) - 1;
+    static constexpr uint64_t CANONICAL_NAN = 0x7FF8ull << 48;
+
+    uint64_t bits;
+
+    explicit Value(uint64_t raw) : bits(raw) {}
+    uint64_t tag() const { return bits >> 48; }
+};
+
+static_assert(sizeof(Value) == 8, "Value must stay one machine word");
+
+inline ostream& operator<<(ostream& os, Value value) {
+    switch (value.type()) {
+        case Value::Type::Int: return os << value.asInt();
+        case Value::Type::Bool: return os << (value.asBool() ? "true" : "false");
+        case Value::Type::Double: return os << value.asDouble();
+        case Value::Type::Object: return os << "<object " << value.asObject() << ">";
+    }
+    return os;
+}
+
+enum class ArithOp : uint8_t { Add, Sub, Mul, Div };
+enum class CompareOp : uint8_t { Eq, Ne, Lt, Gt, Le, Ge };
+
+// 32-bit division as every engine runs it: zero divisors and INT_MIN / -1
+// are errors rather than traps
+inline int divideInt(int l, int r) {
+    if (r == 0) throw runtime_error("Division by zero");
+    if (l == INT32_MIN && r == -1) throw runtime_error("Division overflow");
+    return l / r;
+}
+
+// Mixed or non-int operands: bools take part as 0 and 1, a double operand
+// makes the result a double
+[[gnu::noinline]] inline Value arithmeticSlow(ArithOp op, Value a, Value b) {
+    if (a.isObject() || b.isObject()) throw runtime_error("Arithmetic on a non-numeric value");
+    if (a.isDouble() || b.isDouble()) {
+        double x = a.toDouble(), y = b.toDouble();
+        switch (op) {
+            case ArithOp::Add: return Value::fromDouble(x + y);
+            case ArithOp::Sub: return Value::fromDouble(x - y);
+            case ArithOp::Mul: return Value::fromDouble(x * y);
+            case ArithOp::Div: return Value::fromDouble(x / y);
+        }
+    }
+    unsigned x = (unsigned)a.asInt(), y = (unsigned)b.asInt();
+    switch (op) {
+        case ArithOp::Add: return Value::fromInt((int)(x + y));
+        case ArithOp::Sub: return Value::fromInt((int)(x - y));
+        case ArithOp::Mul: return Value::fromInt((int)(x * y));
+        case ArithOp::Div: break;
+    }
+    return Value::fromInt(divideInt(a.asInt(), b.asInt()));
+}
+
+// Int arithmetic wraps at 32 bits, the semantics of the optimizer's folding,
+// the register VM and the JIT; computing it unsigned keeps it free of
+// undefined behaviour. Division by zero and INT_MIN / -1 are run-time
+// errors. `op` is a constant at every call site, so only its case remains.
+inline Value arithmetic(ArithOp op, Value a, Value b) {
+    if (Value::bothInt(a, b)) {
+        unsigned x = (unsigned)a.asInt(), y = (unsigned)b.asInt();
+        switch (op) {
+            case ArithOp::Add: return Value::fromInt((int)(x + y));
+            case ArithOp::Sub: return Value::fromInt((int)(x - y));
+            case ArithOp::Mul: return Value::fromInt((int)(x * y));
+            case ArithOp::Div:
+                if (b.asInt() != 0 && b.asInt() != -1) return Value::fromInt(a.asInt() / b.asInt());
+                break;
+        }
+    }
+    return arithmeticSlow(op, a, b);
+}
+
+[[gnu::noinline]] inline bool compareSlow(CompareOp op, Value a, Value b) {
+    if (a.isObject() || b.isObject()) {
+        // Objects only compare for identity
+        if (op == CompareOp::Eq) return a.raw() == b.raw();
+        if (op == CompareOp::Ne) return a.raw() != b.raw();
+        throw runtime_error("Comparison of a non-numeric value");
+    }
+    double x = a.toDouble(), y = b.toDouble();
+    switch (op) {
+        case CompareOp::Eq: return x == y;
+        case CompareOp::Ne: return x != y;
+        case CompareOp::Lt: return x < y;
+        case CompareOp::Gt: return x > y;
+        case CompareOp::Le: return x <= y;
+        case CompareOp::Ge: return x >= y;
+    }
+    return false;
+}
+
+inline bool compare(CompareOp op, Value a, Value b) {
+    if (Value::bothInt(a, b)) {
+        int x = a.asInt(), y = b.asInt();
+        switch (op) {
+            case CompareOp::Eq: return x == y;
+            case CompareOp::Ne: return x != y;
+            case CompareOp::Lt: return x < y;
+            case CompareOp::Gt: return x > y;
+            case CompareOp::Le: return x <= y;
+            case CompareOp::Ge: return x >= y;
+        }
+    }
+    return compareSlow(op, a, b);
+}